@@ -0,0 +1,42 @@
+# Deterministic synthetic corpora: the same seed always gives the same
+# documents, so numbers from different builds can be compared.
+module Corpus
+  SYLLABLES = %w[ka ki ku ke ko sa shi su se so ta chi tsu te to na ni nu ne no
+                 ha hi fu he ho ma mi mu me mo ya yu yo ra ri ru re ro wa n]
+
+  # Kanji and hiragana from the most common blocks.
+  CJK = (0x4e00...0x4e00 + 2000).map { |c| c.chr(Encoding::UTF_8) } +
+        (0x3041..0x3093).map { |c| c.chr(Encoding::UTF_8) }
+
+  module_function
+
+  def ascii_word(rng)
+    Array.new(1 + rng.rand(4)) { SYLLABLES[rng.rand(SYLLABLES.size)] }.join
+  end
+
+  def ascii_words(n, seed)
+    rng = Random.new(seed)
+    Array.new(n) { ascii_word(rng) }
+  end
+
+  # n documents of whitespace-separated ASCII words.
+  def ascii(n, seed = 1, words: 40)
+    rng = Random.new(seed)
+    Array.new(n) { Array.new(words) { ascii_word(rng) }.join(' ') }
+  end
+
+  # n documents of unspaced CJK text, skewed towards the first characters
+  # the way real text is.
+  def cjk(n, seed = 2, chars: 120)
+    rng = Random.new(seed)
+    Array.new(n) do
+      Array.new(chars) { CJK[(rng.rand**3 * CJK.size).to_i] }.join
+    end
+  end
+
+  # n documents as token lists, for JDB#put and WDB#put.
+  def tokens(n, seed = 3, words: 40)
+    rng = Random.new(seed)
+    Array.new(n) { Array.new(words) { ascii_word(rng) } }
+  end
+end
@@ -0,0 +1,52 @@
+# Timing and reporting for bench/run.rb.
+module Harness
+  module_function
+
+  def clock
+    Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  end
+
+  def allocations
+    GC.stat(:total_allocated_objects)
+  end
+
+  # Run the block once per input and report ops/sec, p50/p99 latency and
+  # objects allocated per call.
+  def measure(label, inputs)
+    lat = Array.new(inputs.size)
+    a0 = allocations
+    t0 = clock
+    inputs.each_with_index do |input, i|
+      s = clock
+      yield input
+      lat[i] = clock - s
+    end
+    total = clock - t0
+    allocs = allocations - a0
+    report(label, inputs.size, total, lat.sort!, allocs)
+  end
+
+  # Time a single call, for sync and optimize.
+  def once(label)
+    a0 = allocations
+    t0 = clock
+    yield
+    total = clock - t0
+    report(label, 1, total, [total], allocations - a0)
+  end
+
+  def percentile(sorted, q)
+    sorted[[(sorted.size * q).ceil - 1, 0].max]
+  end
+
+  def header
+    printf "%-36s %10s %12s %10s %10s %10s\n",
+           'benchmark', 'ops', 'ops/sec', 'p50 us', 'p99 us', 'allocs/op'
+  end
+
+  def report(label, n, total, sorted, allocs)
+    printf "%-36s %10d %12.0f %10.1f %10.1f %10.1f\n",
+           label, n, n / (total / 1e9), percentile(sorted, 0.50) / 1e3,
+           percentile(sorted, 0.99) / 1e3, allocs.fdiv(n)
+  end
+end
@@ -0,0 +1,126 @@
+# Benchmarks for every database class.  Run with `rake bench`.
+#
+#   BENCH_N        documents per corpus (default 20000)
+#   BENCH_QUERIES  searches per mode (default 2000)
+#   BENCH_CLASSES  comma-separated subset of IDB,QDB,JDB,WDB
+#   BENCH_DIR      where the databases go (default a temporary directory)
+
+require 'tokyodystopia'
+require 'tmpdir'
+require 'fileutils'
+require_relative 'corpus'
+require_relative 'harness'
+
+include TokyoDystopia
+
+N = Integer(ENV['BENCH_N'] || 20_000)
+QUERIES = Integer(ENV['BENCH_QUERIES'] || 2_000)
+CLASSES = (ENV['BENCH_CLASSES'] || 'IDB,QDB,JDB,WDB').split(',')
+
+def open_db(klass, dir, name)
+  db = klass.new
+  db.open(File.join(dir, name), klass::WRITER | klass::CREAT | klass::TRUNC)
+  db
+end
+
+# Query words drawn from the corpus itself, so most of them hit.
+def sample_words(docs, n, seed)
+  rng = Random.new(seed)
+  Array.new(n) do
+    doc = docs[rng.rand(docs.size)]
+    doc = doc.split(' ') if doc.is_a?(String) && doc.include?(' ')
+    if doc.is_a?(Array)
+      doc[rng.rand(doc.size)]
+    else
+      doc[rng.rand(doc.size - 3), 2 + rng.rand(2)]
+    end
+  end
+end
+
+def search2_exprs(words)
+  words.each_slice(2).flat_map do |a, b|
+    b ||= a
+    ["#{a} && #{b}", "#{a} || #{b}", "#{a} !! #{b}"]
+  end
+end
+
+def bench_modes(name, db, words, modes)
+  modes.each do |mode|
+    Harness.measure("#{name} search #{mode}", words) do |w|
+      db.search(w, db.class.const_get(mode))
+    end
+  end
+end
+
+def bench_common(name, db)
+  Harness.once("#{name} sync") { db.sync }
+  Harness.once("#{name} optimize") { db.optimize }
+end
+
+def with_dir
+  if ENV['BENCH_DIR']
+    FileUtils.mkdir_p(ENV['BENCH_DIR'])
+    yield ENV['BENCH_DIR']
+  else
+    Dir.mktmpdir('tdbench') { |dir| yield dir }
+  end
+end
+
+ascii = Corpus.ascii(N)
+cjk = Corpus.cjk(N)
+tokens = Corpus.tokens(N)
+ids = (1..N).to_a
+
+puts "TokyoDystopia #{TokyoDystopia::VERSION}, ruby #{RUBY_VERSION}, #{N} documents"
+Harness.header
+
+with_dir do |dir|
+  if CLASSES.include?('IDB')
+    [['ascii', ascii], ['cjk', cjk]].each do |kind, docs|
+      db = open_db(IDB, dir, "idb-#{kind}")
+      Harness.measure("IDB put #{kind}", ids) { |id| db.put(id, docs[id - 1]) }
+      words = sample_words(docs, QUERIES, 10)
+      bench_modes("IDB #{kind}", db, words,
+                  %w[SUBSTR PREFIX SUFFIX FULL TOKEN TOKPRE TOKSUF])
+      Harness.measure("IDB #{kind} search2", search2_exprs(words)) { |e| db.search2(e) }
+      bench_common("IDB #{kind}", db)
+      db.close
+    end
+  end
+
+  if CLASSES.include?('QDB')
+    [['ascii', ascii], ['cjk', cjk]].each do |kind, docs|
+      db = open_db(QDB, dir, "qdb-#{kind}")
+      Harness.measure("QDB put #{kind}", ids) { |id| db.put(id, docs[id - 1]) }
+      words = sample_words(docs, QUERIES, 11)
+      bench_modes("QDB #{kind}", db, words, %w[SUBSTR PREFIX SUFFIX FULL])
+      bench_common("QDB #{kind}", db)
+      db.close
+    end
+  end
+
+  if CLASSES.include?('JDB')
+    db = open_db(JDB, dir, 'jdb')
+    Harness.measure('JDB put tokens', ids) { |id| db.put(id, tokens[id - 1]) }
+    db2 = open_db(JDB, dir, 'jdb2')
+    Harness.measure('JDB put2 ascii', ids) { |id| db2.put2(id, ascii[id - 1], ' ') }
+    db2.close
+    words = sample_words(tokens, QUERIES, 12)
+    bench_modes('JDB', db, words, %w[SUBSTR PREFIX SUFFIX FULL])
+    Harness.measure('JDB search2', search2_exprs(words)) { |e| db.search2(e) }
+    bench_common('JDB', db)
+    db.close
+  end
+
+  if CLASSES.include?('WDB')
+    db = open_db(WDB, dir, 'wdb')
+    Harness.measure('WDB put tokens', ids) { |id| db.put(id, tokens[id - 1]) }
+    db2 = open_db(WDB, dir, 'wdb2')
+    Harness.measure('WDB put2 ascii', ids) { |id| db2.put2(id, ascii[id - 1], ' ') }
+    db2.close
+    words = sample_words(tokens, QUERIES, 13)
+    Harness.measure('WDB search', words) { |w| db.search(w) }
+    bench_common('WDB', db)
+    db.close
+  end
+end
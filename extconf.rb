@@ -1,4 +1,9 @@
 require 'mkmf'
 dir_config 'tokyodystopia'
 have_library 'tokyodystopia'
+have_header 'ruby/thread.h'
+have_func 'rb_thread_call_without_gvl', 'ruby/thread.h'
+have_func 'rb_gc_adjust_memory_usage'
+have_func 'rb_io_wait', 'ruby/io.h'
+have_func 'rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h'
 create_makefile 'tokyodystopia'
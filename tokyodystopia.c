@@ -1,11 +1,31 @@
 #include <ruby.h>
+#include <ruby/encoding.h>
 #include <dystopia.h>
 #include <tcqdb.h>
 #include <laputa.h>
 #include <tcwdb.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_RB_IO_WAIT)
+#include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#define TD_FIBER_SCHEDULER 1
+#endif
 
 static VALUE mTD;
 static VALUE eTD;
@@ -13,6 +33,13 @@ static VALUE cIDB;
 static VALUE cQDB;
 static VALUE cJDB;
 static VALUE cWDB;
+static VALUE cIdSet;
+static VALUE cPool;
+static VALUE cTask;
+static VALUE cShIDB;
+static VALUE cShQDB;
+static VALUE cShJDB;
+static VALUE cAnalyzer;
 static VALUE eMisc;
 
 #define NERRORS (TCENOREC+1)
@@ -26,701 +53,8129 @@ static void tc_error(int ecode, const char *msg)
     rb_raise(eMisc, "%s", msg);
 }
 
+/* Blocking calls
+ *
+ * Every call into the library that may touch the disk or walk an index is
+ * made through td_nogvl() so that other Ruby threads keep running.  The
+ * arguments are copied into a td_call beforehand: no Ruby object may be
+ * touched while the GVL is released.  The library calls cannot be
+ * interrupted half-way, so no unblock function is given and interrupts are
+ * delivered when the call returns.  Under a fiber scheduler the call goes
+ * to a worker thread instead and only the calling fiber waits for it.
+ * Every such call, and the library calls of the extension's own threads
+ * but background tasks, is counted in td_gate, which fork waits to see
+ * empty (see Forking).
+ */
+
+typedef struct td_rank td_rank;
+
+typedef struct {
+    void *db;
+    int64_t id;
+    char *str;
+    char *delims;
+    int smode;
+    TCLIST *words;
+    int np;
+    void *res;
+    td_rank *rank;               /* side store to keep up, or NULL */
+    bool ok;
+} td_call;
+
+/* Library calls in flight.  A new call only waits while a fork is under
+ * way, so a call may enter while another one waits for it. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;         /* calls dropped to 0 */
+    int calls;
+} td_gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void td_gate_enter(void)
+{
+    pthread_mutex_lock(&td_gate.mutex);
+    td_gate.calls++;
+    pthread_mutex_unlock(&td_gate.mutex);
+}
+
+static void td_gate_leave(void)
+{
+    pthread_mutex_lock(&td_gate.mutex);
+    if (--td_gate.calls == 0)
+        pthread_cond_broadcast(&td_gate.idle);
+    pthread_mutex_unlock(&td_gate.mutex);
+}
+
+typedef struct {
+    void *(*func)(void *);
+    void *arg;
+    void *ret;
+} td_gated;
+
+static void *td_gated_call(void *p)
+{
+    td_gated *g = p;
+    td_gate_enter();
+    g->ret = g->func(g->arg);
+    td_gate_leave();
+    return NULL;
+}
+
+#ifdef TD_FIBER_SCHEDULER
+static bool td_nogvl_fiber(void *(*func)(void *), void *arg, void **ret);
+#endif
+
+static void *td_nogvl(void *(*func)(void *), void *arg)
+{
+#ifdef TD_FIBER_SCHEDULER
+    void *ret;
+    if (rb_fiber_scheduler_current() != Qnil && td_nogvl_fiber(func, arg, &ret))
+        return ret;
+#endif
+    td_gated g = { func, arg, NULL };
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(td_gated_call, &g, NULL, NULL);
+#else
+    td_gated_call(&g);
+#endif
+    return g.ret;
+}
+
+static char *td_strdup(VALUE str)
+{
+    const char *ptr = StringValueCStr(str);
+    long len = RSTRING_LEN(str);
+    char *buf = ALLOC_N(char, len + 1);
+    memcpy(buf, ptr, len + 1);
+    return buf;
+}
+
+static TCLIST *td_words(VALUE words)
+{
+    VALUE ary = rb_check_array_type(words);
+    TCLIST *tclist = tclistnew();
+    int i;
+    VALUE *ptr = RARRAY_PTR(ary);
+    for (i = 0; i < RARRAY_LEN(ary); i++) {
+        VALUE s = rb_check_string_type(ptr[i]);
+        tclistpush(tclist, RSTRING_PTR(s), RSTRING_LEN(s));
+    }
+    return tclist;
+}
+
+/* Worker threads
+ *
+ * A process-wide pool of native threads, one per CPU, started on first
+ * use, for work that fans out over several handles.  A caller queues a
+ * batch of jobs and waits for it without the GVL.  While it waits it runs
+ * queued jobs itself, so a batch finishes even when every worker is busy.
+ * Jobs never touch Ruby.
+ */
+
+typedef struct td_job td_job;
+typedef struct td_fjob td_fjob;
+
+struct td_job {
+    void *(*func)(void *);
+    void *arg;
+    int *pending;                /* jobs of the batch not yet finished */
+    td_job *next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    td_job *head;
+    td_job *tail;
+    td_fjob *fjobs;              /* fiber calls not yet joined */
+    int nthreads;
+} td_workers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Run the first queued job; called and returns with the mutex held. */
+static void td_job_run_locked(void)
+{
+    td_job *j = td_workers.head;
+    td_workers.head = j->next;
+    if (!td_workers.head)
+        td_workers.tail = NULL;
+    pthread_mutex_unlock(&td_workers.mutex);
+    j->func(j->arg);
+    pthread_mutex_lock(&td_workers.mutex);
+    (*j->pending)--;
+    pthread_cond_broadcast(&td_workers.done);
+}
+
+static void *td_worker_main(void *p)
+{
+    pthread_mutex_lock(&td_workers.mutex);
+    for (;;) {
+        while (!td_workers.head)
+            pthread_cond_wait(&td_workers.work, &td_workers.mutex);
+        td_job_run_locked();
+    }
+    return NULL;
+}
+
+static void td_workers_start(void)
+{
+    if (__atomic_load_n(&td_workers.nthreads, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&td_workers.mutex);
+    if (!td_workers.nthreads) {
+        long i, n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1)
+            n = 1;
+        for (i = 0; i < n; i++) {
+            pthread_t th;
+            if (pthread_create(&th, NULL, td_worker_main, NULL) != 0)
+                break;
+            pthread_detach(th);
+        }
+        /* With no thread at all the caller runs every job itself. */
+        __atomic_store_n(&td_workers.nthreads, i ? i : -1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&td_workers.mutex);
+}
+
+typedef struct {
+    td_job *jobs;
+    int num;
+    int pending;
+} td_batchjobs;
+
+static void td_job_push_locked(td_job *j, int *pending)
+{
+    j->pending = pending;
+    j->next = NULL;
+    if (td_workers.tail)
+        td_workers.tail->next = j;
+    else
+        td_workers.head = j;
+    td_workers.tail = j;
+}
+
+static void *td_run_jobs_nogvl(void *p)
+{
+    td_batchjobs *b = p;
+    int i;
+    pthread_mutex_lock(&td_workers.mutex);
+    for (i = 0; i < b->num; i++)
+        td_job_push_locked(&b->jobs[i], &b->pending);
+    b->pending = b->num;
+    pthread_cond_broadcast(&td_workers.work);
+    while (b->pending > 0) {
+        if (td_workers.head)
+            td_job_run_locked();
+        else
+            pthread_cond_wait(&td_workers.done, &td_workers.mutex);
+    }
+    pthread_mutex_unlock(&td_workers.mutex);
+    return NULL;
+}
+
+/* Run num jobs in parallel and wait for all of them. */
+static void td_run_jobs(td_job *jobs, int num)
+{
+    td_batchjobs b = { jobs, num, 0 };
+    if (num == 0)
+        return;
+    td_workers_start();
+    td_nogvl(td_run_jobs_nogvl, &b);
+}
+
+#ifdef TD_FIBER_SCHEDULER
+/* A blocking call made under a fiber scheduler.  The worker writes a byte
+ * to a pipe when done; the fiber waits for it with rb_io_wait, which lets
+ * the scheduler run other fibers meanwhile.  Each call in flight has a
+ * pipe to itself, so a finished job wakes its own fiber and no other.
+ * The pipes are pooled on the thread and go back to the pool after the
+ * call.  No more are made than there are workers, since further calls
+ * could not run anyway; a fiber finding none idle blocks through the
+ * scheduler until one is given back.  This is not a Thread::Queue, whose
+ * waiters a forked child forgets.  The td_fjob lives on the
+ * fiber's stack, so even when the wait is interrupted, the frame is not
+ * left before the worker is through with it.  Until then it is also kept
+ * in td_workers.fjobs, for a forked child to fail the calls it lost. */
+
+struct td_fjob {
+    td_job job;
+    void *(*func)(void *);
+    void *arg;
+    void *ret;
+    VALUE pool;                  /* td_fjob_pool, which the pipe goes back to */
+    VALUE pipe;                  /* [reader, writer] */
+    VALUE rio;
+    int rfd;
+    int wfd;
+    int pending;
+    int finished;
+    bool lost;                   /* left to the parent of a fork */
+    td_fjob *fprev;
+    td_fjob *fnext;
+};
+
+static void *td_fjob_run(void *p)
+{
+    td_fjob *f = p;
+    char c = 0;
+    td_gate_enter();
+    f->ret = f->func(f->arg);
+    td_gate_leave();
+    __atomic_store_n(&f->finished, 1, __ATOMIC_RELEASE);
+    while (write(f->wfd, &c, 1) < 0 && errno == EINTR)
+        ;
+    return NULL;
+}
+
+static VALUE td_fjob_wait(VALUE data)
+{
+    td_fjob *f = (td_fjob *)data;
+    while (!__atomic_load_n(&f->finished, __ATOMIC_ACQUIRE))
+        rb_io_wait(f->rio, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+    return Qnil;
+}
+
+static void *td_fjob_join_nogvl(void *p)
+{
+    td_fjob *f = p;
+    char c;
+    pthread_mutex_lock(&td_workers.mutex);
+    while (f->pending > 0)
+        pthread_cond_wait(&td_workers.done, &td_workers.mutex);
+    if (f->fprev)
+        f->fprev->fnext = f->fnext;
+    else
+        td_workers.fjobs = f->fnext;
+    if (f->fnext)
+        f->fnext->fprev = f->fprev;
+    pthread_mutex_unlock(&td_workers.mutex);
+    while (read(f->rfd, &c, 1) < 0 && errno == EINTR)
+        ;
+    return NULL;
+}
+
+/* Put a pipe back in the pool and wake the first fiber waiting for one. */
+static void td_fjob_give(VALUE w, VALUE pipe)
+{
+    rb_ary_push(RARRAY_AREF(w, 0), pipe);
+    VALUE fiber = rb_ary_shift(RARRAY_AREF(w, 3));
+    VALUE scheduler = rb_fiber_scheduler_current();
+    if (!NIL_P(fiber) && !NIL_P(scheduler))
+        rb_fiber_scheduler_unblock(scheduler, w, fiber);
+}
+
+static VALUE td_fjob_finish(VALUE data)
+{
+    td_fjob *f = (td_fjob *)data;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(td_fjob_join_nogvl, f, NULL, NULL);
+#else
+    td_fjob_join_nogvl(f);
+#endif
+    td_fjob_give(f->pool, f->pipe);
+    return Qnil;
+}
+
+static VALUE td_fjob_pipe(VALUE unused)
+{
+    return rb_funcall(rb_cIO, rb_intern("pipe"), 0);
+}
+
+/* The thread's pipes as [idle, made, pid, waiting fibers], made on first
+ * use and again in a forked child. */
+static VALUE td_fjob_pool(void)
+{
+    static ID id;
+    if (!id)
+        id = rb_intern("td_wakeup");
+    VALUE th = rb_thread_current();
+    VALUE w = rb_attr_get(th, id);
+    if (!NIL_P(w) && NUM2INT(RARRAY_AREF(w, 2)) == getpid())
+        return w;
+    w = rb_ary_new3(4, rb_ary_new(), INT2FIX(0), INT2NUM(getpid()), rb_ary_new());
+    rb_ivar_set(th, id, w);
+    return w;
+}
+
+static VALUE td_fjob_block(VALUE w)
+{
+    return rb_fiber_scheduler_block(rb_fiber_scheduler_current(), w, Qnil);
+}
+
+/* A pipe of the thread's own, waiting for one to come back if as many
+ * are out as there are workers; nil if no pipe can be made. */
+static VALUE td_fjob_take(VALUE w)
+{
+    VALUE idle = RARRAY_AREF(w, 0);
+    VALUE waiting = RARRAY_AREF(w, 3);
+    int state;
+    for (;;) {
+        if (RARRAY_LEN(idle) > 0)
+            return rb_ary_pop(idle);
+        int made = FIX2INT(RARRAY_AREF(w, 1));
+        if (made < td_workers.nthreads)
+            break;
+        VALUE fiber = rb_fiber_current();
+        rb_ary_push(waiting, fiber);
+        rb_protect(td_fjob_block, w, &state);
+        rb_ary_delete(waiting, fiber);
+        if (state) {
+            /* Pass on a wakeup this fiber may have taken. */
+            if (RARRAY_LEN(idle) > 0 && RARRAY_LEN(waiting) > 0)
+                td_fjob_give(w, rb_ary_pop(idle));
+            rb_jump_tag(state);
+        }
+    }
+    VALUE pipe = rb_protect(td_fjob_pipe, Qnil, &state);
+    if (state) {
+        rb_set_errinfo(Qnil);
+        return Qnil;
+    }
+    rb_ary_store(w, 1, INT2FIX(FIX2INT(RARRAY_AREF(w, 1)) + 1));
+    return pipe;
+}
+
+/* Run func(arg) on a worker; false if there is no worker or pipe. */
+static bool td_nogvl_fiber(void *(*func)(void *), void *arg, void **ret)
+{
+    td_workers_start();
+    if (td_workers.nthreads < 0)
+        return false;
+    VALUE w = td_fjob_pool();
+    VALUE pipe = td_fjob_take(w);
+    if (NIL_P(pipe))
+        return false;
+    /* A fork while the fiber waited for the pipe leaves no worker. */
+    td_workers_start();
+    if (td_workers.nthreads < 0) {
+        td_fjob_give(w, pipe);
+        return false;
+    }
+    td_fjob f;
+    MEMZERO(&f, td_fjob, 1);
+    f.job.func = td_fjob_run;
+    f.job.arg = &f;
+    f.func = func;
+    f.arg = arg;
+    f.pool = w;
+    f.pipe = pipe;
+    f.rio = RARRAY_AREF(pipe, 0);
+    f.rfd = NUM2INT(rb_funcall(f.rio, rb_intern("fileno"), 0));
+    f.wfd = NUM2INT(rb_funcall(RARRAY_AREF(pipe, 1), rb_intern("fileno"), 0));
+    pthread_mutex_lock(&td_workers.mutex);
+    td_job_push_locked(&f.job, &f.pending);
+    f.pending = 1;
+    f.fnext = td_workers.fjobs;
+    if (td_workers.fjobs)
+        td_workers.fjobs->fprev = &f;
+    td_workers.fjobs = &f;
+    pthread_cond_signal(&td_workers.work);
+    pthread_mutex_unlock(&td_workers.mutex);
+    rb_ensure(td_fjob_wait, (VALUE)&f, td_fjob_finish, (VALUE)&f);
+    RB_GC_GUARD(w);
+    RB_GC_GUARD(pipe);
+    if (f.lost)
+        rb_raise(eMisc, "call was left running in the parent process");
+    *ret = f.ret;
+    return true;
+}
+#endif
+
+/* Result cache
+ *
+ * An optional per-database LRU cache of search and search2 hits, keyed by
+ * method, search mode and word.  Every write through the same object
+ * bumps the generation and empties the cache; a search only stores its
+ * hits if the generation it started under is still current, so a write
+ * that overlaps a search can never leave stale hits behind.  All access
+ * goes through the cache's own mutex, so it may be used with or without
+ * the GVL.  Once created, a cache lives as long as its database object;
+ * disabling it only empties it.
+ */
+
+typedef struct td_rentry td_rentry;
+
+struct td_rentry {
+    td_rentry *chain;
+    td_rentry *prev;             /* LRU list, most recent first */
+    td_rentry *next;
+    uint64_t hash;
+    double expire;
+    uint64_t *ids;
+    long num;
+    size_t bytes;
+    int klen;
+    char key[1];
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    td_rentry **buckets;
+    size_t nbuckets;
+    td_rentry *head;
+    td_rentry *tail;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    double ttl;
+    uint64_t gen;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} td_rcache;
+
+static double td_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Key: method, search mode, word. */
+static int td_rkey(char *buf, char method, int smode, const char *word, int wlen)
+{
+    buf[0] = method;
+    memcpy(buf + 1, &smode, sizeof(smode));
+    memcpy(buf + 1 + sizeof(smode), word, wlen);
+    return 1 + sizeof(smode) + wlen;
+}
+
+static uint64_t td_rhash(const char *key, int klen)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+    for (i = 0; i < klen; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void td_runlink(td_rcache *rc, td_rentry *e)
+{
+    td_rentry **p = &rc->buckets[e->hash & (rc->nbuckets - 1)];
+    while (*p != e)
+        p = &(*p)->chain;
+    *p = e->chain;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        rc->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        rc->tail = e->prev;
+    rc->entries--;
+    rc->bytes -= e->bytes;
+    free(e->ids);
+    free(e);
+}
+
+static void td_rclear_locked(td_rcache *rc)
+{
+    while (rc->head)
+        td_runlink(rc, rc->head);
+}
+
+static td_rcache *td_rcache_new(void)
+{
+    td_rcache *rc = calloc(1, sizeof(td_rcache));
+    if (!rc)
+        rb_memerror();
+    rc->nbuckets = 256;
+    rc->buckets = calloc(rc->nbuckets, sizeof(td_rentry *));
+    if (!rc->buckets) {
+        free(rc);
+        rb_memerror();
+    }
+    pthread_mutex_init(&rc->mutex, NULL);
+    return rc;
+}
+
+static void td_rcache_free(td_rcache *rc)
+{
+    if (!rc)
+        return;
+    td_rclear_locked(rc);
+    pthread_mutex_destroy(&rc->mutex);
+    free(rc->buckets);
+    free(rc);
+}
+
+/* Drop every entry after a write. */
+static void td_rcache_clear(td_rcache *rc)
+{
+    if (!rc)
+        return;
+    pthread_mutex_lock(&rc->mutex);
+    rc->gen++;
+    td_rclear_locked(rc);
+    pthread_mutex_unlock(&rc->mutex);
+}
+
+/* Look a key up; on a hit *ids is a malloc'd copy.  *gen is set either way
+ * for the td_rcache_put that follows a miss. */
+static bool td_rcache_get(td_rcache *rc, char method, int smode, const char *word,
+                          uint64_t **ids, int *np, uint64_t *gen)
+{
+    if (!rc || rc->max_bytes == 0)
+        return false;
+    int wlen = strlen(word);
+    char *key = malloc(wlen + 1 + sizeof(int));
+    if (!key)
+        return false;
+    int klen = td_rkey(key, method, smode, word, wlen);
+    uint64_t h = td_rhash(key, klen);
+    bool hit = false;
+    pthread_mutex_lock(&rc->mutex);
+    *gen = rc->gen;
+    td_rentry *e = rc->max_bytes ? rc->buckets[h & (rc->nbuckets - 1)] : NULL;
+    while (e && !(e->hash == h && e->klen == klen && memcmp(e->key, key, klen) == 0))
+        e = e->chain;
+    if (e && e->expire && e->expire < td_now()) {
+        td_runlink(rc, e);
+        e = NULL;
+    }
+    if (e && (*ids = malloc(sizeof(uint64_t) * (e->num > 0 ? e->num : 1)))) {
+        memcpy(*ids, e->ids, sizeof(uint64_t) * e->num);
+        *np = e->num;
+        hit = true;
+        if (e != rc->head) {
+            e->prev->next = e->next;
+            if (e->next)
+                e->next->prev = e->prev;
+            else
+                rc->tail = e->prev;
+            e->prev = NULL;
+            e->next = rc->head;
+            rc->head->prev = e;
+            rc->head = e;
+        }
+    }
+    if (hit)
+        rc->hits++;
+    else
+        rc->misses++;
+    pthread_mutex_unlock(&rc->mutex);
+    free(key);
+    return hit;
+}
+
+static void td_rgrow(td_rcache *rc)
+{
+    size_t n = rc->nbuckets * 2, i;
+    td_rentry **buckets = calloc(n, sizeof(td_rentry *));
+    if (!buckets)
+        return;
+    for (i = 0; i < rc->nbuckets; i++) {
+        td_rentry *e = rc->buckets[i];
+        while (e) {
+            td_rentry *next = e->chain;
+            e->chain = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(rc->buckets);
+    rc->buckets = buckets;
+    rc->nbuckets = n;
+}
+
+/* Store a copy of fresh hits, unless a write happened since gen. */
+static void td_rcache_put(td_rcache *rc, char method, int smode, const char *word,
+                          const uint64_t *ids, int np, uint64_t gen)
+{
+    if (!rc || rc->max_bytes == 0)
+        return;
+    int wlen = strlen(word);
+    int klen = 1 + sizeof(int) + wlen;
+    size_t bytes = sizeof(td_rentry) + klen + sizeof(uint64_t) * np;
+    if (bytes > rc->max_bytes)
+        return;
+    td_rentry *e = malloc(sizeof(td_rentry) + klen);
+    uint64_t *copy = malloc(sizeof(uint64_t) * (np > 0 ? np : 1));
+    if (!e || !copy) {
+        free(e);
+        free(copy);
+        return;
+    }
+    e->klen = td_rkey(e->key, method, smode, word, wlen);
+    e->hash = td_rhash(e->key, e->klen);
+    memcpy(copy, ids, sizeof(uint64_t) * np);
+    e->ids = copy;
+    e->num = np;
+    e->bytes = bytes;
+    pthread_mutex_lock(&rc->mutex);
+    if (gen != rc->gen || rc->max_bytes == 0) {
+        pthread_mutex_unlock(&rc->mutex);
+        free(copy);
+        free(e);
+        return;
+    }
+    e->expire = rc->ttl > 0 ? td_now() + rc->ttl : 0;
+    td_rentry *old = rc->buckets[e->hash & (rc->nbuckets - 1)];
+    while (old && !(old->hash == e->hash && old->klen == e->klen && memcmp(old->key, e->key, e->klen) == 0))
+        old = old->chain;
+    if (old)
+        td_runlink(rc, old);
+    while (rc->tail && rc->bytes + bytes > rc->max_bytes) {
+        td_runlink(rc, rc->tail);
+        rc->evictions++;
+    }
+    if (rc->entries >= rc->nbuckets)
+        td_rgrow(rc);
+    size_t b = e->hash & (rc->nbuckets - 1);
+    e->chain = rc->buckets[b];
+    rc->buckets[b] = e;
+    e->prev = NULL;
+    e->next = rc->head;
+    if (rc->head)
+        rc->head->prev = e;
+    else
+        rc->tail = e;
+    rc->head = e;
+    rc->entries++;
+    rc->bytes += bytes;
+    pthread_mutex_unlock(&rc->mutex);
+}
+
+/* Statistics
+ *
+ * Each database object and each class keep counters and log2-bucketed
+ * histograms of the latency of put, out, search and the like, of the
+ * number of hits per search and of the bytes handed to put.  Recording
+ * is a handful of relaxed atomic adds, so it is always on.  stats
+ * returns a snapshot as a Hash; histogram keys are the exclusive upper
+ * bound of each bucket (nanoseconds for latency, hits for sizes).
+ */
+
+enum { TD_IDB, TD_QDB, TD_JDB, TD_WDB, TD_NKINDS };
+
+enum {
+    TD_OP_PUT, TD_OP_PUT_BATCH, TD_OP_OUT, TD_OP_SEARCH, TD_OP_SEARCH2,
+    TD_OP_QUERY, TD_OP_SYNC, TD_OP_OPTIMIZE, TD_NOPS
+};
+
+static const char *const td_opnames[TD_NOPS] = {
+    "put", "put_batch", "out", "search", "search2", "query", "sync", "optimize"
+};
+
+#define TD_HIST 48
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t nsec;
+    uint64_t hist[TD_HIST];
+} td_opstat;
+
+typedef struct {
+    td_opstat ops[TD_NOPS];
+    uint64_t searches;           /* successful search, search2 and query calls */
+    uint64_t hits;
+    uint64_t sizes[TD_HIST];
+    uint64_t bytes;
+} td_stats;
+
+static td_stats td_gstats[TD_NKINDS];
+
+static uint64_t td_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Bucket i holds values in [2^(i-1), 2^i); 0 goes to bucket 0. */
+static int td_bucket(uint64_t v)
+{
+    int b = v ? 64 - __builtin_clzll(v) : 0;
+    return b < TD_HIST ? b : TD_HIST - 1;
+}
+
+#define TD_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+static void td_stats_op(td_stats *st, int op, uint64_t nsec, bool ok)
+{
+    td_opstat *o = &st->ops[op];
+    TD_ADD(o->calls, 1);
+    if (!ok)
+        TD_ADD(o->errors, 1);
+    TD_ADD(o->nsec, nsec);
+    TD_ADD(o->hist[td_bucket(nsec)], 1);
+}
+
+static void td_stats_hits(td_stats *st, int np)
+{
+    TD_ADD(st->searches, 1);
+    TD_ADD(st->hits, np);
+    TD_ADD(st->sizes[td_bucket(np)], 1);
+}
+
+static void td_stats_reset(td_stats *st)
+{
+    uint64_t *p = (uint64_t *)st;
+    size_t i;
+    for (i = 0; i < sizeof(td_stats) / sizeof(uint64_t); i++)
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
+
+static VALUE td_hist_hash(const uint64_t *hist)
+{
+    VALUE ret = rb_hash_new();
+    int i;
+    for (i = 0; i < TD_HIST; i++) {
+        uint64_t n = __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+        if (n)
+            rb_hash_aset(ret, ULL2NUM(i < 64 ? 1ULL << i : 0), ULL2NUM(n));
+    }
+    return ret;
+}
+
+#define TD_LOAD(var) ULL2NUM(__atomic_load_n(&(var), __ATOMIC_RELAXED))
+
+static VALUE td_stats_hash(td_stats *st)
+{
+    VALUE ret = rb_hash_new();
+    int i;
+    for (i = 0; i < TD_NOPS; i++) {
+        td_opstat *o = &st->ops[i];
+        VALUE h = rb_hash_new();
+        rb_hash_aset(h, ID2SYM(rb_intern("calls")), TD_LOAD(o->calls));
+        rb_hash_aset(h, ID2SYM(rb_intern("errors")), TD_LOAD(o->errors));
+        rb_hash_aset(h, ID2SYM(rb_intern("total_ns")), TD_LOAD(o->nsec));
+        rb_hash_aset(h, ID2SYM(rb_intern("latency_ns")), td_hist_hash(o->hist));
+        rb_hash_aset(ret, ID2SYM(rb_intern(td_opnames[i])), h);
+    }
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(rb_intern("searches")), TD_LOAD(st->searches));
+    rb_hash_aset(h, ID2SYM(rb_intern("hits")), TD_LOAD(st->hits));
+    rb_hash_aset(h, ID2SYM(rb_intern("sizes")), td_hist_hash(st->sizes));
+    rb_hash_aset(ret, ID2SYM(rb_intern("results")), h);
+    rb_hash_aset(ret, ID2SYM(rb_intern("bytes_indexed")), TD_LOAD(st->bytes));
+    return ret;
+}
+
+static VALUE td_s_stats(VALUE self)
+{
+    static const char *const names[TD_NKINDS] = { "IDB", "QDB", "JDB", "WDB" };
+    VALUE ret = rb_hash_new();
+    int i;
+    for (i = 0; i < TD_NKINDS; i++)
+        rb_hash_aset(ret, ID2SYM(rb_intern(names[i])), td_stats_hash(&td_gstats[i]));
+    return ret;
+}
+
+static VALUE td_s_reset_stats(VALUE self)
+{
+    int i;
+    for (i = 0; i < TD_NKINDS; i++)
+        td_stats_reset(&td_gstats[i]);
+    return self;
+}
+
+/* Databases
+ *
+ * Every IDB, QDB, JDB and WDB object wraps a td_db: the library handle
+ * plus the state this extension keeps beside it.
+ */
+
+/* The library's default indexing cache size for every class. */
+#define TD_ICSIZ_DEFAULT (1LL << 27)
+
+typedef struct td_writer td_writer;
+
+typedef struct td_db {
+    void *db;                    /* TCIDB, TCQDB, TCJDB or TCWDB */
+    int kind;                    /* TD_IDB, ... */
+    int64_t icsiz;               /* indexing cache limit set by setcache */
+    size_t cached;               /* estimate of the cache, reported to the GC */
+    td_rcache *rcache;
+    td_writer *writer;           /* write-behind thread, or NULL */
+    td_rank *rank;               /* rank_stats side store, or NULL */
+    bool snapshot;               /* opened with snapshot: true */
+    int tasks;                   /* running background tasks */
+    bool orphan;                 /* collected; the last task deletes it */
+    td_stats stats;
+    struct td_db *prev;          /* in td_dbs */
+    struct td_db *next;
+} td_db;
+
+/* Every td_db alive, for the fork handlers; changed under the GVL only. */
+static td_db *td_dbs;
+
+static td_db *td_db_new(void *db, int kind)
+{
+    td_db *tdb = calloc(1, sizeof(td_db));
+    if (!tdb)
+        rb_memerror();
+    tdb->db = db;
+    tdb->kind = kind;
+    tdb->icsiz = TD_ICSIZ_DEFAULT;
+    tdb->next = td_dbs;
+    if (td_dbs)
+        td_dbs->prev = tdb;
+    td_dbs = tdb;
+    return tdb;
+}
+
+static void td_gc_adjust(ssize_t diff)
+{
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    if (diff)
+        rb_gc_adjust_memory_usage(diff);
+#endif
+}
+
+/* Bytes indexed since the last flush sit in the library's indexing cache,
+ * up to icsiz; tell the GC as the cache grows and when it is written out. */
+static void td_db_cache_grow(td_db *tdb, uint64_t bytes)
+{
+    size_t cached = tdb->cached + bytes;
+    if (cached > (uint64_t)tdb->icsiz)
+        cached = tdb->icsiz;
+    td_gc_adjust((ssize_t)cached - (ssize_t)tdb->cached);
+    tdb->cached = cached;
+}
+
+static void td_db_cache_flushed(td_db *tdb)
+{
+    td_gc_adjust(-(ssize_t)tdb->cached);
+    tdb->cached = 0;
+}
+
+static void td_writer_abandon(td_db *tdb);
+static void td_rank_close(td_rank *r);
+
+/* Delete the library's handle and all that hangs off it.  Needs no GVL,
+ * so the last background task of a collected database can run it. */
+static void td_db_destroy(td_db *tdb)
+{
+    td_writer_abandon(tdb);
+    switch (tdb->kind) {
+      case TD_IDB: tcidbdel(tdb->db); break;
+      case TD_QDB: tcqdbdel(tdb->db); break;
+      case TD_JDB: tcjdbdel(tdb->db); break;
+      default: tcwdbdel(tdb->db); break;
+    }
+    td_rank_close(tdb->rank);
+    td_rcache_free(tdb->rcache);
+    free(tdb);
+}
+
+static size_t td_db_memsize(const void *p)
+{
+    const td_db *tdb = p;
+    size_t size = sizeof(td_db) + tdb->cached;
+    if (tdb->rcache)
+        size += sizeof(td_rcache) + tdb->rcache->nbuckets * sizeof(td_rentry *) +
+                __atomic_load_n(&tdb->rcache->bytes, __ATOMIC_RELAXED);
+    return size;
+}
+
+/* Parent of the IDB, QDB, JDB and WDB types, for methods they share. */
+static const rb_data_type_t td_db_type = {
+    "TokyoDystopia::DB",
+    { NULL, NULL, td_db_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static td_db *td_db_get(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &td_db_type, tdb);
+    return tdb;
+}
+
+/* Record an operation started at t0 on tdb and its class. */
+static void td_record(td_db *tdb, int op, uint64_t t0, bool ok)
+{
+    uint64_t nsec = td_clock() - t0;
+    td_stats_op(&tdb->stats, op, nsec, ok);
+    td_stats_op(&td_gstats[tdb->kind], op, nsec, ok);
+}
+
+static void td_record_hits(td_db *tdb, int np)
+{
+    td_stats_hits(&tdb->stats, np);
+    td_stats_hits(&td_gstats[tdb->kind], np);
+}
+
+static void td_record_bytes(td_db *tdb, uint64_t bytes)
+{
+    TD_ADD(tdb->stats.bytes, bytes);
+    TD_ADD(td_gstats[tdb->kind].bytes, bytes);
+    td_db_cache_grow(tdb, bytes);
+}
+
+/* td_nogvl for a call whose success ends up in c->ok. */
+static void td_timed(td_db *tdb, int op, void *(*func)(void *), td_call *c)
+{
+    uint64_t t0 = td_clock();
+    td_nogvl(func, c);
+    td_record(tdb, op, t0, c->ok);
+}
+
+static uint64_t td_words_bytes(TCLIST *words)
+{
+    uint64_t bytes = 0;
+    int i, sp;
+    for (i = 0; i < tclistnum(words); i++) {
+        tclistval(words, i, &sp);
+        bytes += sp;
+    }
+    return bytes;
+}
+
+static VALUE db_stats(VALUE obj)
+{
+    return td_stats_hash(&td_db_get(obj)->stats);
+}
+
+static VALUE db_reset_stats(VALUE obj)
+{
+    td_stats_reset(&td_db_get(obj)->stats);
+    return obj;
+}
+
+static VALUE db_enable_result_cache(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb = td_db_get(obj);
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+    static ID keys[2];
+    VALUE vals[2] = { Qundef, Qundef };
+    if (!keys[0]) {
+        keys[0] = rb_intern("max_bytes");
+        keys[1] = rb_intern("ttl");
+    }
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keys, 0, 2, vals);
+    size_t max_bytes = vals[0] == Qundef ? 64 * 1024 * 1024 : NUM2SIZET(vals[0]);
+    double ttl = vals[1] == Qundef || NIL_P(vals[1]) ? 0 : NUM2DBL(vals[1]);
+    if (max_bytes == 0)
+        rb_raise(rb_eArgError, "max_bytes must be positive");
+    if (!tdb->rcache)
+        __atomic_store_n(&tdb->rcache, td_rcache_new(), __ATOMIC_RELEASE);
+    td_rcache *rc = tdb->rcache;
+    pthread_mutex_lock(&rc->mutex);
+    rc->max_bytes = max_bytes;
+    rc->ttl = ttl;
+    while (rc->tail && rc->bytes > rc->max_bytes)
+        td_runlink(rc, rc->tail);
+    pthread_mutex_unlock(&rc->mutex);
+    return obj;
+}
+
+static VALUE db_disable_result_cache(VALUE obj)
+{
+    td_rcache *rc = td_db_get(obj)->rcache;
+    if (rc) {
+        pthread_mutex_lock(&rc->mutex);
+        rc->max_bytes = 0;
+        rc->gen++;
+        td_rclear_locked(rc);
+        pthread_mutex_unlock(&rc->mutex);
+    }
+    return obj;
+}
+
+static VALUE db_clear_result_cache(VALUE obj)
+{
+    td_rcache_clear(td_db_get(obj)->rcache);
+    return obj;
+}
+
+static VALUE db_result_cache_stats(VALUE obj)
+{
+    td_rcache *rc = td_db_get(obj)->rcache;
+    if (!rc)
+        return Qnil;
+    pthread_mutex_lock(&rc->mutex);
+    uint64_t hits = rc->hits, misses = rc->misses, evictions = rc->evictions;
+    size_t entries = rc->entries, bytes = rc->bytes, max_bytes = rc->max_bytes;
+    pthread_mutex_unlock(&rc->mutex);
+    VALUE ret = rb_hash_new();
+    rb_hash_aset(ret, ID2SYM(rb_intern("hits")), ULL2NUM(hits));
+    rb_hash_aset(ret, ID2SYM(rb_intern("misses")), ULL2NUM(misses));
+    rb_hash_aset(ret, ID2SYM(rb_intern("evictions")), ULL2NUM(evictions));
+    rb_hash_aset(ret, ID2SYM(rb_intern("entries")), SIZET2NUM(entries));
+    rb_hash_aset(ret, ID2SYM(rb_intern("bytes")), SIZET2NUM(bytes));
+    rb_hash_aset(ret, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(max_bytes));
+    return ret;
+}
+
+/* Write-behind
+ *
+ * With open(..., async_writes: true) put and out only append to a queue
+ * and return.  A native thread owned by the database takes the whole
+ * queue at once, applies it through the library, empties the result
+ * cache and syncs every flush_interval seconds.  It never touches Ruby.
+ * When max_pending writes are queued, put and out wait for room.  Every
+ * queued write is tried: one that fails does not stop the others, and
+ * the error of the first failure is kept and raised by the next put, out,
+ * flush, sync, optimize, vanish or close.  Searches see a write once it has been
+ * applied; flush waits until everything queued so far is applied and
+ * synced.
+ */
+
+#define TD_FLUSH_INTERVAL 1.0
+#define TD_MAX_PENDING 10000
+#define TD_FLUSH_INTERVAL_MAX 86400.0
+#define TD_MAX_PENDING_MAX (1L << 20)
+
+typedef struct {
+    int64_t id;
+    char *text;                  /* malloc'd, or NULL */
+    bool out;
+} td_wop;
+
+struct td_writer {
+    td_db *tdb;
+    bool (*apply)(td_db *tdb, const td_wop *op);
+    bool (*sync)(td_db *tdb);
+    int (*ecode)(void *db);
+    const char *(*errmsg)(int ecode);
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;         /* new writes, a flush or stop */
+    pthread_cond_t done;         /* a batch applied or synced */
+    td_wop *queue;
+    td_wop *spare;               /* swapped with queue by the worker */
+    long num;
+    long max_pending;
+    double interval;
+    uint64_t queued;             /* sequence number of the last queued write */
+    uint64_t applied;            /* ... of the last applied one */
+    uint64_t sync_want;          /* sync once this write is applied */
+    uint64_t synced;             /* last write covered by a sync */
+    int error;                   /* ecode of the first failed write, or 0 */
+    bool stop;
+    bool lost;                   /* the thread stayed in the parent of a fork */
+};
+
+static void td_writer_deadline(struct timespec *ts, double secs)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += (time_t)secs;
+    ts->tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static bool td_writer_due(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void *td_writer_main(void *p)
+{
+    td_writer *w = p;
+    struct timespec deadline;
+    td_writer_deadline(&deadline, w->interval);
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        bool timeout = false;
+        while (w->num == 0 && !w->stop && w->sync_want <= w->synced && !timeout) {
+            if (w->applied > w->synced)
+                timeout = pthread_cond_timedwait(&w->work, &w->mutex, &deadline) == ETIMEDOUT;
+            else
+                pthread_cond_wait(&w->work, &w->mutex);
+        }
+        if (w->num == 0 && w->stop)
+            break;
+        td_wop *ops = w->queue;
+        long i, n = w->num;
+        uint64_t target = w->queued;
+        bool sync = timeout || w->sync_want > w->synced || td_writer_due(&deadline);
+        w->queue = w->spare;
+        w->spare = ops;
+        w->num = 0;
+        pthread_mutex_unlock(&w->mutex);
+
+        int error = 0;
+        td_gate_enter();
+        for (i = 0; i < n; i++) {
+            if (!w->apply(w->tdb, &ops[i]) && !error)
+                error = w->ecode(w->tdb->db);
+            free(ops[i].text);
+        }
+        if (n > 0)
+            td_rcache_clear(__atomic_load_n(&w->tdb->rcache, __ATOMIC_ACQUIRE));
+        if (sync) {
+            if (!w->sync(w->tdb) && !error)
+                error = w->ecode(w->tdb->db);
+            td_writer_deadline(&deadline, w->interval);
+        }
+        td_gate_leave();
+
+        pthread_mutex_lock(&w->mutex);
+        w->applied = target;
+        if (sync)
+            w->synced = target;
+        if (error && !w->error)
+            w->error = error;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+static td_writer *td_writer_new(td_db *tdb, double interval, long max_pending)
+{
+    td_writer *w = calloc(1, sizeof(td_writer));
+    if (!w)
+        rb_memerror();
+    w->tdb = tdb;
+    w->interval = interval;
+    w->max_pending = max_pending;
+    w->queue = malloc(sizeof(td_wop) * max_pending);
+    w->spare = malloc(sizeof(td_wop) * max_pending);
+    if (!w->queue || !w->spare) {
+        free(w->queue);
+        free(w->spare);
+        free(w);
+        rb_memerror();
+    }
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    return w;
+}
+
+static void td_writer_free(td_writer *w)
+{
+    long i;
+    for (i = 0; i < w->num; i++)
+        free(w->queue[i].text);
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->done);
+    free(w->queue);
+    free(w->spare);
+    free(w);
+}
+
+/* Start a writer thread for tdb, which must not have one yet. */
+static void td_writer_start(td_db *tdb, double interval, long max_pending,
+                            bool (*apply)(td_db *, const td_wop *), bool (*sync)(td_db *),
+                            int (*ecode)(void *), const char *(*errmsg)(int))
+{
+    td_writer *w = td_writer_new(tdb, interval, max_pending);
+    w->apply = apply;
+    w->sync = sync;
+    w->ecode = ecode;
+    w->errmsg = errmsg;
+    int err = pthread_create(&w->thread, NULL, td_writer_main, w);
+    if (err) {
+        td_writer_free(w);
+        rb_syserr_fail(err, "pthread_create");
+    }
+    tdb->writer = w;
+}
+
+/* Start a new thread for w if its own was left behind by fork. */
+static void td_writer_revive(td_writer *w)
+{
+    if (!w->lost)
+        return;
+    int err = pthread_create(&w->thread, NULL, td_writer_main, w);
+    if (err)
+        rb_syserr_fail(err, "pthread_create");
+    w->lost = false;
+}
+
+typedef struct {
+    td_writer *w;
+    uint64_t *seq;               /* wait until *seq >= target, or ... */
+    uint64_t target;
+    bool room;                   /* ... until the queue has room */
+} td_wwait;
+
+static void *td_writer_wait_nogvl(void *p)
+{
+    td_wwait *a = p;
+    td_writer *w = a->w;
+    pthread_mutex_lock(&w->mutex);
+    if (a->room) {
+        while (w->num >= w->max_pending)
+            pthread_cond_wait(&w->done, &w->mutex);
+    } else {
+        while (*a->seq < a->target)
+            pthread_cond_wait(&w->done, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+/* Raise the error of a failed write, once. */
+static void td_writer_check(td_writer *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    int error = w->error;
+    w->error = 0;
+    pthread_mutex_unlock(&w->mutex);
+    if (error)
+        tc_error(error, w->errmsg(error));
+}
+
+/* Queue a put of text, or an out (text is only needed by QDB). */
+static void td_writer_push(td_writer *w, int64_t id, VALUE text, bool out)
+{
+    char *copy = NULL;
+    td_writer_check(w);
+    td_writer_revive(w);
+    if (!NIL_P(text)) {
+        StringValueCStr(text);
+        copy = malloc(RSTRING_LEN(text) + 1);
+        if (!copy)
+            rb_memerror();
+        memcpy(copy, RSTRING_PTR(text), RSTRING_LEN(text) + 1);
+    }
+    pthread_mutex_lock(&w->mutex);
+    while (w->num >= w->max_pending) {
+        pthread_mutex_unlock(&w->mutex);
+        td_wwait a = { w, NULL, 0, true };
+        td_nogvl(td_writer_wait_nogvl, &a);
+        pthread_mutex_lock(&w->mutex);
+    }
+    td_wop *op = &w->queue[w->num++];
+    op->id = id;
+    op->text = copy;
+    op->out = out;
+    w->queued++;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/* Wait until every write queued so far is applied, and synced if sync. */
+static void td_writer_drain(td_writer *w, bool sync)
+{
+    pthread_mutex_lock(&w->mutex);
+    td_wwait a = { w, sync ? &w->synced : &w->applied, w->queued, false };
+    if (sync && w->sync_want < a.target)
+        w->sync_want = a.target;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->mutex);
+    td_nogvl(td_writer_wait_nogvl, &a);
+    td_writer_check(w);
+}
+
+static void *td_writer_join_nogvl(void *p)
+{
+    td_writer *w = p;
+    pthread_mutex_lock(&w->mutex);
+    w->stop = true;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->mutex);
+    if (!w->lost)
+        pthread_join(w->thread, NULL);
+    return NULL;
+}
+
+/* Let queued writes land before a call that must see them. */
+static void td_db_drain(td_db *tdb)
+{
+    if (tdb->writer)
+        td_writer_drain(tdb->writer, false);
+}
+
+/* Apply what is queued and stop the thread; returns the ecode of a failed
+ * write, which the caller raises once it has closed the handle, or 0. */
+static int td_writer_stop(td_db *tdb)
+{
+    td_writer *w = tdb->writer;
+    if (!w)
+        return 0;
+    tdb->writer = NULL;
+    td_nogvl(td_writer_join_nogvl, w);
+    int error = w->error;
+    td_writer_free(w);
+    return error;
+}
+
+/* For free functions: stop the thread without raising. */
+static void td_writer_abandon(td_db *tdb)
+{
+    td_writer *w = tdb->writer;
+    if (!w)
+        return;
+    tdb->writer = NULL;
+    td_writer_join_nogvl(w);
+    td_writer_free(w);
+}
+
+typedef struct {
+    bool async;
+    double interval;
+    long max_pending;
+    bool rank;
+    bool snapshot;
+    long prefetch;               /* bytes per file, -1 for all */
+} td_oopts;
+
+static void td_oopts_parse(VALUE opts, td_oopts *oo)
+{
+    static ID keys[6];
+    VALUE vals[6];
+    oo->async = false;
+    oo->interval = TD_FLUSH_INTERVAL;
+    oo->max_pending = TD_MAX_PENDING;
+    oo->rank = false;
+    oo->snapshot = false;
+    oo->prefetch = 0;
+    if (NIL_P(opts))
+        return;
+    if (!keys[0]) {
+        keys[0] = rb_intern("async_writes");
+        keys[1] = rb_intern("flush_interval");
+        keys[2] = rb_intern("max_pending");
+        keys[3] = rb_intern("rank_stats");
+        keys[4] = rb_intern("snapshot");
+        keys[5] = rb_intern("prefetch");
+    }
+    rb_get_kwargs(opts, keys, 0, 6, vals);
+    if (vals[0] != Qundef)
+        oo->async = RTEST(vals[0]);
+    if (vals[1] != Qundef && !NIL_P(vals[1]))
+        oo->interval = NUM2DBL(vals[1]);
+    if (vals[2] != Qundef && !NIL_P(vals[2]))
+        oo->max_pending = NUM2LONG(vals[2]);
+    if (vals[3] != Qundef)
+        oo->rank = RTEST(vals[3]);
+    if (vals[4] != Qundef)
+        oo->snapshot = RTEST(vals[4]);
+    if (vals[5] != Qundef && RTEST(vals[5])) {
+        oo->prefetch = vals[5] == Qtrue ? -1 : NUM2LONG(vals[5]);
+        if (oo->prefetch == 0 || oo->prefetch < -1)
+            rb_raise(rb_eArgError, "prefetch must be true or a positive number of bytes");
+    }
+    if (oo->prefetch && !oo->snapshot)
+        rb_raise(rb_eArgError, "prefetch needs snapshot: true");
+    if (oo->snapshot && oo->async)
+        rb_raise(rb_eArgError, "a snapshot takes no writes");
+    /* Checked here, before the library opens anything. */
+    if (!(oo->interval > 0 && oo->interval <= TD_FLUSH_INTERVAL_MAX))
+        rb_raise(rb_eArgError, "flush_interval must be positive and at most %g",
+                 TD_FLUSH_INTERVAL_MAX);
+    if (oo->max_pending <= 0 || oo->max_pending > TD_MAX_PENDING_MAX)
+        rb_raise(rb_eArgError, "max_pending must be between 1 and %ld", TD_MAX_PENDING_MAX);
+}
+
+static VALUE db_flush(VALUE obj)
+{
+    td_db *tdb = td_db_get(obj);
+    if (tdb->writer)
+        td_writer_drain(tdb->writer, true);
+    return obj;
+}
+
+static VALUE db_pending(VALUE obj)
+{
+    td_writer *w = td_db_get(obj)->writer;
+    if (!w)
+        return INT2FIX(0);
+    pthread_mutex_lock(&w->mutex);
+    uint64_t pending = w->queued - w->applied;
+    pthread_mutex_unlock(&w->mutex);
+    return ULL2NUM(pending);
+}
+
+/* Snapshots
+ *
+ * open(path, omode, snapshot: true) serves an index that is only read,
+ * such as one built offline and shipped as files.  The mode is forced to
+ * READER|NOLCK, so no file lock is taken, a handle opened before fork
+ * serves every child, and writes fail in the library as on any reader.
+ * prefetch: true asks the kernel to read the index files, the path itself
+ * or the files directly under it, into the page cache in whole
+ * (POSIX_FADV_WILLNEED), and prefetch: n only their first n bytes, where
+ * the headers, bucket arrays and upper B+tree pages sit.  This only
+ * starts the reads early; nothing is pinned, and the kernel may evict
+ * the pages again like any others.  What the page cache holds is shared
+ * by every process reading the files, forked or not.
+ */
+
+typedef struct {
+    const char *path;
+    long prefetch;               /* bytes per file, -1 for all */
+} td_snapmap;
+
+static void td_snapshot_file(td_snapmap *m, const char *file)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+#ifdef POSIX_FADV_WILLNEED
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t want = m->prefetch < 0 || m->prefetch > st.st_size ? st.st_size : m->prefetch;
+        posix_fadvise(fd, 0, want, POSIX_FADV_WILLNEED);
+    }
+#endif
+    close(fd);
+}
+
+static void *td_snapshot_nogvl(void *p)
+{
+    td_snapmap *m = p;
+    DIR *dir = opendir(m->path);
+    if (!dir) {
+        td_snapshot_file(m, m->path);
+        return NULL;
+    }
+    struct dirent *ent;
+    size_t plen = strlen(m->path);
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        char *file = malloc(plen + strlen(ent->d_name) + 2);
+        if (!file)
+            break;
+        sprintf(file, "%s/%s", m->path, ent->d_name);
+        td_snapshot_file(m, file);
+        free(file);
+    }
+    closedir(dir);
+    return NULL;
+}
+
+/* Start reading the files of an index opened at path.  A failure is no
+ * error: the library reads the files all the same. */
+static void td_snapshot_prefetch(VALUE path, long prefetch)
+{
+    td_snapmap m = { RSTRING_PTR(path), prefetch };
+    td_nogvl(td_snapshot_nogvl, &m);
+}
+
+/* Whether the handle was opened with snapshot: true. */
+static VALUE db_snapshot_p(VALUE obj)
+{
+    return td_db_get(obj)->snapshot ? Qtrue : Qfalse;
+}
+
+/* Background tasks
+ *
+ * optimize_async and sync_async run the call on a native thread of its
+ * own and return a Task at once.  The thread only holds the library's
+ * handle; searches through other handles, and through this one between
+ * the library's own locks, keep going.  A Task and its thread share the
+ * td_task, which the last of the two frees.  A database collected while
+ * one of its tasks is still running is not waited for: the last task to
+ * finish deletes the handle.
+ */
+
+typedef struct {
+    VALUE db;
+    td_db *tdb;
+    int op;                      /* TD_OP_OPTIMIZE or TD_OP_SYNC */
+    void *(*func)(void *);
+    int (*ecode)(void *);
+    const char *(*errmsg)(int);
+    td_call c;
+    pthread_t thread;
+    int error;
+    int refs;
+    pid_t pid;                   /* process that started the thread */
+    bool done;
+    bool settled;                /* done observed from Ruby */
+} td_task;
+
+static pthread_mutex_t td_task_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t td_task_cond = PTHREAD_COND_INITIALIZER;
+
+static void td_task_unref(td_task *t)
+{
+    pthread_mutex_lock(&td_task_mutex);
+    bool last = --t->refs == 0;
+    pthread_mutex_unlock(&td_task_mutex);
+    if (last)
+        free(t);
+}
+
+static void *td_task_main(void *p)
+{
+    td_task *t = p;
+    uint64_t t0 = td_clock();
+    t->func(&t->c);
+    int error = t->c.ok ? 0 : t->ecode(t->c.db);
+    td_record(t->tdb, t->op, t0, t->c.ok);
+    if (t->op == TD_OP_OPTIMIZE)
+        td_rcache_clear(__atomic_load_n(&t->tdb->rcache, __ATOMIC_ACQUIRE));
+    pthread_mutex_lock(&td_task_mutex);
+    t->error = error;
+    t->done = true;
+    bool last = --t->tdb->tasks == 0 && t->tdb->orphan;
+    pthread_cond_broadcast(&td_task_cond);
+    pthread_mutex_unlock(&td_task_mutex);
+    if (last)
+        td_db_destroy(t->tdb);
+    td_task_unref(t);
+    return NULL;
+}
+
+/* For free functions: forget the database, and delete it now unless a
+ * task still holds the handle, in which case the last task does. */
+static void td_db_free(td_db *tdb)
+{
+    td_db_cache_flushed(tdb);
+    if (tdb->prev)
+        tdb->prev->next = tdb->next;
+    else
+        td_dbs = tdb->next;
+    if (tdb->next)
+        tdb->next->prev = tdb->prev;
+    pthread_mutex_lock(&td_task_mutex);
+    bool busy = tdb->tasks > 0;
+    tdb->orphan = busy;
+    pthread_mutex_unlock(&td_task_mutex);
+    if (!busy)
+        td_db_destroy(tdb);
+}
+
+static void task_mark(void *p)
+{
+    rb_gc_mark(((td_task *)p)->db);
+}
+
+static void task_free(void *p)
+{
+    td_task_unref(p);
+}
+
+static size_t task_memsize(const void *p)
+{
+    return sizeof(td_task);
+}
+
+static const rb_data_type_t task_type = {
+    "TokyoDystopia::Task",
+    { task_mark, task_free, task_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE td_task_start(VALUE db, td_db *tdb, int op, void *(*func)(void *),
+                           int (*ecode)(void *), const char *(*errmsg)(int))
+{
+    td_db_drain(tdb);
+    td_task *t = calloc(1, sizeof(td_task));
+    if (!t)
+        rb_memerror();
+    t->db = db;
+    t->tdb = tdb;
+    t->op = op;
+    t->func = func;
+    t->ecode = ecode;
+    t->errmsg = errmsg;
+    t->c.db = tdb->db;
+    t->refs = 2;
+    t->pid = getpid();
+    VALUE obj = TypedData_Wrap_Struct(cTask, &task_type, t);
+    pthread_mutex_lock(&td_task_mutex);
+    tdb->tasks++;
+    pthread_mutex_unlock(&td_task_mutex);
+    int err = pthread_create(&t->thread, NULL, td_task_main, t);
+    if (err) {
+        pthread_mutex_lock(&td_task_mutex);
+        tdb->tasks--;
+        t->refs--;
+        t->done = true;
+        t->settled = true;
+        pthread_mutex_unlock(&td_task_mutex);
+        rb_syserr_fail(err, "pthread_create");
+    }
+    pthread_detach(t->thread);
+    return obj;
+}
+
+static td_task *td_task_get(VALUE obj)
+{
+    td_task *t;
+    TypedData_Get_Struct(obj, td_task, &task_type, t);
+    return t;
+}
+
+/* Whether t has finished; the first time it has, account for it and raise
+ * the library's error if it failed. */
+static bool td_task_settle(td_task *t)
+{
+    pthread_mutex_lock(&td_task_mutex);
+    bool done = t->done;
+    pthread_mutex_unlock(&td_task_mutex);
+    if (!done && t->pid != getpid()) {
+        t->done = true;
+        t->settled = true;
+        rb_raise(eMisc, "task was left running in the parent process");
+    }
+    if (!done || t->settled)
+        return done;
+    t->settled = true;
+    if (t->error)
+        tc_error(t->error, t->errmsg(t->error));
+    td_db_cache_flushed(t->tdb);
+    return true;
+}
+
+static VALUE task_done_p(VALUE obj)
+{
+    return td_task_settle(td_task_get(obj)) ? Qtrue : Qfalse;
+}
+
+typedef struct {
+    td_task *t;
+    struct timespec deadline;
+    bool timed;
+    bool interrupted;
+} td_twait;
+
+static void *td_task_wait_nogvl(void *p)
+{
+    td_twait *a = p;
+    pthread_mutex_lock(&td_task_mutex);
+    while (!a->t->done && !a->interrupted) {
+        if (!a->timed)
+            pthread_cond_wait(&td_task_cond, &td_task_mutex);
+        else if (pthread_cond_timedwait(&td_task_cond, &td_task_mutex, &a->deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&td_task_mutex);
+    return NULL;
+}
+
+static void td_task_wait_ubf(void *p)
+{
+    td_twait *a = p;
+    pthread_mutex_lock(&td_task_mutex);
+    a->interrupted = true;
+    pthread_cond_broadcast(&td_task_cond);
+    pthread_mutex_unlock(&td_task_mutex);
+}
+
+/* Wait for the task, at most timeout seconds if given; true once done. */
+static VALUE task_wait(int argc, VALUE *argv, VALUE obj)
+{
+    td_task *t = td_task_get(obj);
+    VALUE timeout;
+    rb_scan_args(argc, argv, "01", &timeout);
+    td_twait a = { t };
+    if (!NIL_P(timeout)) {
+        a.timed = true;
+        td_writer_deadline(&a.deadline, NUM2DBL(timeout));
+    }
+    while (!td_task_settle(t)) {
+        a.interrupted = false;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+        rb_thread_call_without_gvl(td_task_wait_nogvl, &a, td_task_wait_ubf, &a);
+#else
+        td_task_wait_nogvl(&a);
+#endif
+        rb_thread_check_ints();
+        if (!a.interrupted && a.timed)
+            return td_task_settle(t) ? Qtrue : Qfalse;
+    }
+    return Qtrue;
+}
+
+/* The library reports no progress, so only nil (running) or 1.0. */
+static VALUE task_progress(VALUE obj)
+{
+    return td_task_settle(td_task_get(obj)) ? DBL2NUM(1.0) : Qnil;
+}
+
+/* Batches
+ *
+ * put_batch reads its records from Ruby into a td_batch in chunks of up to
+ * TD_BATCH_MAX records, then hands the whole chunk to a per-class apply
+ * function which runs without the GVL.  Texts and words are copied into
+ * one scratch buffer, and JDB/WDB records reuse a single TCLIST; both
+ * survive from one chunk to the next.
+ */
+
+#define TD_BATCH_MAX 4096
+#define TD_BATCH_BYTES (8 * 1024 * 1024)
+#define TD_DELIMS " \t\r\n"
+
+typedef struct td_batch td_batch;
+
+struct td_batch {
+    void *db;
+    td_db *tdb;
+    void *(*apply)(void *);
+    void (*error)(void *);
+    VALUE src;
+    char *delims;                /* owned copy, or NULL for TD_DELIMS */
+    int num;
+    int64_t ids[TD_BATCH_MAX];
+    long offs[TD_BATCH_MAX];
+    int wnums[TD_BATCH_MAX];     /* word count, or -1 for a text record */
+    char *buf;
+    long len;
+    long cap;
+    uint64_t bytes;              /* text and word bytes of the chunk */
+    TCLIST *words;
+    int done;                    /* records applied by the last apply */
+    long total;
+    bool ok;
+};
+
+static char *td_batch_reserve(td_batch *b, long size)
+{
+    if (b->len + size > b->cap) {
+        long cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + size)
+            cap *= 2;
+        REALLOC_N(b->buf, char, cap);
+        b->cap = cap;
+    }
+    char *ptr = b->buf + b->len;
+    b->len += size;
+    return ptr;
+}
+
+static void td_batch_text(td_batch *b, VALUE text)
+{
+    const char *ptr = StringValueCStr(text);
+    long len = RSTRING_LEN(text);
+    b->offs[b->num] = b->len;
+    b->wnums[b->num] = -1;
+    memcpy(td_batch_reserve(b, len + 1), ptr, len + 1);
+    b->bytes += len;
+}
+
+static void td_batch_words(td_batch *b, VALUE words)
+{
+    VALUE ary = rb_check_array_type(words);
+    if (NIL_P(ary)) {
+        td_batch_text(b, words);
+        return;
+    }
+    b->offs[b->num] = b->len;
+    b->wnums[b->num] = RARRAY_LEN(ary);
+    long i;
+    for (i = 0; i < RARRAY_LEN(ary); i++) {
+        VALUE s = RARRAY_PTR(ary)[i];
+        StringValue(s);
+        int len = RSTRING_LEN(s);
+        memcpy(td_batch_reserve(b, sizeof(len)), &len, sizeof(len));
+        memcpy(td_batch_reserve(b, len), RSTRING_PTR(s), len);
+        b->bytes += len;
+    }
+}
+
+/* Fill b->words from a record added by td_batch_words. */
+static void td_batch_list(td_batch *b, int i)
+{
+    const char *ptr = b->buf + b->offs[i];
+    int j;
+    tclistclear(b->words);
+    for (j = 0; j < b->wnums[i]; j++) {
+        int len;
+        memcpy(&len, ptr, sizeof(len));
+        ptr += sizeof(len);
+        tclistpush(b->words, ptr, len);
+        ptr += len;
+    }
+}
+
+static void td_batch_flush(td_batch *b)
+{
+    if (b->num == 0)
+        return;
+    b->ok = true;
+    b->done = 0;
+    uint64_t t0 = td_clock();
+    td_nogvl(b->apply, b);
+    td_record(b->tdb, TD_OP_PUT_BATCH, t0, b->ok);
+    td_rcache_clear(b->tdb->rcache);
+    if (b->ok)
+        td_record_bytes(b->tdb, b->bytes);
+    b->total += b->done;
+    b->num = 0;
+    b->len = 0;
+    b->bytes = 0;
+    if (!b->ok)
+        b->error(b->db);
+}
+
+static VALUE td_batch_i(RB_BLOCK_CALL_FUNC_ARGLIST(rec, data))
+{
+    td_batch *b = (td_batch *)data;
+    VALUE id, val;
+    if (argc >= 2) {
+        id = argv[0];
+        val = argv[1];
+    } else {
+        VALUE ary = rb_convert_type(rec, T_ARRAY, "Array", "to_ary");
+        if (RARRAY_LEN(ary) != 2)
+            rb_raise(rb_eArgError, "record must be [id, text]");
+        id = RARRAY_PTR(ary)[0];
+        val = RARRAY_PTR(ary)[1];
+    }
+    b->ids[b->num] = NUM2LL(id);
+    if (b->words)
+        td_batch_words(b, val);
+    else
+        td_batch_text(b, val);
+    b->num++;
+    if (b->num == TD_BATCH_MAX || b->len >= TD_BATCH_BYTES)
+        td_batch_flush(b);
+    return Qnil;
+}
+
+static VALUE td_batch_run(VALUE data)
+{
+    td_batch *b = (td_batch *)data;
+    rb_block_call(b->src, rb_intern("each"), 0, 0, td_batch_i, data);
+    td_batch_flush(b);
+    return LL2NUM(b->total);
+}
+
+static VALUE td_batch_free(VALUE data)
+{
+    td_batch *b = (td_batch *)data;
+    xfree(b->buf);
+    xfree(b->delims);
+    if (b->words)
+        tclistdel(b->words);
+    xfree(b);
+    return Qnil;
+}
+
+/* Feed every [id, text] pair of src to apply; returns the record count. */
+static VALUE td_put_batch(td_db *tdb, VALUE src, void *(*apply)(void *),
+                          void (*error)(void *), bool words, VALUE delims)
+{
+    if (!NIL_P(delims))
+        StringValueCStr(delims);
+    td_batch *b = ALLOC(td_batch);
+    MEMZERO(b, td_batch, 1);
+    b->db = tdb->db;
+    b->tdb = tdb;
+    b->apply = apply;
+    b->error = error;
+    b->src = src;
+    if (!NIL_P(delims))
+        b->delims = td_strdup(delims);
+    if (words)
+        b->words = tclistnew();
+    return rb_ensure(td_batch_run, (VALUE)b, td_batch_free, (VALUE)b);
+}
+
+/* Import
+ *
+ * import reads records straight from a file or an IO and feeds them to the
+ * same per-class apply functions as put_batch, without a Ruby object per
+ * line.  A path is mapped into memory; an IO is read in large chunks into
+ * a window which keeps the incomplete last line for the next chunk.  Lines
+ * are parsed without the GVL: TSV lines are split at tabs, and JSON Lines
+ * objects are scanned for the two wanted members, skipping the others.
+ * The library wants NUL-terminated texts, so each text is copied once,
+ * decoded, into the batch buffer.  Malformed lines are counted and the
+ * first TD_IMPORT_ERRORS of them reported; they do not stop the import.
+ */
+
+#define TD_IMPORT_CHUNK (1024 * 1024)
+#define TD_IMPORT_ERRORS 100
+#define TD_JSON_DEPTH 64
+
+enum { TD_TSV, TD_JSONL };
+
+typedef struct {
+    long line;
+    const char *msg;
+} td_ierror;
+
+typedef struct {
+    td_batch *b;
+    int format;
+    long idcol;                  /* TSV columns */
+    long textcol;
+    char *idkey;                 /* JSON Lines member names */
+    char *textkey;
+    int limit;                   /* records per batch */
+    VALUE io;
+    VALUE chunk;
+    char *win;
+    long wcap;
+    int fd;
+    void *map;
+    size_t maplen;
+    const char *ptr;             /* the data at hand */
+    long len;
+    long pos;
+    bool eof;
+    long need;                   /* buffer size one line needs, or 0 */
+    bool full;                   /* the next line waits for a flush */
+    long lineno;
+    long malformed;
+    int nerrors;
+    td_ierror errors[TD_IMPORT_ERRORS];
+} td_import;
+
+/* A decimal ID in [p, e), or 0 if it is not one. */
+static int64_t td_parse_id(const char *p, const char *e)
+{
+    int64_t id = 0;
+    if (p == e)
+        return 0;
+    for (; p < e; p++) {
+        if (*p < '0' || *p > '9' || id > (INT64_MAX - (*p - '0')) / 10)
+            return 0;
+        id = id * 10 + (*p - '0');
+    }
+    return id;
+}
+
+static const char *td_tsv_line(td_import *im, const char *p, const char *e, int64_t *id)
+{
+    const char *ids = NULL, *ide = NULL, *ts = NULL, *te = NULL;
+    long col;
+    for (col = 0; p <= e; col++) {
+        const char *t = memchr(p, '\t', e - p);
+        if (!t)
+            t = e;
+        if (col == im->idcol) {
+            ids = p;
+            ide = t;
+        }
+        if (col == im->textcol) {
+            ts = p;
+            te = t;
+        }
+        p = t + 1;
+    }
+    if (!ids || !ts)
+        return "missing column";
+    if (!(*id = td_parse_id(ids, ide)))
+        return "invalid id";
+    if (memchr(ts, '\0', te - ts))
+        return "NUL in text";
+    td_batch *b = im->b;
+    memcpy(b->buf + b->len, ts, te - ts);
+    b->buf[b->len + (te - ts)] = '\0';
+    return NULL;
+}
+
+static const char *td_json_ws(const char *p, const char *e)
+{
+    while (p < e && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+static int td_hex4(const char *p, const char *e)
+{
+    int i, c = 0;
+    if (e - p < 4)
+        return -1;
+    for (i = 0; i < 4; i++) {
+        int d = p[i];
+        if (d >= '0' && d <= '9')
+            d -= '0';
+        else if ((d | 0x20) >= 'a' && (d | 0x20) <= 'f')
+            d = (d | 0x20) - 'a' + 10;
+        else
+            return -1;
+        c = c * 16 + d;
+    }
+    return c;
+}
+
+/* Scan the string at p, which starts with a quote, decoding it to out
+ * unless out is NULL.  Returns the end of the string or NULL. */
+static const char *td_json_string(const char *p, const char *e, char *out, long *olen)
+{
+    long n = 0;
+    for (p++; p < e; p++) {
+        unsigned char c = *p;
+        if (c == '"') {
+            if (olen)
+                *olen = n;
+            return p + 1;
+        }
+        if (c < 0x20)
+            return NULL;
+        if (c != '\\') {
+            if (out)
+                out[n] = c;
+            n++;
+            continue;
+        }
+        if (++p == e)
+            return NULL;
+        switch (*p) {
+          case '"': case '\\': case '/': c = *p; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case 'u': {
+            long u = td_hex4(p + 1, e);
+            if (u < 0)
+                return NULL;
+            p += 4;
+            if (u >= 0xd800 && u < 0xdc00 && e - p > 6 && p[1] == '\\' && p[2] == 'u') {
+                long l = td_hex4(p + 3, e);
+                if (l >= 0xdc00 && l < 0xe000) {
+                    u = 0x10000 + ((u - 0xd800) << 10) + (l - 0xdc00);
+                    p += 6;
+                }
+            }
+            char tmp[4];
+            int k = 0;
+            if (u < 0x80) {
+                tmp[k++] = u;
+            } else if (u < 0x800) {
+                tmp[k++] = 0xc0 | (u >> 6);
+                tmp[k++] = 0x80 | (u & 0x3f);
+            } else if (u < 0x10000) {
+                tmp[k++] = 0xe0 | (u >> 12);
+                tmp[k++] = 0x80 | ((u >> 6) & 0x3f);
+                tmp[k++] = 0x80 | (u & 0x3f);
+            } else {
+                tmp[k++] = 0xf0 | (u >> 18);
+                tmp[k++] = 0x80 | ((u >> 12) & 0x3f);
+                tmp[k++] = 0x80 | ((u >> 6) & 0x3f);
+                tmp[k++] = 0x80 | (u & 0x3f);
+            }
+            if (out)
+                memcpy(out + n, tmp, k);
+            n += k;
+            continue;
+          }
+          default:
+            return NULL;
+        }
+        if (out)
+            out[n] = c;
+        n++;
+    }
+    return NULL;
+}
+
+/* Skip the value at p; returns its end or NULL. */
+static const char *td_json_skip(const char *p, const char *e, int depth)
+{
+    if (p == e || depth > TD_JSON_DEPTH)
+        return NULL;
+    if (*p == '"')
+        return td_json_string(p, e, NULL, NULL);
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = td_json_ws(p + 1, e);
+        if (p < e && *p == close)
+            return p + 1;
+        for (;;) {
+            if (close == '}') {
+                if (p == e || *p != '"' || !(p = td_json_string(p, e, NULL, NULL)))
+                    return NULL;
+                p = td_json_ws(p, e);
+                if (p == e || *p != ':')
+                    return NULL;
+                p = td_json_ws(p + 1, e);
+            }
+            if (!(p = td_json_skip(p, e, depth + 1)))
+                return NULL;
+            p = td_json_ws(p, e);
+            if (p < e && *p == ',')
+                p = td_json_ws(p + 1, e);
+            else if (p < e && *p == close)
+                return p + 1;
+            else
+                return NULL;
+        }
+    }
+    const char *s = p;
+    while (p < e && (strchr("+-.eE", *p) || (*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z')))
+        p++;
+    return p > s ? p : NULL;
+}
+
+static bool td_json_key(const char *s, const char *e, const char *key)
+{
+    size_t n = e - s;
+    return !memchr(s, '\\', n) && strlen(key) == n && !memcmp(s, key, n);
+}
+
+static const char *td_jsonl_line(td_import *im, const char *p, const char *e, int64_t *id)
+{
+    td_batch *b = im->b;
+    bool gotid = false, gottext = false;
+    p = td_json_ws(p, e);
+    if (p == e || *p != '{')
+        return "invalid JSON";
+    p = td_json_ws(p + 1, e);
+    if (p < e && *p == '}')
+        p++;
+    else for (;;) {
+        if (p == e || *p != '"')
+            return "invalid JSON";
+        const char *ks = p + 1;
+        if (!(p = td_json_string(p, e, NULL, NULL)))
+            return "invalid JSON";
+        const char *ke = p - 1;
+        p = td_json_ws(p, e);
+        if (p == e || *p != ':')
+            return "invalid JSON";
+        p = td_json_ws(p + 1, e);
+        if (td_json_key(ks, ke, im->idkey)) {
+            const char *s = p;
+            while (p < e && *p >= '0' && *p <= '9')
+                p++;
+            if (!(*id = td_parse_id(s, p)) || (p < e && strchr(".eE", *p)))
+                return "invalid id";
+            gotid = true;
+        } else if (td_json_key(ks, ke, im->textkey)) {
+            long n;
+            if (p == e || *p != '"')
+                return "text is not a string";
+            if (!(p = td_json_string(p, e, b->buf + b->len, &n)))
+                return "invalid JSON";
+            if (memchr(b->buf + b->len, '\0', n))
+                return "NUL in text";
+            b->buf[b->len + n] = '\0';
+            gottext = true;
+        } else if (!(p = td_json_skip(p, e, 1))) {
+            return "invalid JSON";
+        }
+        p = td_json_ws(p, e);
+        if (p < e && *p == ',') {
+            p = td_json_ws(p + 1, e);
+        } else if (p < e && *p == '}') {
+            p++;
+            break;
+        } else {
+            return "invalid JSON";
+        }
+    }
+    if (td_json_ws(p, e) != e)
+        return "invalid JSON";
+    if (!gotid)
+        return "missing id";
+    if (!gottext)
+        return "missing text";
+    return NULL;
+}
+
+/* Parse whole lines of the data at hand into the batch until it is full,
+ * the data runs out, or a line does not fit in the batch buffer: then
+ * the batch is flushed, or if it is empty, the buffer grown. */
+static void *td_import_parse_nogvl(void *p)
+{
+    td_import *im = p;
+    td_batch *b = im->b;
+    while (b->num < im->limit && im->pos < im->len) {
+        const char *line = im->ptr + im->pos;
+        const char *nl = memchr(line, '\n', im->len - im->pos);
+        if (!nl && !im->eof)
+            break;
+        long ll = nl ? nl - line : im->len - im->pos;
+        /* Decoding never makes a text longer than its line. */
+        if (b->len + ll + 1 > b->cap) {
+            if (b->num == 0)
+                im->need = ll + 1;
+            else
+                im->full = true;
+            break;
+        }
+        im->pos += ll + (nl ? 1 : 0);
+        im->lineno++;
+        if (ll > 0 && line[ll - 1] == '\r')
+            ll--;
+        if (ll == 0)
+            continue;
+        int64_t id = 0;
+        const char *err = im->format == TD_TSV ?
+            td_tsv_line(im, line, line + ll, &id) :
+            td_jsonl_line(im, line, line + ll, &id);
+        if (err) {
+            if (im->nerrors < TD_IMPORT_ERRORS) {
+                im->errors[im->nerrors].line = im->lineno;
+                im->errors[im->nerrors].msg = err;
+                im->nerrors++;
+            }
+            im->malformed++;
+            continue;
+        }
+        long tl = strlen(b->buf + b->len);
+        b->ids[b->num] = id;
+        b->offs[b->num] = b->len;
+        b->wnums[b->num] = -1;
+        b->len += tl + 1;
+        b->bytes += tl;
+        b->num++;
+    }
+    return NULL;
+}
+
+/* Move the incomplete line to the front of the window and read more. */
+static void td_import_read(td_import *im)
+{
+    long rest = im->len - im->pos;
+    if (rest > 0)
+        memmove(im->win, im->win + im->pos, rest);
+    VALUE ret = rb_funcall(im->io, rb_intern("read"), 2, INT2FIX(TD_IMPORT_CHUNK), im->chunk);
+    long n = NIL_P(ret) ? 0 : RSTRING_LEN(im->chunk);
+    if (NIL_P(ret))
+        im->eof = true;
+    if (rest + n > im->wcap) {
+        long cap = im->wcap ? im->wcap : TD_IMPORT_CHUNK;
+        while (cap < rest + n)
+            cap *= 2;
+        REALLOC_N(im->win, char, cap);
+        im->wcap = cap;
+    }
+    if (n > 0)
+        memcpy(im->win + rest, RSTRING_PTR(im->chunk), n);
+    im->ptr = im->win;
+    im->len = rest + n;
+    im->pos = 0;
+}
+
+static VALUE td_import_run(VALUE data)
+{
+    td_import *im = (td_import *)data;
+    td_batch *b = im->b;
+    for (;;) {
+        td_nogvl(td_import_parse_nogvl, im);
+        if (im->need) {
+            td_batch_reserve(b, im->need);
+            b->len = 0;
+            im->need = 0;
+        } else if (b->num >= im->limit || im->full) {
+            td_batch_flush(b);
+            im->full = false;
+        } else if (im->eof) {
+            break;
+        } else {
+            td_import_read(im);
+        }
+    }
+    td_batch_flush(b);
+
+    VALUE errors = rb_ary_new2(im->nerrors);
+    int i;
+    for (i = 0; i < im->nerrors; i++)
+        rb_ary_push(errors, rb_assoc_new(LONG2NUM(im->errors[i].line),
+                                         rb_str_new_cstr(im->errors[i].msg)));
+    VALUE ret = rb_hash_new();
+    rb_hash_aset(ret, ID2SYM(rb_intern("records")), LONG2NUM(b->total));
+    rb_hash_aset(ret, ID2SYM(rb_intern("malformed")), LONG2NUM(im->malformed));
+    rb_hash_aset(ret, ID2SYM(rb_intern("errors")), errors);
+    return ret;
+}
+
+static VALUE td_import_free(VALUE data)
+{
+    td_import *im = (td_import *)data;
+    if (im->map)
+        munmap(im->map, im->maplen);
+    if (im->fd >= 0)
+        close(im->fd);
+    xfree(im->win);
+    xfree(im->idkey);
+    xfree(im->textkey);
+    td_batch_free((VALUE)im->b);
+    xfree(im);
+    return Qnil;
+}
+
+static char *td_import_key(VALUE v, const char *dflt)
+{
+    if (v == Qundef || NIL_P(v))
+        v = rb_str_new_cstr(dflt);
+    else if (SYMBOL_P(v))
+        v = rb_sym2str(v);
+    return td_strdup(v);
+}
+
+/* import(io_or_path, format: :tsv, id_field:, text_field:, batch:[, delims:])
+ * Returns { records:, malformed:, errors: [[line, message], ...] }. */
+static VALUE td_import_s(td_db *tdb, int argc, VALUE *argv, void *(*apply)(void *),
+                         void (*error)(void *), bool delimsopt)
+{
+    VALUE src, opts;
+    rb_scan_args(argc, argv, "1:", &src, &opts);
+    static ID keys[5];
+    VALUE vals[5] = { Qundef, Qundef, Qundef, Qundef, Qundef };
+    if (!keys[0]) {
+        keys[0] = rb_intern("format");
+        keys[1] = rb_intern("id_field");
+        keys[2] = rb_intern("text_field");
+        keys[3] = rb_intern("batch");
+        keys[4] = rb_intern("delims");
+    }
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keys, 0, delimsopt ? 5 : 4, vals);
+    int format;
+    if (vals[0] == Qundef || vals[0] == ID2SYM(rb_intern("tsv")))
+        format = TD_TSV;
+    else if (vals[0] == ID2SYM(rb_intern("jsonl")))
+        format = TD_JSONL;
+    else
+        rb_raise(rb_eArgError, "format must be :tsv or :jsonl");
+    long limit = vals[3] == Qundef ? TD_BATCH_MAX : NUM2LONG(vals[3]);
+    if (limit < 1 || limit > TD_BATCH_MAX)
+        rb_raise(rb_eArgError, "batch must be between 1 and %d", TD_BATCH_MAX);
+    long idcol = 0, textcol = 1;
+    if (format == TD_TSV) {
+        if (vals[1] != Qundef)
+            idcol = NUM2LONG(vals[1]);
+        if (vals[2] != Qundef)
+            textcol = NUM2LONG(vals[2]);
+        if (idcol < 0 || textcol < 0)
+            rb_raise(rb_eArgError, "TSV fields are column numbers from 0");
+    }
+    VALUE delims = vals[4] == Qundef ? Qnil : vals[4];
+    if (!NIL_P(delims))
+        StringValueCStr(delims);
+    bool isio = rb_respond_to(src, rb_intern("read"));
+    if (!isio)
+        FilePathValue(src);
+
+    td_import *im = ALLOC(td_import);
+    MEMZERO(im, td_import, 1);
+    im->fd = -1;
+    td_batch *b = ALLOC(td_batch);
+    MEMZERO(b, td_batch, 1);
+    b->db = tdb->db;
+    b->tdb = tdb;
+    b->apply = apply;
+    b->error = error;
+    im->b = b;
+    im->format = format;
+    im->idcol = idcol;
+    im->textcol = textcol;
+    im->limit = (int)limit;
+    if (format == TD_JSONL) {
+        im->idkey = td_import_key(vals[1], "id");
+        im->textkey = td_import_key(vals[2], "text");
+    }
+    if (!NIL_P(delims))
+        b->delims = td_strdup(delims);
+    td_batch_reserve(b, TD_BATCH_BYTES);
+    b->len = 0;
+    /* im is no Ruby object: src and chunk stay on this frame, which marks
+     * and pins them while the import runs. */
+    VALUE chunk = Qnil;
+    if (isio) {
+        chunk = rb_str_buf_new(TD_IMPORT_CHUNK);
+        im->io = src;
+        im->chunk = chunk;
+    } else {
+        struct stat st;
+        im->fd = open(RSTRING_PTR(src), O_RDONLY | O_CLOEXEC);
+        if (im->fd < 0 || fstat(im->fd, &st) < 0) {
+            int e = errno;
+            td_import_free((VALUE)im);
+            rb_syserr_fail_str(e, src);
+        }
+        if (st.st_size > 0) {
+            im->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, im->fd, 0);
+            if (im->map == MAP_FAILED) {
+                int e = errno;
+                im->map = NULL;
+                td_import_free((VALUE)im);
+                rb_syserr_fail_str(e, src);
+            }
+            im->maplen = st.st_size;
+            madvise(im->map, im->maplen, MADV_SEQUENTIAL);
+        }
+        im->ptr = im->map;
+        im->len = im->maplen;
+        im->eof = true;
+    }
+    VALUE ret = rb_ensure(td_import_run, (VALUE)im, td_import_free, (VALUE)im);
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(chunk);
+    return ret;
+}
+
+/* Results
+ *
+ * The search methods take an optional hash of result options.  By default
+ * hits come back as an Array of Integer; with packed: true they come back
+ * as one binary String of little-endian uint64 IDs, which callers can
+ * hand on without creating an object per hit, and with idset: true as an
+ * IdSet which takes over the library's buffer as it is.  limit:, offset:
+ * and order: (:asc or :desc, by ID) select a window of the hits before
+ * any of them is converted.
+ */
+
+typedef struct {
+    bool packed;
+    bool idset;
+    bool desc;
+    long limit;                  /* -1 for all */
+    long offset;
+} td_ropts;
+
+static void td_ropts_parse(VALUE opts, td_ropts *ro)
+{
+    static ID keys[5];
+    VALUE vals[5];
+    ro->packed = false;
+    ro->idset = false;
+    ro->desc = false;
+    ro->limit = -1;
+    ro->offset = 0;
+    if (NIL_P(opts))
+        return;
+    if (!keys[0]) {
+        keys[0] = rb_intern("packed");
+        keys[1] = rb_intern("idset");
+        keys[2] = rb_intern("limit");
+        keys[3] = rb_intern("offset");
+        keys[4] = rb_intern("order");
+    }
+    rb_get_kwargs(opts, keys, 0, 5, vals);
+    if (vals[0] != Qundef)
+        ro->packed = RTEST(vals[0]);
+    if (vals[1] != Qundef)
+        ro->idset = RTEST(vals[1]);
+    if (vals[2] != Qundef && !NIL_P(vals[2])) {
+        ro->limit = NUM2LONG(vals[2]);
+        if (ro->limit < 0)
+            rb_raise(rb_eArgError, "negative limit");
+    }
+    if (vals[3] != Qundef && !NIL_P(vals[3])) {
+        ro->offset = NUM2LONG(vals[3]);
+        if (ro->offset < 0)
+            rb_raise(rb_eArgError, "negative offset");
+    }
+    if (vals[4] != Qundef && !NIL_P(vals[4])) {
+        if (vals[4] == ID2SYM(rb_intern("desc")))
+            ro->desc = true;
+        else if (vals[4] != ID2SYM(rb_intern("asc")))
+            rb_raise(rb_eArgError, "order must be :asc or :desc");
+    }
+}
+
+/* How many leading IDs in ascending order are enough, or -1 for all. */
+static long td_ropts_need(const td_ropts *ro)
+{
+    if (ro->limit < 0 || ro->desc)
+        return -1;
+    return ro->offset + ro->limit;
+}
+
+/* The window of np ascending IDs selected by ro, as [*start, *start + *num). */
+static void td_window(const td_ropts *ro, long np, long *start, long *num)
+{
+    long avail = np > ro->offset ? np - ro->offset : 0;
+    *num = ro->limit >= 0 && ro->limit < avail ? ro->limit : avail;
+    *start = ro->desc ? np - ro->offset - *num : ro->offset;
+    if (*num == 0)
+        *start = 0;
+}
+
+static VALUE td_pack(const uint64_t *ids, long num, bool desc)
+{
+    VALUE str = rb_str_new(NULL, num * sizeof(uint64_t));
+    char *ptr = RSTRING_PTR(str);
+    long i;
+#ifdef WORDS_BIGENDIAN
+    int j;
+    for (i = 0; i < num; i++) {
+        uint64_t v = ids[desc ? num - 1 - i : i];
+        for (j = 0; j < 8; j++)
+            *ptr++ = (char)(v >> (j * 8));
+    }
+#else
+    if (desc) {
+        for (i = 0; i < num; i++)
+            memcpy(ptr + i * sizeof(uint64_t), &ids[num - 1 - i], sizeof(uint64_t));
+    } else {
+        memcpy(ptr, ids, num * sizeof(uint64_t));
+    }
+#endif
+    return str;
+}
+
+static VALUE td_idset_new(uint64_t *ids, long num, long cap);
+
+/* search_each and friends hand the hits to their block chunk: IDs at a
+ * time, as Arrays or, with packed: true, as packed Strings.  The idlist
+ * stays in C until every chunk has been yielded. */
+
+#define TD_CHUNK_DEFAULT 10000
+
+typedef struct {
+    long chunk;
+    bool packed;
+    uint64_t *ids;
+    long num;
+} td_each;
+
+static void td_each_parse(VALUE opts, td_each *e)
+{
+    static ID keys[2];
+    VALUE vals[2];
+    e->chunk = TD_CHUNK_DEFAULT;
+    e->packed = false;
+    e->ids = NULL;
+    e->num = 0;
+    if (NIL_P(opts))
+        return;
+    if (!keys[0]) {
+        keys[0] = rb_intern("chunk");
+        keys[1] = rb_intern("packed");
+    }
+    rb_get_kwargs(opts, keys, 0, 2, vals);
+    if (vals[0] != Qundef && !NIL_P(vals[0])) {
+        e->chunk = NUM2LONG(vals[0]);
+        if (e->chunk <= 0)
+            rb_raise(rb_eArgError, "chunk must be positive");
+    }
+    if (vals[1] != Qundef)
+        e->packed = RTEST(vals[1]);
+}
+
+static VALUE td_each_run(VALUE data)
+{
+    td_each *e = (td_each *)data;
+    long i, j;
+    for (i = 0; i < e->num; i += e->chunk) {
+        long n = e->num - i < e->chunk ? e->num - i : e->chunk;
+        if (e->packed) {
+            rb_yield(td_pack(e->ids + i, n, false));
+        } else {
+            VALUE ary = rb_ary_new2(n);
+            for (j = 0; j < n; j++)
+                rb_ary_push(ary, ULL2NUM(e->ids[i + j]));
+            rb_yield(ary);
+        }
+    }
+    return Qnil;
+}
+
+static VALUE td_each_free(VALUE data)
+{
+    free(((td_each *)data)->ids);
+    return Qnil;
+}
+
+/* Yield an idlist returned by the library in chunks and free it. */
+static void td_idlist_each(uint64_t *idlist, int np, td_each *e)
+{
+    e->ids = idlist;
+    e->num = np;
+    rb_ensure(td_each_run, (VALUE)e, td_each_free, (VALUE)e);
+}
+
+/* Convert the window of an idlist returned by the library and free it. */
+static VALUE td_idlist(uint64_t *idlist, int np, const td_ropts *ro)
+{
+    VALUE ret;
+    long start, num, i;
+    td_window(ro, np, &start, &num);
+    if (ro->idset) {
+        memmove(idlist, idlist + start, num * sizeof(uint64_t));
+        return td_idset_new(idlist, num, np);
+    }
+    if (ro->packed) {
+        ret = td_pack(idlist + start, num, ro->desc);
+    } else {
+        ret = rb_ary_new2(num);
+        for (i = 0; i < num; i++)
+            rb_ary_push(ret, ULL2NUM(idlist[ro->desc ? start + num - 1 - i : start + i]));
+    }
+    free(idlist);
+    return ret;
+}
+
+/* ID sets
+ *
+ * An IdSet owns a malloc'd, ascending, duplicate-free array of IDs, the
+ * same shape as the idlists the library returns.  Union, intersection and
+ * difference merge the two arrays directly; when one side is much smaller
+ * than the other its elements are located in the larger one by galloping
+ * (exponential then binary search) instead.  Large merges run without the
+ * GVL.  Integers are only created when the set is enumerated.
+ */
+
+#define TD_GALLOP_RATIO 32
+#define TD_NOGVL_IDS 65536
+
+typedef struct {
+    uint64_t *ids;
+    long num;
+    size_t bytes;                /* size of ids, as reported to the GC */
+} td_idset;
+
+static uint64_t *td_ids_alloc(long num)
+{
+    uint64_t *ids = malloc(sizeof(uint64_t) * (num > 0 ? num : 1));
+    if (!ids)
+        rb_memerror();
+    return ids;
+}
+
+static void idset_free(void *p)
+{
+    td_idset *set = p;
+    td_gc_adjust(-(ssize_t)set->bytes);
+    free(set->ids);
+    xfree(set);
+}
+
+static size_t idset_memsize(const void *p)
+{
+    const td_idset *set = p;
+    return sizeof(td_idset) + set->bytes;
+}
+
+static const rb_data_type_t idset_type = {
+    "TokyoDystopia::IdSet",
+    { NULL, idset_free, idset_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Wrap ids, a malloc'd array of cap IDs of which the first num are used. */
+static VALUE td_idset_new(uint64_t *ids, long num, long cap)
+{
+    td_idset *set = ALLOC(td_idset);
+    set->ids = ids;
+    set->num = num;
+    set->bytes = sizeof(uint64_t) * (cap > 0 ? cap : 1);
+    VALUE obj = TypedData_Wrap_Struct(cIdSet, &idset_type, set);
+    td_gc_adjust(set->bytes);
+    return obj;
+}
+
+static int td_idcmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sort ids and drop duplicates; returns the new length. */
+static long td_idsort(uint64_t *ids, long num)
+{
+    long i, n = 0;
+    for (i = 1; i < num; i++)
+        if (ids[i] <= ids[i - 1])
+            break;
+    if (i >= num)
+        return num;
+    qsort(ids, num, sizeof(*ids), td_idcmp);
+    for (i = 0; i < num; i++)
+        if (n == 0 || ids[n - 1] != ids[i])
+            ids[n++] = ids[i];
+    return n;
+}
+
+/* The merges below write at most max IDs to out. */
+
+/* First index in ids[lo, num) whose value is not less than key. */
+static long td_gallop(const uint64_t *ids, long lo, long num, uint64_t key)
+{
+    long step = 1, hi = lo;
+    while (hi < num && ids[hi] < key) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > num)
+        hi = num;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (ids[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static long td_union(const uint64_t *a, long na, const uint64_t *b, long nb, uint64_t *out, long max)
+{
+    long i = 0, j = 0, n = 0;
+    while (i < na && j < nb && n < max) {
+        if (a[i] < b[j]) {
+            out[n++] = a[i++];
+        } else if (a[i] > b[j]) {
+            out[n++] = b[j++];
+        } else {
+            out[n++] = a[i++];
+            j++;
+        }
+    }
+    while (i < na && n < max)
+        out[n++] = a[i++];
+    while (j < nb && n < max)
+        out[n++] = b[j++];
+    return n;
+}
+
+static long td_isect(const uint64_t *a, long na, const uint64_t *b, long nb, uint64_t *out, long max)
+{
+    long i = 0, j = 0, n = 0;
+    if (na > nb) {
+        const uint64_t *t = a;
+        a = b;
+        b = t;
+        long tn = na;
+        na = nb;
+        nb = tn;
+    }
+    if (na * TD_GALLOP_RATIO < nb) {
+        for (i = 0; i < na && j < nb && n < max; i++) {
+            j = td_gallop(b, j, nb, a[i]);
+            if (j < nb && b[j] == a[i])
+                out[n++] = a[i];
+        }
+        return n;
+    }
+    while (i < na && j < nb && n < max) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out[n++] = a[i++];
+            j++;
+        }
+    }
+    return n;
+}
+
+static long td_diff(const uint64_t *a, long na, const uint64_t *b, long nb, uint64_t *out, long max)
+{
+    long i = 0, j = 0, n = 0;
+    if (na * TD_GALLOP_RATIO < nb) {
+        for (i = 0; i < na && n < max; i++) {
+            j = td_gallop(b, j, nb, a[i]);
+            if (j >= nb || b[j] != a[i])
+                out[n++] = a[i];
+        }
+        return n;
+    }
+    while (i < na && j < nb && n < max) {
+        if (a[i] < b[j]) {
+            out[n++] = a[i++];
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    while (i < na && n < max)
+        out[n++] = a[i++];
+    return n;
+}
+
+typedef long td_mergefn(const uint64_t *, long, const uint64_t *, long, uint64_t *, long);
+
+typedef struct {
+    td_mergefn *op;
+    const td_idset *a;
+    const td_idset *b;
+    uint64_t *out;
+    long num;
+} td_setop;
+
+static void *td_setop_nogvl(void *p)
+{
+    td_setop *s = p;
+    s->num = s->op(s->a->ids, s->a->num, s->b->ids, s->b->num, s->out, LONG_MAX);
+    return NULL;
+}
+
+static td_idset *td_idset_get(VALUE obj)
+{
+    td_idset *set;
+    TypedData_Get_Struct(obj, td_idset, &idset_type, set);
+    return set;
+}
+
+static VALUE idset_s_new(int argc, VALUE *argv, VALUE klass);
+
+/* Accept an IdSet, an Array of Integer or a packed String. */
+static VALUE td_to_idset(VALUE obj)
+{
+    if (rb_obj_is_kind_of(obj, cIdSet))
+        return obj;
+    return idset_s_new(1, &obj, cIdSet);
+}
+
+static VALUE td_idset_op(VALUE obj, VALUE other, td_mergefn *op, long max)
+{
+    td_setop s = { op, td_idset_get(obj), NULL, NULL, 0 };
+    other = td_to_idset(other);
+    s.b = td_idset_get(other);
+    if (max < 0)
+        max = s.a->num + s.b->num;
+    s.out = td_ids_alloc(max);
+    if (s.a->num + s.b->num >= TD_NOGVL_IDS)
+        td_nogvl(td_setop_nogvl, &s);
+    else
+        td_setop_nogvl(&s);
+    RB_GC_GUARD(other);
+    return td_idset_new(s.out, s.num, max);
+}
+
+static VALUE idset_s_new(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE src;
+    rb_scan_args(argc, argv, "01", &src);
+    if (NIL_P(src))
+        return td_idset_new(td_ids_alloc(0), 0, 0);
+    if (RB_TYPE_P(src, T_STRING)) {
+        long num = RSTRING_LEN(src) / sizeof(uint64_t);
+        if (RSTRING_LEN(src) % sizeof(uint64_t))
+            rb_raise(rb_eArgError, "packed IDs must be a multiple of 8 bytes");
+        uint64_t *ids = td_ids_alloc(num);
+        const unsigned char *ptr = (const unsigned char *)RSTRING_PTR(src);
+        long i;
+        int j;
+        for (i = 0; i < num; i++) {
+            uint64_t v = 0;
+            for (j = 7; j >= 0; j--)
+                v = (v << 8) | ptr[i * 8 + j];
+            ids[i] = v;
+        }
+        return td_idset_new(ids, td_idsort(ids, num), num);
+    }
+    VALUE ary = rb_convert_type(src, T_ARRAY, "Array", "to_ary");
+    long i, num = RARRAY_LEN(ary);
+    uint64_t *ids = td_ids_alloc(num);
+    VALUE ret = td_idset_new(ids, 0, num);
+    for (i = 0; i < num; i++)
+        ids[i] = NUM2ULL(RARRAY_PTR(ary)[i]);
+    td_idset_get(ret)->num = td_idsort(ids, num);
+    return ret;
+}
+
+static VALUE idset_size(VALUE obj)
+{
+    return LONG2NUM(td_idset_get(obj)->num);
+}
+
+static VALUE idset_empty_p(VALUE obj)
+{
+    return td_idset_get(obj)->num == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE idset_each(VALUE obj)
+{
+    RETURN_SIZED_ENUMERATOR(obj, 0, 0, idset_size);
+    long i;
+    for (i = 0; i < td_idset_get(obj)->num; i++)
+        rb_yield(ULL2NUM(td_idset_get(obj)->ids[i]));
+    return obj;
+}
+
+static VALUE idset_to_a(VALUE obj)
+{
+    td_idset *set = td_idset_get(obj);
+    VALUE ret = rb_ary_new2(set->num);
+    long i;
+    for (i = 0; i < set->num; i++)
+        rb_ary_push(ret, ULL2NUM(set->ids[i]));
+    return ret;
+}
+
+static VALUE idset_to_packed(VALUE obj)
+{
+    td_idset *set = td_idset_get(obj);
+    return td_pack(set->ids, set->num, false);
+}
+
+static VALUE idset_include_p(VALUE obj, VALUE id)
+{
+    td_idset *set = td_idset_get(obj);
+    uint64_t key = NUM2ULL(id);
+    long i = td_gallop(set->ids, 0, set->num, key);
+    return i < set->num && set->ids[i] == key ? Qtrue : Qfalse;
+}
+
+static VALUE idset_union(VALUE obj, VALUE other)
+{
+    return td_idset_op(obj, other, td_union, -1);
+}
+
+static VALUE idset_isect(VALUE obj, VALUE other)
+{
+    return td_idset_op(obj, other, td_isect, td_idset_get(obj)->num);
+}
+
+static VALUE idset_diff(VALUE obj, VALUE other)
+{
+    return td_idset_op(obj, other, td_diff, td_idset_get(obj)->num);
+}
+
+static VALUE idset_eq(VALUE obj, VALUE other)
+{
+    if (!rb_obj_is_kind_of(other, cIdSet))
+        return Qfalse;
+    td_idset *a = td_idset_get(obj), *b = td_idset_get(other);
+    return a->num == b->num && memcmp(a->ids, b->ids, sizeof(uint64_t) * a->num) == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE idset_inspect(VALUE obj)
+{
+    return rb_sprintf("#<%"PRIsVALUE" size=%ld>", rb_class_name(CLASS_OF(obj)), td_idset_get(obj)->num);
+}
+
+/* Analyzers
+ *
+ * An Analyzer turns a text into words in one pass over its UTF-8: each
+ * character is folded (full-width ASCII to ASCII, the ideographic space to
+ * a space, upper to lower case for Latin, Greek and Cyrillic), delimiters
+ * end words, words outside the length bounds or in the stop list are
+ * dropped, and words longer than ngram: characters are cut into n-grams.
+ * The words go straight into a TCLIST.  The folding buffer and the list
+ * belong to the analyzer and are reused; a list still in use by a call
+ * that released the GVL is not, and a fresh one is made instead.  Bytes
+ * that are not UTF-8 are kept as they are.
+ */
+
+typedef struct {
+    bool delim[128];
+    bool fold_case;
+    bool fold_width;
+    int min_len;
+    int max_len;                 /* 0 for no bound */
+    int ngram;                   /* 0 for whole words */
+    TCMAP *stops;
+    char *buf;
+    long cap;
+    TCLIST *list;
+    bool busy;
+} td_analyzer;
+
+static void analyzer_free(void *p)
+{
+    td_analyzer *an = p;
+    if (an->stops)
+        tcmapdel(an->stops);
+    if (an->list)
+        tclistdel(an->list);
+    xfree(an->buf);
+    xfree(an);
+}
+
+static size_t analyzer_memsize(const void *p)
+{
+    const td_analyzer *an = p;
+    return sizeof(td_analyzer) + an->cap + (an->stops ? tcmapmsiz(an->stops) : 0);
+}
+
+static const rb_data_type_t analyzer_type = {
+    "TokyoDystopia::Analyzer",
+    { NULL, analyzer_free, analyzer_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE analyzer_alloc(VALUE klass)
+{
+    td_analyzer *an;
+    VALUE obj = TypedData_Make_Struct(klass, td_analyzer, &analyzer_type, an);
+    const char *d;
+    for (d = TD_DELIMS; *d; d++)
+        an->delim[(unsigned char)*d] = true;
+    an->fold_case = true;
+    an->fold_width = true;
+    an->min_len = 1;
+    return obj;
+}
+
+/* The analyzer obj is, or NULL if it is not one. */
+static td_analyzer *td_analyzer_check(VALUE obj)
+{
+    if (!rb_typeddata_is_kind_of(obj, &analyzer_type))
+        return NULL;
+    return RTYPEDDATA_DATA(obj);
+}
+
+/* Decode one character at p; a byte that starts no valid sequence is
+ * returned as itself with *len 1 and *raw set. */
+static long td_utf8(const unsigned char *p, const unsigned char *e, int *len, bool *raw)
+{
+    long c = p[0];
+    int n = c < 0x80 ? 1 : (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 0;
+    int i;
+    *raw = false;
+    if (n == 1) {
+        *len = 1;
+        return c;
+    }
+    if (n == 0 || e - p < n) {
+        *len = 1;
+        *raw = true;
+        return c;
+    }
+    c &= 0x7f >> n;
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *len = 1;
+            *raw = true;
+            return p[0];
+        }
+        c = c << 6 | (p[i] & 0x3f);
+    }
+    *len = n;
+    return c;
+}
+
+static int td_utf8_put(char *out, long c)
+{
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+static long td_fold(const td_analyzer *an, long c)
+{
+    if (an->fold_width) {
+        if (c >= 0xff01 && c <= 0xff5e)
+            c -= 0xfee0;
+        else if (c == 0x3000)
+            c = ' ';
+    }
+    if (!an->fold_case)
+        return c;
+    if (c < 0x80)
+        return c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+    if ((c >= 0xc0 && c <= 0xde && c != 0xd7) || (c >= 0x391 && c <= 0x3a9 && c != 0x3a2) ||
+        (c >= 0x410 && c <= 0x42f))
+        return c + 0x20;
+    if (c >= 0x400 && c <= 0x40f)
+        return c + 0x50;
+    if (c == 0x178)
+        return 0xff;
+    if (((c >= 0x100 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) && !(c & 1))
+        return c + 1;
+    if (((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) && (c & 1))
+        return c + 1;
+    return c;
+}
+
+/* Push the word [p, p + len) of nchars characters, or its n-grams. */
+static void td_analyzer_word(const td_analyzer *an, const char *p, long len, long nchars, TCLIST *out)
+{
+    if (nchars < an->min_len || (an->max_len && nchars > an->max_len))
+        return;
+    int sp;
+    if (an->stops && tcmapget(an->stops, p, len, &sp))
+        return;
+    if (!an->ngram || nchars <= an->ngram) {
+        tclistpush(out, p, len);
+        return;
+    }
+    const char *s = p, *e = p + len, *q = p;
+    long i;
+    /* q runs ngram characters ahead of s. */
+    for (i = 0; i < an->ngram; i++)
+        do q++; while (q < e && (*q & 0xc0) == 0x80);
+    for (;;) {
+        tclistpush(out, s, q - s);
+        if (q == e)
+            break;
+        do s++; while ((*s & 0xc0) == 0x80);
+        do q++; while (q < e && (*q & 0xc0) == 0x80);
+    }
+}
+
+/* Analyze [ptr, ptr + len) into out.  Folding never makes a character
+ * longer, so the folded word fits in len bytes. */
+static void td_analyze(td_analyzer *an, const char *ptr, long len, TCLIST *out)
+{
+    if (an->cap < len + 1) {
+        REALLOC_N(an->buf, char, len + 1);
+        an->cap = len + 1;
+    }
+    const unsigned char *p = (const unsigned char *)ptr, *e = p + len;
+    long wlen = 0, nchars = 0;
+    while (p < e) {
+        int n;
+        bool raw;
+        long c = td_utf8(p, e, &n, &raw);
+        p += n;
+        if (!raw)
+            c = td_fold(an, c);
+        if (!raw && ((c < 0x80 && an->delim[c]) || c == 0x3000 || c == 0xa0)) {
+            td_analyzer_word(an, an->buf, wlen, nchars, out);
+            wlen = nchars = 0;
+            continue;
+        }
+        if (raw)
+            an->buf[wlen++] = c;
+        else
+            wlen += td_utf8_put(an->buf + wlen, c);
+        nchars++;
+    }
+    td_analyzer_word(an, an->buf, wlen, nchars, out);
+}
+
+/* The analyzer's own list, emptied, unless a call is still using it. */
+static TCLIST *td_analyzer_list(td_analyzer *an)
+{
+    if (an->busy)
+        return tclistnew();
+    if (!an->list)
+        an->list = tclistnew();
+    tclistclear(an->list);
+    an->busy = true;
+    return an->list;
+}
+
+static void td_analyzer_release(td_analyzer *an, TCLIST *list)
+{
+    if (list == an->list)
+        an->busy = false;
+    else
+        tclistdel(list);
+}
+
+/* The words of text, in a list to give back with td_analyzer_release. */
+static TCLIST *td_analyzer_words(td_analyzer *an, VALUE text)
+{
+    StringValue(text);
+    TCLIST *list = td_analyzer_list(an);
+    td_analyze(an, RSTRING_PTR(text), RSTRING_LEN(text), list);
+    return list;
+}
+
+static td_analyzer *td_analyzer_get(VALUE obj)
+{
+    td_analyzer *an;
+    TypedData_Get_Struct(obj, td_analyzer, &analyzer_type, an);
+    return an;
+}
+
+/* Add word to the stop list, folded like the texts it is matched against. */
+static void td_analyzer_stop(td_analyzer *an, VALUE word)
+{
+    StringValue(word);
+    TCLIST *list = tclistnew();
+    int i, sp;
+    bool ngram = an->ngram;
+    an->ngram = 0;
+    td_analyze(an, RSTRING_PTR(word), RSTRING_LEN(word), list);
+    an->ngram = ngram;
+    for (i = 0; i < tclistnum(list); i++) {
+        const char *w = tclistval(list, i, &sp);
+        tcmapput(an->stops, w, sp, "", 0);
+    }
+    tclistdel(list);
+}
+
+/* Analyzer.new(delims: " \t\r\n", fold_case: true, fold_width: true,
+ *              stopwords: nil, min_length: 1, max_length: nil, ngram: nil) */
+static VALUE analyzer_initialize(int argc, VALUE *argv, VALUE obj)
+{
+    td_analyzer *an = td_analyzer_get(obj);
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+    static ID keys[7];
+    VALUE vals[7] = { Qundef, Qundef, Qundef, Qundef, Qundef, Qundef, Qundef };
+    if (!keys[0]) {
+        keys[0] = rb_intern("delims");
+        keys[1] = rb_intern("fold_case");
+        keys[2] = rb_intern("fold_width");
+        keys[3] = rb_intern("stopwords");
+        keys[4] = rb_intern("min_length");
+        keys[5] = rb_intern("max_length");
+        keys[6] = rb_intern("ngram");
+    }
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keys, 0, 7, vals);
+    if (vals[0] != Qundef) {
+        const char *d = StringValueCStr(vals[0]);
+        MEMZERO(an->delim, bool, 128);
+        for (; *d; d++) {
+            if ((unsigned char)*d >= 0x80)
+                rb_raise(rb_eArgError, "delims must be ASCII");
+            an->delim[(unsigned char)*d] = true;
+        }
+    }
+    if (vals[1] != Qundef)
+        an->fold_case = RTEST(vals[1]);
+    if (vals[2] != Qundef)
+        an->fold_width = RTEST(vals[2]);
+    if (vals[4] != Qundef && !NIL_P(vals[4]))
+        an->min_len = NUM2INT(vals[4]);
+    if (vals[5] != Qundef && !NIL_P(vals[5]))
+        an->max_len = NUM2INT(vals[5]);
+    if (vals[6] != Qundef && !NIL_P(vals[6]))
+        an->ngram = NUM2INT(vals[6]);
+    if (an->min_len < 1 || an->max_len < 0 || an->ngram < 0)
+        rb_raise(rb_eArgError, "lengths must be positive");
+    if (an->stops) {
+        tcmapdel(an->stops);
+        an->stops = NULL;
+    }
+    if (vals[3] != Qundef && !NIL_P(vals[3])) {
+        VALUE ary = rb_convert_type(vals[3], T_ARRAY, "Array", "to_ary");
+        an->stops = tcmapnew();
+        long i;
+        for (i = 0; i < RARRAY_LEN(ary); i++)
+            td_analyzer_stop(an, RARRAY_AREF(ary, i));
+    }
+    return obj;
+}
+
+/* The words of text as an Array of String. */
+static VALUE analyzer_analyze(VALUE obj, VALUE text)
+{
+    td_analyzer *an = td_analyzer_get(obj);
+    TCLIST *list = td_analyzer_words(an, text);
+    VALUE ret = rb_ary_new2(tclistnum(list));
+    int i, sp;
+    for (i = 0; i < tclistnum(list); i++) {
+        const char *w = tclistval(list, i, &sp);
+        rb_ary_push(ret, rb_enc_str_new(w, sp, rb_utf8_encoding()));
+    }
+    td_analyzer_release(an, list);
+    return ret;
+}
+
+/* Take analyzer: out of the options of a query method. */
+static td_analyzer *td_take_analyzer(VALUE *opts)
+{
+    if (NIL_P(*opts))
+        return NULL;
+    VALUE an = rb_hash_lookup2(*opts, ID2SYM(rb_intern("analyzer")), Qundef);
+    if (an == Qundef)
+        return NULL;
+    *opts = rb_hash_dup(*opts);
+    rb_hash_delete(*opts, ID2SYM(rb_intern("analyzer")));
+    return NIL_P(an) ? NULL : td_analyzer_get(an);
+}
+
+/* Snippets
+ *
+ * IDB#snippets fetches the texts of a page of hits and cuts windows out of
+ * them around the query terms, all in one call without the GVL.  The terms
+ * are compiled into an Aho-Corasick automaton over bytes, matched with
+ * ASCII folded to lower case, whose failure links are resolved into a full
+ * transition table, so each text is scanned once whatever the number of
+ * terms.  Overlapping matches are reduced to the leftmost longest.  A
+ * window is width bytes around the first match it takes, widened to UTF-8
+ * character boundaries, and takes every later match that fits in it.
+ * Offsets handed back are in characters.
+ */
+
+#define TD_SNIPPET_WIDTH 160
+#define TD_SNIPPET_MAX 3
+
+typedef int td_acrow[256];
+
+typedef struct {
+    td_acrow *next;
+    int *out;                    /* longest term ending at the node, or 0 */
+    int num;
+} td_ac;
+
+static int td_ac_node(td_ac *ac)
+{
+    REALLOC_N(ac->next, td_acrow, ac->num + 1);
+    REALLOC_N(ac->out, int, ac->num + 1);
+    memset(ac->next[ac->num], 0xff, sizeof(ac->next[0]));
+    ac->out[ac->num] = 0;
+    return ac->num++;
+}
+
+static void td_ac_add(td_ac *ac, const char *term, long len)
+{
+    int u = 0;
+    long i;
+    for (i = 0; i < len; i++) {
+        int c = TOLOWER((unsigned char)term[i]);
+        if (ac->next[u][c] < 0) {
+            int v = td_ac_node(ac);
+            ac->next[u][c] = v;
+        }
+        u = ac->next[u][c];
+    }
+    if (len > ac->out[u])
+        ac->out[u] = len;
+}
+
+/* Resolve the failure links breadth first. */
+static void td_ac_finish(td_ac *ac)
+{
+    int *fail = ALLOC_N(int, ac->num);
+    int *queue = ALLOC_N(int, ac->num);
+    int head = 0, tail = 0, c;
+    fail[0] = 0;
+    for (c = 0; c < 256; c++) {
+        int v = ac->next[0][c];
+        if (v < 0) {
+            ac->next[0][c] = 0;
+        } else {
+            fail[v] = 0;
+            queue[tail++] = v;
+        }
+    }
+    while (head < tail) {
+        int u = queue[head++];
+        for (c = 0; c < 256; c++) {
+            int v = ac->next[u][c];
+            if (v < 0) {
+                ac->next[u][c] = ac->next[fail[u]][c];
+            } else {
+                fail[v] = ac->next[fail[u]][c];
+                if (ac->out[fail[v]] > ac->out[v])
+                    ac->out[v] = ac->out[fail[v]];
+                queue[tail++] = v;
+            }
+        }
+    }
+    xfree(fail);
+    xfree(queue);
+}
+
+typedef struct {
+    long start;
+    long end;
+    int mfirst;
+    int mnum;
+} td_frag;
+
+typedef struct {
+    int64_t id;
+    char *text;                  /* from the library, or NULL if missing */
+    long len;
+    long *matches;               /* start and length pairs */
+    int nmatches;
+    td_frag frags[TD_SNIPPET_MAX];
+    int nfrags;
+} td_snip;
+
+typedef struct {
+    void *db;
+    char *(*get)(void *db, int64_t id);
+    int (*ecode)(void *db);
+    void (*error)(void *db);
+    td_ac ac;
+    long width;
+    int max;
+    VALUE ids;
+    VALUE terms;
+    td_snip *docs;
+    long num;
+    bool ok;
+    bool nomem;
+} td_snippets;
+
+static int td_matchcmp(const void *a, const void *b)
+{
+    const long *x = a, *y = b;
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+    return x[1] > y[1] ? -1 : x[1] < y[1];
+}
+
+/* Find the matches in d's text, leftmost longest and not overlapping. */
+static bool td_snip_match(td_snippets *s, td_snip *d)
+{
+    const td_ac *ac = &s->ac;
+    long i, n = 0, cap = 0;
+    long *m = NULL;
+    int u = 0;
+    for (i = 0; i < d->len; i++) {
+        u = ac->next[u][TOLOWER((unsigned char)d->text[i])];
+        if (!ac->out[u])
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            long *p = realloc(m, sizeof(long) * 2 * cap);
+            if (!p) {
+                free(m);
+                return false;
+            }
+            m = p;
+        }
+        m[2 * n] = i + 1 - ac->out[u];
+        m[2 * n + 1] = ac->out[u];
+        n++;
+    }
+    qsort(m, n, sizeof(long) * 2, td_matchcmp);
+    long k = 0, end = 0;
+    for (i = 0; i < n; i++) {
+        if (m[2 * i] < end)
+            continue;
+        m[2 * k] = m[2 * i];
+        m[2 * k + 1] = m[2 * i + 1];
+        end = m[2 * k] + m[2 * k + 1];
+        k++;
+    }
+    d->matches = m;
+    d->nmatches = k;
+    return true;
+}
+
+static void td_snip_frags(td_snippets *s, td_snip *d)
+{
+    const char *t = d->text;
+    long from = 0;
+    int i = 0;
+    while (d->nfrags < s->max && (i < d->nmatches || (d->nmatches == 0 && d->nfrags == 0))) {
+        long ms = d->nmatches ? d->matches[2 * i] : 0;
+        long ml = d->nmatches ? d->matches[2 * i + 1] : 0;
+        long start = ms + ml / 2 - s->width / 2;
+        if (start < from)
+            start = from;
+        long end = start + s->width;
+        if (end > d->len) {
+            end = d->len;
+            start = end - s->width > from ? end - s->width : from;
+        }
+        if (start > ms)
+            start = ms;
+        if (end < ms + ml)
+            end = ms + ml;
+        while (start > from && (t[start] & 0xc0) == 0x80)
+            start--;
+        while (end < d->len && (t[end] & 0xc0) == 0x80)
+            end++;
+        td_frag *f = &d->frags[d->nfrags++];
+        f->start = start;
+        f->end = end;
+        f->mfirst = i;
+        while (i < d->nmatches && d->matches[2 * i] + d->matches[2 * i + 1] <= end)
+            i++;
+        f->mnum = i - f->mfirst;
+        from = end;
+        if (d->nmatches == 0)
+            break;
+    }
+}
+
+static void *td_snippets_nogvl(void *p)
+{
+    td_snippets *s = p;
+    long i;
+    for (i = 0; i < s->num; i++) {
+        td_snip *d = &s->docs[i];
+        d->text = s->get(s->db, d->id);
+        if (!d->text) {
+            if (s->ecode(s->db) == TCENOREC)
+                continue;
+            s->ok = false;
+            return NULL;
+        }
+        d->len = strlen(d->text);
+        if (!td_snip_match(s, d)) {
+            s->nomem = true;
+            return NULL;
+        }
+        td_snip_frags(s, d);
+    }
+    return NULL;
+}
+
+static long td_nchars(const char *p, long len)
+{
+    long i, n = 0;
+    for (i = 0; i < len; i++)
+        if ((p[i] & 0xc0) != 0x80)
+            n++;
+    return n;
+}
+
+static VALUE td_snippets_run(VALUE data)
+{
+    td_snippets *s = (td_snippets *)data;
+    long i;
+    s->docs = ALLOC_N(td_snip, RARRAY_LEN(s->ids));
+    MEMZERO(s->docs, td_snip, RARRAY_LEN(s->ids));
+    for (i = 0; i < RARRAY_LEN(s->ids); i++) {
+        s->docs[i].id = NUM2LL(RARRAY_AREF(s->ids, i));
+        s->num++;
+    }
+    td_ac_node(&s->ac);
+    for (i = 0; i < RARRAY_LEN(s->terms); i++) {
+        VALUE t = RARRAY_AREF(s->terms, i);
+        StringValue(t);
+        if (RSTRING_LEN(t) > 0)
+            td_ac_add(&s->ac, RSTRING_PTR(t), RSTRING_LEN(t));
+    }
+    td_ac_finish(&s->ac);
+    td_nogvl(td_snippets_nogvl, s);
+    if (s->nomem)
+        rb_memerror();
+    if (!s->ok)
+        s->error(s->db);
+    VALUE ret = rb_ary_new2(s->num);
+    int j, k;
+    for (i = 0; i < s->num; i++) {
+        td_snip *d = &s->docs[i];
+        if (!d->text) {
+            rb_ary_push(ret, Qnil);
+            continue;
+        }
+        VALUE frags = rb_ary_new2(d->nfrags);
+        for (j = 0; j < d->nfrags; j++) {
+            td_frag *f = &d->frags[j];
+            VALUE matches = rb_ary_new2(f->mnum);
+            for (k = f->mfirst; k < f->mfirst + f->mnum; k++) {
+                long ms = d->matches[2 * k], ml = d->matches[2 * k + 1];
+                rb_ary_push(matches, rb_assoc_new(LONG2NUM(td_nchars(d->text + f->start, ms - f->start)),
+                                                  LONG2NUM(td_nchars(d->text + ms, ml))));
+            }
+            VALUE h = rb_hash_new();
+            rb_hash_aset(h, ID2SYM(rb_intern("text")),
+                         rb_enc_str_new(d->text + f->start, f->end - f->start, rb_utf8_encoding()));
+            rb_hash_aset(h, ID2SYM(rb_intern("offset")), LONG2NUM(td_nchars(d->text, f->start)));
+            rb_hash_aset(h, ID2SYM(rb_intern("matches")), matches);
+            rb_ary_push(frags, h);
+        }
+        rb_ary_push(ret, frags);
+    }
+    return ret;
+}
+
+static VALUE td_snippets_free(VALUE data)
+{
+    td_snippets *s = (td_snippets *)data;
+    long i;
+    for (i = 0; i < s->num; i++) {
+        free(s->docs[i].text);
+        free(s->docs[i].matches);
+    }
+    xfree(s->docs);
+    xfree(s->ac.next);
+    xfree(s->ac.out);
+    return Qnil;
+}
+
+/* snippets(ids, query, width: 160, max_per_doc: 3): for each ID, nil if
+ * there is no such record, else up to max_per_doc windows as
+ * { text:, offset:, matches: [[offset, length], ...] }.  query is a String
+ * of terms separated by white space or an Array of terms. */
+static VALUE td_snippets_s(void *db, char *(*get)(void *, int64_t), int (*ecode)(void *),
+                           void (*error)(void *), int argc, VALUE *argv)
+{
+    VALUE ids, query, opts;
+    rb_scan_args(argc, argv, "2:", &ids, &query, &opts);
+    static ID keys[2];
+    VALUE vals[2] = { Qundef, Qundef };
+    if (!keys[0]) {
+        keys[0] = rb_intern("width");
+        keys[1] = rb_intern("max_per_doc");
+    }
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keys, 0, 2, vals);
+    long width = vals[0] == Qundef ? TD_SNIPPET_WIDTH : NUM2LONG(vals[0]);
+    long max = vals[1] == Qundef ? TD_SNIPPET_MAX : NUM2LONG(vals[1]);
+    if (width < 1)
+        rb_raise(rb_eArgError, "width must be positive");
+    if (max < 1 || max > TD_SNIPPET_MAX * 10)
+        rb_raise(rb_eArgError, "max_per_doc must be between 1 and %d", TD_SNIPPET_MAX * 10);
+    if (rb_obj_is_kind_of(ids, cIdSet))
+        ids = rb_funcall(ids, rb_intern("to_a"), 0);
+    ids = rb_convert_type(ids, T_ARRAY, "Array", "to_ary");
+    VALUE terms = RB_TYPE_P(query, T_STRING) ? rb_str_split(query, " ") :
+        rb_convert_type(query, T_ARRAY, "Array", "to_ary");
+
+    td_snippets s;
+    MEMZERO(&s, td_snippets, 1);
+    s.db = db;
+    s.get = get;
+    s.ecode = ecode;
+    s.error = error;
+    s.width = width;
+    s.max = (int)max;
+    s.ok = true;
+    s.ids = ids;
+    s.terms = terms;
+    VALUE ret = rb_ensure(td_snippets_run, (VALUE)&s, td_snippets_free, (VALUE)&s);
+    RB_GC_GUARD(ids);
+    RB_GC_GUARD(terms);
+    return ret;
+}
+
+/* Ranking
+ *
+ * search_ranked scores the hits of each query term with BM25 and keeps
+ * the best limit: of them in a bounded min-heap, all without the GVL.
+ * Document lengths, in characters, and the corpus totals come from a side
+ * store kept at put time when the database is opened with rank_stats:
+ * true: a hash database next to the index, at path + ".rank", which maps
+ * each ID to its length and one extra key to the number and total length
+ * of the documents.  The side store is advisory; a failed update of it
+ * does not fail the write.  Term frequencies are approximate.  With the
+ * side store no text is read: each matching term counts once, so a large
+ * result set costs one length lookup per hit.  Without it, an IDB reads
+ * the stored texts for their lengths and counts each term in them the
+ * way the search mode matches it, with ASCII case folding and any ASCII
+ * character but a letter or digit taken as a token boundary.  A QDB has
+ * no stored texts, so it needs the side store.
+ */
+
+#define TD_RANK_LIMIT 10
+#define TD_BM25_K1 1.2
+#define TD_BM25_B 0.75
+
+struct td_rank {
+    TCHDB *hdb;
+    pthread_mutex_t mutex;
+    int64_t num;
+    int64_t sum;
+};
+
+/* Totals live under a one-byte key, which no 8-byte ID key can be. */
+static const char td_rank_tkey[1] = { 0 };
+
+static td_rank *td_rank_open(const char *path, int omode, int *ecode)
+{
+    td_rank *r = calloc(1, sizeof(td_rank));
+    char *file = malloc(strlen(path) + 6);
+    if (!r || !file) {
+        free(r);
+        free(file);
+        *ecode = TCEMISC;
+        return NULL;
+    }
+    sprintf(file, "%s.rank", path);
+    r->hdb = tchdbnew();
+    tchdbsetmutex(r->hdb);
+    if (!tchdbopen(r->hdb, file, omode)) {
+        *ecode = tchdbecode(r->hdb);
+        tchdbdel(r->hdb);
+        free(r);
+        free(file);
+        return NULL;
+    }
+    free(file);
+    int64_t t[2];
+    if (tchdbget3(r->hdb, td_rank_tkey, sizeof(td_rank_tkey), t, sizeof(t)) == sizeof(t)) {
+        r->num = t[0];
+        r->sum = t[1];
+    }
+    pthread_mutex_init(&r->mutex, NULL);
+    return r;
+}
+
+static void td_rank_close(td_rank *r)
+{
+    if (!r)
+        return;
+    tchdbclose(r->hdb);
+    tchdbdel(r->hdb);
+    pthread_mutex_destroy(&r->mutex);
+    free(r);
+}
+
+/* The length of id, or -1 if it is not known. */
+static int32_t td_rank_len(td_rank *r, int64_t id)
+{
+    int32_t len;
+    if (tchdbget3(r->hdb, &id, sizeof(id), &len, sizeof(len)) != sizeof(len))
+        return -1;
+    return len;
+}
+
+static void td_rank_update(td_rank *r, int64_t id, int32_t len, bool out)
+{
+    pthread_mutex_lock(&r->mutex);
+    int32_t old = td_rank_len(r, id);
+    if (old >= 0) {
+        r->num--;
+        r->sum -= old;
+    }
+    if (out) {
+        if (old >= 0)
+            tchdbout(r->hdb, &id, sizeof(id));
+    } else if (tchdbput(r->hdb, &id, sizeof(id), &len, sizeof(len))) {
+        r->num++;
+        r->sum += len;
+    }
+    int64_t t[2] = { r->num, r->sum };
+    tchdbput(r->hdb, td_rank_tkey, sizeof(td_rank_tkey), t, sizeof(t));
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static void td_rank_put(td_rank *r, int64_t id, const char *text)
+{
+    if (r)
+        td_rank_update(r, id, td_nchars(text, strlen(text)), false);
+}
+
+static void td_rank_out(td_rank *r, int64_t id)
+{
+    if (r)
+        td_rank_update(r, id, 0, true);
+}
+
+static void td_rank_sync(td_rank *r)
+{
+    if (r)
+        tchdbsync(r->hdb);
+}
+
+static void td_rank_vanish(td_rank *r)
+{
+    if (!r)
+        return;
+    pthread_mutex_lock(&r->mutex);
+    tchdbvanish(r->hdb);
+    r->num = r->sum = 0;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/* Open the side store for a database opened at path with omode, whose
+ * mode bits are the same as the hash database's. */
+static void td_rank_attach(td_db *tdb, VALUE path, int omode)
+{
+    if (tdb->rank)
+        return;
+    int ecode;
+    tdb->rank = td_rank_open(RSTRING_PTR(path), omode, &ecode);
+    if (!tdb->rank)
+        tc_error(ecode, tchdberrmsg(ecode));
+}
+
+static void td_rank_detach(td_db *tdb)
+{
+    td_rank_close(tdb->rank);
+    tdb->rank = NULL;
+}
+
+typedef struct {
+    int64_t id;
+    double score;
+} td_scored;
+
+typedef struct {
+    uint64_t id;
+    int term;
+} td_rhit;
+
+typedef struct {
+    void *db;
+    td_rank *rank;
+    uint64_t *(*search)(void *db, const char *word, int smode, int *np);
+    char *(*get)(void *db, int64_t id);  /* NULL if there are no texts */
+    uint64_t (*rnum)(void *db);      /* NULL if there is no record count */
+    int smode;
+    char **terms;
+    int nterms;
+    long limit;
+    double k1;
+    double b;
+    td_rhit *hits;               /* sorted by ID, then term */
+    long nhits;
+    td_scored *heap;
+    long nheap;
+    bool ok;
+    bool nomem;
+} td_ranked;
+
+static int td_rhitcmp(const void *a, const void *b)
+{
+    const td_rhit *x = a, *y = b;
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    return x->term < y->term ? -1 : x->term > y->term;
+}
+
+/* Whether a ranks below b: lower score, or the same and a higher ID. */
+static bool td_scored_lt(const td_scored *a, const td_scored *b)
+{
+    return a->score < b->score || (a->score == b->score && a->id > b->id);
+}
+
+static void td_heap_push(td_ranked *r, int64_t id, double score)
+{
+    td_scored s = { id, score }, *h = r->heap;
+    long i;
+    if (r->nheap < r->limit) {
+        i = r->nheap++;
+        while (i > 0 && td_scored_lt(&s, &h[(i - 1) / 2])) {
+            h[i] = h[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h[i] = s;
+        return;
+    }
+    if (!td_scored_lt(&h[0], &s))
+        return;
+    h[0] = s;
+    i = 0;
+    for (;;) {
+        long l = 2 * i + 1, m = i;
+        if (l < r->nheap && td_scored_lt(&h[l], &h[m]))
+            m = l;
+        if (l + 1 < r->nheap && td_scored_lt(&h[l + 1], &h[m]))
+            m = l + 1;
+        if (m == i)
+            break;
+        td_scored tmp = h[i];
+        h[i] = h[m];
+        h[m] = tmp;
+        i = m;
+    }
+}
+
+static bool td_boundary(const char *text, long len, long i)
+{
+    unsigned char c;
+    if (i < 0 || i >= len)
+        return true;
+    c = text[i];
+    return c < 0x80 && !ISALNUM(c);
+}
+
+/* Occurrences of term in text that the search mode smode would match,
+ * ASCII case folded. */
+static long td_count(const char *text, long len, const char *term, long tlen, int smode)
+{
+    long i, j, n = 0;
+    for (i = 0; i + tlen <= len; i++) {
+        for (j = 0; j < tlen; j++)
+            if (TOLOWER((unsigned char)text[i + j]) != TOLOWER((unsigned char)term[j]))
+                break;
+        if (j < tlen)
+            continue;
+        bool head = td_boundary(text, len, i - 1), tail = td_boundary(text, len, i + tlen);
+        bool ok;
+        switch (smode) {
+          case IDBSPREFIX: ok = i == 0; break;
+          case IDBSSUFFIX: ok = i + tlen == len; break;
+          case IDBSFULL: ok = i == 0 && tlen == len; break;
+          case IDBSTOKEN: ok = head && tail; break;
+          case IDBSTOKPRE: ok = head; break;
+          case IDBSTOKSUF: ok = tail; break;
+          default: ok = true; break;
+        }
+        if (ok) {
+            n++;
+            i += tlen - 1;
+        }
+    }
+    return n;
+}
+
+static void *td_ranked_nogvl(void *p)
+{
+    td_ranked *r = p;
+    long *df = calloc(r->nterms, sizeof(long));
+    if (!df) {
+        r->nomem = true;
+        return NULL;
+    }
+    int t, np, i;
+    for (t = 0; t < r->nterms; t++) {
+        uint64_t *ids = r->search(r->db, r->terms[t], r->smode, &np);
+        if (!ids) {
+            r->ok = false;
+            goto done;
+        }
+        td_rhit *hits = realloc(r->hits, sizeof(td_rhit) * (r->nhits + np + 1));
+        if (!hits) {
+            free(ids);
+            r->nomem = true;
+            goto done;
+        }
+        r->hits = hits;
+        for (i = 0; i < np; i++) {
+            r->hits[r->nhits].id = ids[i];
+            r->hits[r->nhits++].term = t;
+        }
+        df[t] = np;
+        free(ids);
+    }
+    qsort(r->hits, r->nhits, sizeof(td_rhit), td_rhitcmp);
+
+    double n = 0, avgdl = 0;
+    if (r->rank) {
+        pthread_mutex_lock(&r->rank->mutex);
+        n = r->rank->num;
+        avgdl = r->rank->num ? (double)r->rank->sum / r->rank->num : 0;
+        pthread_mutex_unlock(&r->rank->mutex);
+    }
+
+    /* One entry per candidate: its ID, length and term frequencies. */
+    long ncand = 0, h, k;
+    for (h = 0; h < r->nhits; h++)
+        if (h == 0 || r->hits[h].id != r->hits[h - 1].id)
+            ncand++;
+    double *tf = malloc(sizeof(double) * (ncand * r->nterms + 1));
+    double *dl = malloc(sizeof(double) * (ncand + 1));
+    int64_t *cid = malloc(sizeof(int64_t) * (ncand + 1));
+    if (!tf || !dl || !cid) {
+        r->nomem = true;
+        goto cands;
+    }
+    double dlsum = 0;
+    long c = -1;
+    for (h = 0; h < r->nhits; h++) {
+        int64_t id = r->hits[h].id;
+        if (c < 0 || cid[c] != id) {
+            c++;
+            cid[c] = id;
+            for (t = 0; t < r->nterms; t++)
+                tf[c * r->nterms + t] = 0;
+            dl[c] = r->rank ? td_rank_len(r->rank, id) : -1;
+            char *text = dl[c] < 0 && r->get ? r->get(r->db, id) : NULL;
+            if (text) {
+                long len = strlen(text);
+                for (t = 0; t < r->nterms; t++)
+                    tf[c * r->nterms + t] = td_count(text, len, r->terms[t],
+                                                     strlen(r->terms[t]), r->smode);
+                dl[c] = td_nchars(text, len);
+                free(text);
+            }
+            if (dl[c] < 0)
+                dl[c] = avgdl;
+            dlsum += dl[c];
+        }
+        /* A hit whose text was not read, or does not show the term, counts once. */
+        if (tf[c * r->nterms + r->hits[h].term] == 0)
+            tf[c * r->nterms + r->hits[h].term] = 1;
+    }
+    if (n <= 0)
+        n = r->rnum ? (double)r->rnum(r->db) : (double)ncand;
+    if (avgdl <= 0)
+        avgdl = ncand ? dlsum / ncand : 1;
+    if (avgdl <= 0)
+        avgdl = 1;
+
+    /* No more than ncand entries are ever pushed. */
+    r->heap = malloc(sizeof(td_scored) * ((r->limit < ncand ? r->limit : ncand) + 1));
+    if (!r->heap) {
+        r->nomem = true;
+        goto cands;
+    }
+    for (k = 0; k < ncand; k++) {
+        double score = 0;
+        for (t = 0; t < r->nterms; t++) {
+            double f = tf[k * r->nterms + t];
+            if (f == 0)
+                continue;
+            double idf = log(1 + (n - df[t] + 0.5) / (df[t] + 0.5));
+            score += idf * f * (r->k1 + 1) / (f + r->k1 * (1 - r->b + r->b * dl[k] / avgdl));
+        }
+        td_heap_push(r, cid[k], score);
+    }
+cands:
+    free(tf);
+    free(dl);
+    free(cid);
+done:
+    free(df);
+    return NULL;
+}
+
+static int td_scored_cmp(const void *a, const void *b)
+{
+    const td_scored *x = a, *y = b;
+    return td_scored_lt(x, y) ? 1 : td_scored_lt(y, x) ? -1 : 0;
+}
+
+static VALUE td_ranked_run(VALUE data)
+{
+    td_ranked *r = (td_ranked *)data;
+    td_nogvl(td_ranked_nogvl, r);
+    if (r->nomem)
+        rb_memerror();
+    if (!r->ok)
+        return Qnil;
+    qsort(r->heap, r->nheap, sizeof(td_scored), td_scored_cmp);
+    VALUE ret = rb_ary_new2(r->nheap);
+    long i;
+    for (i = 0; i < r->nheap; i++)
+        rb_ary_push(ret, rb_assoc_new(LL2NUM(r->heap[i].id), DBL2NUM(r->heap[i].score)));
+    return ret;
+}
+
+static VALUE td_ranked_free(VALUE data)
+{
+    td_ranked *r = (td_ranked *)data;
+    int t;
+    for (t = 0; t < r->nterms; t++)
+        xfree(r->terms[t]);
+    xfree(r->terms);
+    free(r->hits);
+    free(r->heap);
+    return Qnil;
+}
+
+/* search_ranked(query, smode, limit: 10, k1: 1.2, b: 0.75): the best hits
+ * of the terms of query, a String separated by white space or an Array,
+ * as [id, score] pairs by descending score.  nil if a search failed. */
+static VALUE td_ranked_s(td_db *tdb, uint64_t *(*search)(void *, const char *, int, int *),
+                         char *(*get)(void *, int64_t), uint64_t (*rnum)(void *),
+                         VALUE query, int smode, VALUE opts)
+{
+    static ID keys[3];
+    VALUE vals[3] = { Qundef, Qundef, Qundef };
+    if (!keys[0]) {
+        keys[0] = rb_intern("limit");
+        keys[1] = rb_intern("k1");
+        keys[2] = rb_intern("b");
+    }
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keys, 0, 3, vals);
+    if (!get && !tdb->rank)
+        rb_raise(eMisc, "search_ranked needs a database opened with rank_stats: true");
+    td_ranked r;
+    MEMZERO(&r, td_ranked, 1);
+    r.limit = vals[0] == Qundef || NIL_P(vals[0]) ? TD_RANK_LIMIT : NUM2LONG(vals[0]);
+    r.k1 = vals[1] == Qundef ? TD_BM25_K1 : NUM2DBL(vals[1]);
+    r.b = vals[2] == Qundef ? TD_BM25_B : NUM2DBL(vals[2]);
+    if (r.limit < 1)
+        rb_raise(rb_eArgError, "limit must be positive");
+    VALUE terms = RB_TYPE_P(query, T_STRING) ? rb_str_split(query, " ") :
+        rb_convert_type(query, T_ARRAY, "Array", "to_ary");
+    if (RARRAY_LEN(terms) > INT_MAX)
+        rb_raise(rb_eArgError, "too many terms");
+    long i;
+    for (i = 0; i < RARRAY_LEN(terms); i++)
+        StringValueCStr(RARRAY_PTR(terms)[i]);
+    r.db = tdb->db;
+    r.rank = tdb->rank;
+    r.search = search;
+    r.get = get;
+    r.rnum = rnum;
+    r.smode = smode;
+    r.ok = true;
+    r.terms = ALLOC_N(char *, RARRAY_LEN(terms) + 1);
+    for (i = 0; i < RARRAY_LEN(terms); i++)
+        r.terms[r.nterms++] = td_strdup(RARRAY_AREF(terms, i));
+    uint64_t t0 = td_clock();
+    VALUE ret = rb_ensure(td_ranked_run, (VALUE)&r, td_ranked_free, (VALUE)&r);
+    td_record(tdb, TD_OP_QUERY, t0, !NIL_P(ret));
+    RB_GC_GUARD(terms);
+    return ret;
+}
+
+/* Queries
+ *
+ * QDB#query and WDB#query evaluate a boolean tree whose leaves are words
+ * and whose inner nodes are [:and, ...], [:or, ...] and [:not, x] Arrays;
+ * :not is only allowed directly under :and.  The tree is copied into
+ * td_qnodes and evaluated without the GVL.  The children of an :and are
+ * looked up smallest first, using the hit counts of earlier lookups of the
+ * same word where known and the word length otherwise, and the remaining
+ * lookups are skipped as soon as the running intersection is empty.  When
+ * only the first IDs are wanted (limit: without order: :desc) the last
+ * merge at the root stops once it has produced them.
+ */
+
+enum { TD_QTERM, TD_QAND, TD_QOR, TD_QNOT };
+
+#define TD_QSIZES 4096
+#define TD_QUNKNOWN (1L << 24)
+
+typedef struct td_qnode td_qnode;
+
+struct td_qnode {
+    int op;
+    char *word;
+    int num;
+    td_qnode **kids;
+    long est;
+    uint64_t *ids;
+    long nids;
+};
+
+typedef struct {
+    void *db;
+    uint64_t *(*search)(void *db, const char *word, int smode, int *np);
+    int smode;
+    td_analyzer *an;
+    VALUE expr;
+    td_qnode **nodes;
+    int nnodes;
+    td_qnode *root;
+    long max;
+    uint64_t *ids;
+    long nids;
+    bool nomem;
+} td_query;
+
+/* Hit counts of recent lookups: tag in the top 40 bits, count below. */
+static uint64_t td_qsizes[TD_QSIZES];
+
+static uint64_t td_qhash(td_query *q, const char *word)
+{
+    uint64_t h = 14695981039346656037ULL ^ (uintptr_t)q->db ^ (uint64_t)q->smode << 56;
+    while (*word) {
+        h ^= (unsigned char)*word++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static long td_qsize_get(uint64_t h)
+{
+    uint64_t e = __atomic_load_n(&td_qsizes[h % TD_QSIZES], __ATOMIC_RELAXED);
+    return (e >> 24) == (h >> 40) ? (long)(e & 0xffffff) : -1;
+}
+
+static void td_qsize_put(uint64_t h, long num)
+{
+    uint64_t e = (h >> 40) << 24 | (num < 0xffffff ? num : 0xffffff);
+    __atomic_store_n(&td_qsizes[h % TD_QSIZES], e, __ATOMIC_RELAXED);
+}
+
+static td_qnode *td_qnew(td_query *q, int op)
+{
+    td_qnode *n = ALLOC(td_qnode);
+    MEMZERO(n, td_qnode, 1);
+    REALLOC_N(q->nodes, td_qnode *, q->nnodes + 1);
+    q->nodes[q->nnodes++] = n;
+    n->op = op;
+    return n;
+}
+
+static td_qnode *td_qword(td_query *q, const char *ptr, int len)
+{
+    td_qnode *n = td_qnew(q, TD_QTERM);
+    n->word = ALLOC_N(char, len + 1);
+    memcpy(n->word, ptr, len);
+    n->word[len] = '\0';
+    return n;
+}
+
+/* An :or without operands stands for a word that analysis left nothing
+ * of; it matches nothing and is dropped from :and and :or. */
+static bool td_qempty(const td_qnode *n)
+{
+    return (n->op == TD_QOR && n->num == 0) || (n->op == TD_QNOT && td_qempty(n->kids[0]));
+}
+
+/* A word, or with an analyzer the :and of the words it yields. */
+static td_qnode *td_qterm(td_query *q, VALUE expr)
+{
+    if (!q->an) {
+        td_qnode *n = td_qnew(q, TD_QTERM);
+        n->word = td_strdup(expr);
+        return n;
+    }
+    TCLIST *words = td_analyzer_words(q->an, expr);
+    int i, sp, num = tclistnum(words);
+    const char *w;
+    td_qnode *n;
+    if (num == 1) {
+        w = tclistval(words, 0, &sp);
+        n = td_qword(q, w, sp);
+    } else {
+        n = td_qnew(q, num ? TD_QAND : TD_QOR);
+        n->kids = ALLOC_N(td_qnode *, num);
+        for (i = 0; i < num; i++) {
+            w = tclistval(words, i, &sp);
+            n->kids[n->num++] = td_qword(q, w, sp);
+        }
+    }
+    td_analyzer_release(q->an, words);
+    return n;
+}
+
+static td_qnode *td_qcompile(td_query *q, VALUE expr, int depth)
+{
+    if (depth > 64)
+        rb_raise(rb_eArgError, "query nested too deeply");
+    if (RB_TYPE_P(expr, T_STRING))
+        return td_qterm(q, expr);
+    td_qnode *n = td_qnew(q, TD_QTERM);
+    VALUE ary = rb_convert_type(expr, T_ARRAY, "Array", "to_ary");
+    if (RARRAY_LEN(ary) < 2)
+        rb_raise(rb_eArgError, "query node needs an operator and operands");
+    VALUE op = RARRAY_PTR(ary)[0];
+    if (op == ID2SYM(rb_intern("and")))
+        n->op = TD_QAND;
+    else if (op == ID2SYM(rb_intern("or")))
+        n->op = TD_QOR;
+    else if (op == ID2SYM(rb_intern("not")))
+        n->op = TD_QNOT;
+    else
+        rb_raise(rb_eArgError, "unknown query operator: %"PRIsVALUE, rb_inspect(op));
+    if (n->op == TD_QNOT && RARRAY_LEN(ary) != 2)
+        rb_raise(rb_eArgError, ":not takes exactly one operand");
+    n->kids = ALLOC_N(td_qnode *, RARRAY_LEN(ary) - 1);
+    bool positive = false, kept = false;
+    long i;
+    for (i = 1; i < RARRAY_LEN(ary); i++) {
+        td_qnode *kid = td_qcompile(q, RARRAY_PTR(ary)[i], depth + 1);
+        if (kid->op == TD_QNOT && n->op != TD_QAND)
+            rb_raise(rb_eArgError, ":not is only allowed under :and");
+        if (kid->op != TD_QNOT)
+            positive = true;
+        if (n->op == TD_QNOT || !td_qempty(kid)) {
+            n->kids[n->num++] = kid;
+            if (kid->op != TD_QNOT)
+                kept = true;
+        }
+    }
+    if (!positive)
+        rb_raise(rb_eArgError, ":and needs at least one operand that is not :not");
+    if (n->op == TD_QAND && !kept) {
+        n->op = TD_QOR;
+        n->num = 0;
+    }
+    return n;
+}
+
+static void td_qestimate(td_query *q, td_qnode *n)
+{
+    int i;
+    switch (n->op) {
+    case TD_QTERM:
+        n->est = td_qsize_get(td_qhash(q, n->word));
+        if (n->est < 0)
+            n->est = TD_QUNKNOWN / ((long)strlen(n->word) + 1);
+        break;
+    case TD_QOR:
+        n->est = 0;
+        for (i = 0; i < n->num; i++) {
+            td_qestimate(q, n->kids[i]);
+            n->est += n->kids[i]->est;
+        }
+        break;
+    case TD_QAND:
+        n->est = LONG_MAX;
+        for (i = 0; i < n->num; i++) {
+            td_qestimate(q, n->kids[i]);
+            if (n->kids[i]->op != TD_QNOT && n->kids[i]->est < n->est)
+                n->est = n->kids[i]->est;
+        }
+        break;
+    case TD_QNOT:
+        td_qestimate(q, n->kids[0]);
+        n->est = n->kids[0]->est;
+        break;
+    }
+}
+
+/* Positive operands by ascending estimate, then :not operands. */
+static void td_qorder(td_qnode *n)
+{
+    int i, j;
+    for (i = 1; i < n->num; i++) {
+        td_qnode *kid = n->kids[i];
+        for (j = i; j > 0; j--) {
+            td_qnode *prev = n->kids[j - 1];
+            bool before = (kid->op != TD_QNOT && prev->op == TD_QNOT) ||
+                ((kid->op == TD_QNOT) == (prev->op == TD_QNOT) && kid->est < prev->est);
+            if (!before)
+                break;
+            n->kids[j] = prev;
+        }
+        n->kids[j] = kid;
+    }
+}
+
+static bool td_qeval(td_query *q, td_qnode *n);
+
+/* Replace n's hits by op(n, kid) and release kid's. */
+static bool td_qmerge(td_query *q, td_qnode *n, td_qnode *kid, td_mergefn *op, bool last)
+{
+    uint64_t *out = malloc(sizeof(uint64_t) * (n->nids + kid->nids + 1));
+    if (!out) {
+        q->nomem = true;
+        return false;
+    }
+    long max = last && n == q->root && q->max >= 0 ? q->max : LONG_MAX;
+    long num = op(n->ids, n->nids, kid->ids, kid->nids, out, max);
+    free(n->ids);
+    free(kid->ids);
+    kid->ids = NULL;
+    n->ids = out;
+    n->nids = num;
+    return true;
+}
+
+static bool td_qeval(td_query *q, td_qnode *n)
+{
+    int i, np;
+    switch (n->op) {
+    case TD_QTERM:
+        n->ids = q->search(q->db, n->word, q->smode, &np);
+        if (!n->ids)
+            return false;
+        n->nids = np;
+        td_qsize_put(td_qhash(q, n->word), np);
+        return true;
+    case TD_QNOT:
+        if (!td_qeval(q, n->kids[0]))
+            return false;
+        n->ids = n->kids[0]->ids;
+        n->nids = n->kids[0]->nids;
+        n->kids[0]->ids = NULL;
+        return true;
+    case TD_QOR:
+        if (n->num == 0) {
+            n->ids = malloc(sizeof(uint64_t));
+            n->nids = 0;
+            if (!n->ids)
+                q->nomem = true;
+            return n->ids != NULL;
+        }
+        for (i = 0; i < n->num; i++) {
+            if (!td_qeval(q, n->kids[i]))
+                return false;
+            if (i == 0) {
+                n->ids = n->kids[0]->ids;
+                n->nids = n->kids[0]->nids;
+                n->kids[0]->ids = NULL;
+            } else if (!td_qmerge(q, n, n->kids[i], td_union, i == n->num - 1)) {
+                return false;
+            }
+        }
+        return true;
+    case TD_QAND:
+        td_qorder(n);
+        for (i = 0; i < n->num; i++) {
+            if (i > 0 && n->nids == 0)
+                break;
+            if (!td_qeval(q, n->kids[i]))
+                return false;
+            if (i == 0) {
+                n->ids = n->kids[0]->ids;
+                n->nids = n->kids[0]->nids;
+                n->kids[0]->ids = NULL;
+            } else if (!td_qmerge(q, n, n->kids[i], n->kids[i]->op == TD_QNOT ? td_diff : td_isect,
+                                  i == n->num - 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+typedef struct {
+    td_query *q;
+    bool ok;
+} td_qrun;
+
+static void *td_query_nogvl(void *p)
+{
+    td_qrun *r = p;
+    td_qestimate(r->q, r->q->root);
+    r->ok = td_qeval(r->q, r->q->root);
+    return NULL;
+}
+
+static VALUE td_query_run(VALUE data)
+{
+    td_query *q = (td_query *)data;
+    q->root = td_qcompile(q, q->expr, 0);
+    if (q->root->op == TD_QNOT)
+        rb_raise(rb_eArgError, ":not is only allowed under :and");
+    td_qrun r = { q, false };
+    td_nogvl(td_query_nogvl, &r);
+    if (q->nomem)
+        rb_memerror();
+    if (r.ok) {
+        q->ids = q->root->ids;
+        q->nids = q->root->nids;
+        q->root->ids = NULL;
+    }
+    return Qnil;
+}
+
+static VALUE td_query_free(VALUE data)
+{
+    td_query *q = (td_query *)data;
+    int i;
+    for (i = 0; i < q->nnodes; i++) {
+        xfree(q->nodes[i]->word);
+        xfree(q->nodes[i]->kids);
+        free(q->nodes[i]->ids);
+        xfree(q->nodes[i]);
+    }
+    xfree(q->nodes);
+    return Qnil;
+}
+
+/* Evaluate expr; returns the hits, or NULL with the library's error set. */
+static uint64_t *td_query_ids(void *db, uint64_t *(*search)(void *, const char *, int, int *),
+                              VALUE expr, int smode, td_analyzer *an, long max, int *np)
+{
+    td_query q;
+    MEMZERO(&q, td_query, 1);
+    q.db = db;
+    q.search = search;
+    q.smode = smode;
+    q.an = an;
+    q.max = max;
+    q.expr = expr;
+    rb_ensure(td_query_run, (VALUE)&q, td_query_free, (VALUE)&q);
+    *np = q.nids;
+    return q.ids;
+}
+
+/* Iterators
+ *
+ * each_id and each walk a database with the library's iterator.  Up to
+ * TD_ITER_BATCH IDs, and with each their records, are fetched per call
+ * without the GVL and then yielded one by one.  The iterator belongs to
+ * the handle, so two walks over one object at a time disturb each other.
+ */
+
+#define TD_ITER_BATCH 1024
+
+typedef struct {
+    void *db;
+    void *(*fetch)(void *);      /* fills ids/vals; sets end and ok */
+    VALUE (*conv)(void *);       /* NULL to fetch IDs only */
+    void (*release)(void *);
+    void (*error)(void *);
+    int num;
+    int pos;
+    uint64_t ids[TD_ITER_BATCH];
+    void *vals[TD_ITER_BATCH];
+    bool end;
+    bool ok;
+} td_iter;
+
+static VALUE td_str(void *val)
+{
+    return rb_str_new2(val);
+}
+
+static VALUE td_list(void *val)
+{
+    TCLIST *list = val;
+    VALUE ret = rb_ary_new2(tclistnum(list));
+    int i, size;
+    for (i = 0; i < tclistnum(list); i++) {
+        const char *ptr = tclistval(list, i, &size);
+        rb_ary_push(ret, rb_str_new(ptr, size));
+    }
+    return ret;
+}
+
+static void td_list_release(void *val)
+{
+    tclistdel(val);
+}
+
+static VALUE td_iter_run(VALUE data)
+{
+    td_iter *it = (td_iter *)data;
+    while (!it->end) {
+        it->num = it->pos = 0;
+        it->ok = true;
+        td_nogvl(it->fetch, it);
+        if (!it->ok)
+            it->error(it->db);
+        while (it->pos < it->num) {
+            int i = it->pos;
+            VALUE id = ULL2NUM(it->ids[i]);
+            if (!it->conv) {
+                it->pos++;
+                rb_yield(id);
+                continue;
+            }
+            VALUE val = it->conv(it->vals[i]);
+            it->release(it->vals[i]);
+            it->pos++;
+            rb_yield(rb_assoc_new(id, val));
+        }
+    }
+    return Qnil;
+}
+
+static VALUE td_iter_free(VALUE data)
+{
+    td_iter *it = (td_iter *)data;
+    if (it->conv)
+        for (; it->pos < it->num; it->pos++)
+            it->release(it->vals[it->pos]);
+    xfree(it);
+    return Qnil;
+}
+
+static void td_iterate(void *db, void *(*fetch)(void *), VALUE (*conv)(void *),
+                       void (*release)(void *), void (*error)(void *))
+{
+    td_iter *it = ALLOC(td_iter);
+    it->db = db;
+    it->fetch = fetch;
+    it->conv = conv;
+    it->release = release;
+    it->error = error;
+    it->num = it->pos = 0;
+    it->end = false;
+    rb_ensure(td_iter_run, (VALUE)it, td_iter_free, (VALUE)it);
+}
+
 /* Core */
 
-static VALUE idb_allocate(VALUE klass)
+static void idb_free(void *p)
+{
+    td_db_free(p);
+}
+
+static const rb_data_type_t idb_type = {
+    "TokyoDystopia::IDB",
+    { NULL, idb_free, td_db_memsize, },
+    &td_db_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE idb_allocate(VALUE klass)
+{
+    td_db *tdb = td_db_new(tcidbnew(), TD_IDB);
+    tcidbsetmutex(tdb->db);
+    return TypedData_Wrap_Struct(klass, &idb_type, tdb);
+}
+
+#define IDB_CHK(x) if (!(x)) tc_error(tcidbecode(idb), tcidberrmsg(tcidbecode(idb)))
+
+static VALUE idb_tune(VALUE obj, VALUE ernum, VALUE etnum, VALUE iusiz, VALUE opts)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    IDB_CHK(tcidbtune(idb, NUM2LL(ernum), NUM2LL(etnum), NUM2LL(iusiz), NUM2INT(opts)));
+    return obj;
+}
+
+static VALUE idb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    int64_t size = NUM2LL(icsiz);
+    IDB_CHK(tcidbsetcache(idb, size, NUM2INT(lcnum)));
+    if (size > 0)
+        tdb->icsiz = size;
+    return obj;
+}
+
+static VALUE idb_setfwmmax(VALUE obj, VALUE fwmmax)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    IDB_CHK(tcidbsetfwmmax(idb, NUM2ULONG(fwmmax)));
+    return obj;
+}
+
+static bool idb_wapply(td_db *tdb, const td_wop *op)
+{
+    if (op->out) {
+        if (!tcidbout(tdb->db, op->id))
+            return false;
+        td_rank_out(tdb->rank, op->id);
+    } else {
+        if (!tcidbput(tdb->db, op->id, op->text))
+            return false;
+        td_rank_put(tdb->rank, op->id, op->text);
+    }
+    return true;
+}
+
+static bool idb_wsync(td_db *tdb)
+{
+    td_rank_sync(tdb->rank);
+    return tcidbsync(tdb->db);
+}
+
+static int idb_ecode(void *db)
+{
+    return tcidbecode(db);
+}
+
+static void *idb_open_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidbopen(c->db, c->str, c->smode);
+    return NULL;
+}
+
+static VALUE idb_open(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    VALUE path, omode, opts;
+    rb_scan_args(argc, argv, "2:", &path, &omode, &opts);
+    td_oopts oo;
+    td_oopts_parse(opts, &oo);
+    FilePathValue(path);
+    td_call c = { .db = idb, .smode = oo.snapshot ? IDBOREADER | IDBONOLCK : NUM2INT(omode) };
+    c.str = td_strdup(path);
+    td_nogvl(idb_open_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    xfree(c.str);
+    IDB_CHK(c.ok);
+    tdb->snapshot = oo.snapshot;
+    if (oo.prefetch)
+        td_snapshot_prefetch(path, oo.prefetch);
+    if (oo.rank)
+        td_rank_attach(tdb, path, c.smode);
+    if (oo.async && !tdb->writer)
+        td_writer_start(tdb, oo.interval, oo.max_pending,
+                        idb_wapply, idb_wsync, idb_ecode, tcidberrmsg);
+    return obj;
+}
+
+static void *idb_close_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidbclose(c->db);
+    return NULL;
+}
+
+static VALUE idb_close(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    int werror = td_writer_stop(tdb);
+    td_call c = { .db = idb };
+    td_nogvl(idb_close_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    tdb->snapshot = false;
+    td_rank_detach(tdb);
+    if (werror)
+        tc_error(werror, tcidberrmsg(werror));
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static void *idb_put_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidbput(c->db, c->id, c->str);
+    if (c->ok)
+        td_rank_put(c->rank, c->id, c->str);
+    return NULL;
+}
+
+static VALUE idb_put(VALUE obj, VALUE id, VALUE text)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    if (tdb->writer) {
+        uint64_t t0 = td_clock();
+        td_writer_push(tdb->writer, NUM2LL(id), text, false);
+        td_record(tdb, TD_OP_PUT, t0, true);
+        td_record_bytes(tdb, RSTRING_LEN(text));
+        return obj;
+    }
+    td_call c = { .db = idb, .id = NUM2LL(id), .rank = tdb->rank };
+    c.str = td_strdup(text);
+    td_timed(tdb, TD_OP_PUT, idb_put_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    if (c.ok)
+        td_record_bytes(tdb, RSTRING_LEN(text));
+    xfree(c.str);
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static void idb_error(void *db)
+{
+    TCIDB *idb = db;
+    tc_error(tcidbecode(idb), tcidberrmsg(tcidbecode(idb)));
+}
+
+static char *idb_snippet_get(void *db, int64_t id)
+{
+    return tcidbget(db, id);
+}
+
+static uint64_t *idb_rank_search(void *db, const char *word, int smode, int *np)
+{
+    return tcidbsearch(db, word, smode, np);
+}
+
+static uint64_t idb_rank_rnum(void *db)
+{
+    return tcidbrnum(db);
+}
+
+static VALUE idb_search_ranked(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    VALUE query, smode, opts;
+    rb_scan_args(argc, argv, "11:", &query, &smode, &opts);
+    td_db_drain(tdb);
+    VALUE ret = td_ranked_s(tdb, idb_rank_search, idb_snippet_get, idb_rank_rnum, query,
+                            NIL_P(smode) ? IDBSSUBSTR : NUM2INT(smode), opts);
+    IDB_CHK(!NIL_P(ret));
+    return ret;
+}
+
+static VALUE idb_snippets(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    td_db_drain(tdb);
+    return td_snippets_s(tdb->db, idb_snippet_get, idb_ecode, idb_error, argc, argv);
+}
+
+static void *idb_batch_nogvl(void *p)
+{
+    td_batch *b = p;
+    int i;
+    for (i = 0; i < b->num; i++) {
+        if (!tcidbput(b->db, b->ids[i], b->buf + b->offs[i])) {
+            b->ok = false;
+            break;
+        }
+        td_rank_put(b->tdb->rank, b->ids[i], b->buf + b->offs[i]);
+        b->done++;
+    }
+    return NULL;
+}
+
+static VALUE idb_put_batch(VALUE obj, VALUE records)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    td_db_drain(tdb);
+    return td_put_batch(tdb, records, idb_batch_nogvl, idb_error, false, Qnil);
+}
+
+static VALUE idb_import(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    td_db_drain(tdb);
+    return td_import_s(tdb, argc, argv, idb_batch_nogvl, idb_error, false);
+}
+
+static void *idb_out_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidbout(c->db, c->id);
+    if (c->ok)
+        td_rank_out(c->rank, c->id);
+    return NULL;
+}
+
+static VALUE idb_out(VALUE obj, VALUE id)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    if (tdb->writer) {
+        uint64_t t0 = td_clock();
+        td_writer_push(tdb->writer, NUM2LL(id), Qnil, true);
+        td_record(tdb, TD_OP_OUT, t0, true);
+        return obj;
+    }
+    td_call c = { .db = idb, .id = NUM2LL(id), .rank = tdb->rank };
+    td_timed(tdb, TD_OP_OUT, idb_out_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static void *idb_get_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcidbget(c->db, c->id);
+    return NULL;
+}
+
+static VALUE idb_get(VALUE obj, VALUE id)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    td_call c = { .db = idb, .id = NUM2LL(id) };
+    td_nogvl(idb_get_nogvl, &c);
+    if (c.res == NULL && tcidbecode(idb) == TCENOREC)
+        return Qnil;
+    IDB_CHK(c.res);
+    VALUE ret = rb_str_new2(c.res);
+    free(c.res);
+    return ret;
+}
+
+static void *idb_search_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcidbsearch(c->db, c->str, c->smode, &c->np);
+    return NULL;
+}
+
+static uint64_t *idb_search_ids(td_db *tdb, VALUE word, VALUE smode, int *np)
+{
+    TCIDB *idb = tdb->db;
+    td_call c = { .db = idb, .smode = NUM2INT(smode) };
+    c.str = td_strdup(word);
+    uint64_t t0 = td_clock(), gen;
+    if (td_rcache_get(tdb->rcache, 's', c.smode, c.str, (uint64_t **)&c.res, &c.np, &gen)) {
+        xfree(c.str);
+        td_record(tdb, TD_OP_SEARCH, t0, true);
+        td_record_hits(tdb, c.np);
+        *np = c.np;
+        return c.res;
+    }
+    td_nogvl(idb_search_nogvl, &c);
+    td_record(tdb, TD_OP_SEARCH, t0, c.res != NULL);
+    if (c.res) {
+        td_rcache_put(tdb->rcache, 's', c.smode, c.str, c.res, c.np, gen);
+        td_record_hits(tdb, c.np);
+    }
+    xfree(c.str);
+    if (c.res == NULL)
+        tc_error(tcidbecode(idb), tcidberrmsg(tcidbecode(idb)));
+    *np = c.np;
+    return c.res;
+}
+
+static VALUE idb_search(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    int np;
+    uint64_t *idlist = idb_search_ids(tdb, word, smode, &np);
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE idb_search_count(VALUE obj, VALUE word, VALUE smode)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    int np;
+    free(idb_search_ids(tdb, word, smode, &np));
+    return INT2NUM(np);
+}
+
+static VALUE idb_search_any_p(VALUE obj, VALUE word, VALUE smode)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    int np;
+    free(idb_search_ids(tdb, word, smode, &np));
+    return np > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE idb_search_each(int argc, VALUE *argv, VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, argc, argv);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_each e;
+    td_each_parse(opts, &e);
+    int np;
+    uint64_t *idlist = idb_search_ids(tdb, word, smode, &np);
+    td_idlist_each(idlist, np, &e);
+    return obj;
+}
+
+static void *idb_search2_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcidbsearch2(c->db, c->str, &c->np);
+    return NULL;
+}
+
+static uint64_t *idb_search2_ids(td_db *tdb, VALUE expr, int *np)
+{
+    TCIDB *idb = tdb->db;
+    td_call c = { .db = idb };
+    c.str = td_strdup(expr);
+    uint64_t t0 = td_clock(), gen;
+    if (td_rcache_get(tdb->rcache, '2', c.smode, c.str, (uint64_t **)&c.res, &c.np, &gen)) {
+        xfree(c.str);
+        td_record(tdb, TD_OP_SEARCH2, t0, true);
+        td_record_hits(tdb, c.np);
+        *np = c.np;
+        return c.res;
+    }
+    td_nogvl(idb_search2_nogvl, &c);
+    td_record(tdb, TD_OP_SEARCH2, t0, c.res != NULL);
+    if (c.res) {
+        td_rcache_put(tdb->rcache, '2', c.smode, c.str, c.res, c.np, gen);
+        td_record_hits(tdb, c.np);
+    }
+    xfree(c.str);
+    if (c.res == NULL)
+        tc_error(tcidbecode(idb), tcidberrmsg(tcidbecode(idb)));
+    *np = c.np;
+    return c.res;
+}
+
+static VALUE idb_search2(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    VALUE expr, opts;
+    rb_scan_args(argc, argv, "1:", &expr, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    int np;
+    uint64_t *idlist = idb_search2_ids(tdb, expr, &np);
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE idb_search2_count(VALUE obj, VALUE expr)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    int np;
+    free(idb_search2_ids(tdb, expr, &np));
+    return INT2NUM(np);
+}
+
+static VALUE idb_search2_any_p(VALUE obj, VALUE expr)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    int np;
+    free(idb_search2_ids(tdb, expr, &np));
+    return np > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE idb_search2_each(int argc, VALUE *argv, VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, argc, argv);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    VALUE expr, opts;
+    rb_scan_args(argc, argv, "1:", &expr, &opts);
+    td_each e;
+    td_each_parse(opts, &e);
+    int np;
+    uint64_t *idlist = idb_search2_ids(tdb, expr, &np);
+    td_idlist_each(idlist, np, &e);
+    return obj;
+}
+
+static VALUE idb_iterinit(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    IDB_CHK(tcidbiterinit(idb));
+    return obj;
+}
+
+static void *idb_iternext_nogvl(void *p)
+{
+    td_call *c = p;
+    c->id = tcidbiternext(c->db);
+    return NULL;
+}
+
+static VALUE idb_iternext(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    td_call c = { .db = idb };
+    td_nogvl(idb_iternext_nogvl, &c);
+    if (c.id == 0 && tcidbecode(idb) == TCENOREC)
+        return Qnil;
+    IDB_CHK(c.id);
+    return ULL2NUM(c.id);
+}
+
+static void *idb_iter_nogvl(void *p)
+{
+    td_iter *it = p;
+    while (it->num < TD_ITER_BATCH) {
+        uint64_t id = tcidbiternext(it->db);
+        if (id == 0) {
+            it->end = true;
+            it->ok = tcidbecode(it->db) == TCENOREC;
+            break;
+        }
+        if (it->conv) {
+            void *val = tcidbget(it->db, id);
+            if (val == NULL) {
+                if (tcidbecode(it->db) == TCENOREC)
+                    continue;
+                it->ok = false;
+                break;
+            }
+            it->vals[it->num] = val;
+        }
+        it->ids[it->num++] = id;
+    }
+    return NULL;
+}
+
+static VALUE idb_each_id(VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, 0, 0);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    IDB_CHK(tcidbiterinit(idb));
+    td_iterate(idb, idb_iter_nogvl, NULL, NULL, idb_error);
+    return obj;
+}
+
+static VALUE idb_each(VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, 0, 0);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    IDB_CHK(tcidbiterinit(idb));
+    td_iterate(idb, idb_iter_nogvl, td_str, free, idb_error);
+    return obj;
+}
+
+static void *idb_sync_nogvl(void *p)
+{
+    td_call *c = p;
+    td_rank_sync(c->rank);
+    c->ok = tcidbsync(c->db);
+    return NULL;
+}
+
+static VALUE idb_sync(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    td_db_drain(tdb);
+    td_call c = { .db = idb, .rank = tdb->rank };
+    td_timed(tdb, TD_OP_SYNC, idb_sync_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static void *idb_optimize_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidboptimize(c->db);
+    return NULL;
+}
+
+static VALUE idb_optimize(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    td_db_drain(tdb);
+    td_call c = { .db = idb };
+    td_timed(tdb, TD_OP_OPTIMIZE, idb_optimize_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static VALUE idb_optimize_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_OPTIMIZE, idb_optimize_nogvl, idb_ecode, tcidberrmsg);
+}
+
+static VALUE idb_sync_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_SYNC, idb_sync_nogvl, idb_ecode, tcidberrmsg);
+}
+
+static void *idb_vanish_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidbvanish(c->db);
+    if (c->ok)
+        td_rank_vanish(c->rank);
+    return NULL;
+}
+
+static VALUE idb_vanish(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    td_db_drain(tdb);
+    td_call c = { .db = idb, .rank = tdb->rank };
+    td_nogvl(idb_vanish_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static void *idb_copy_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcidbcopy(c->db, c->str);
+    return NULL;
+}
+
+static VALUE idb_copy(VALUE obj, VALUE path)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    td_db_drain(tdb);
+    FilePathValue(path);
+    td_call c = { .db = idb };
+    c.str = td_strdup(path);
+    td_nogvl(idb_copy_nogvl, &c);
+    xfree(c.str);
+    IDB_CHK(c.ok);
+    return obj;
+}
+
+static VALUE idb_path(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    const char *path = tcidbpath(idb);
+    return path ? rb_tainted_str_new2(path) : Qnil;
+}
+
+static VALUE idb_rnum(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    return ULL2NUM(tcidbrnum(idb));
+}
+
+static VALUE idb_fsiz(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &idb_type, tdb);
+    TCIDB *idb = tdb->db;
+    return ULL2NUM(tcidbfsiz(idb));
+}
+
+/* Q-gram */
+
+static void qdb_free(void *p)
+{
+    td_db_free(p);
+}
+
+static const rb_data_type_t qdb_type = {
+    "TokyoDystopia::QDB",
+    { NULL, qdb_free, td_db_memsize, },
+    &td_db_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE qdb_allocate(VALUE klass)
+{
+    td_db *tdb = td_db_new(tcqdbnew(), TD_QDB);
+    tcqdbsetmutex(tdb->db);
+    return TypedData_Wrap_Struct(klass, &qdb_type, tdb);
+}
+
+#define QDB_CHK(x) if (!(x)) tc_error(tcqdbecode(qdb), tcqdberrmsg(tcqdbecode(qdb)))
+
+static VALUE qdb_tune(VALUE obj, VALUE etnum, VALUE opts)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    QDB_CHK(tcqdbtune(qdb, NUM2LL(etnum), NUM2INT(opts)));
+    return obj;
+}
+
+static VALUE qdb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    int64_t size = NUM2LL(icsiz);
+    QDB_CHK(tcqdbsetcache(qdb, size, NUM2LONG(lcnum)));
+    if (size > 0)
+        tdb->icsiz = size;
+    return obj;
+}
+
+static VALUE qdb_setfwmmax(VALUE obj, VALUE fwmmax)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    QDB_CHK(tcqdbsetfwmmax(qdb, NUM2ULONG(fwmmax)));
+    return obj;
+}
+
+static bool qdb_wapply(td_db *tdb, const td_wop *op)
+{
+    if (op->out) {
+        if (!tcqdbout(tdb->db, op->id, op->text))
+            return false;
+        td_rank_out(tdb->rank, op->id);
+    } else {
+        if (!tcqdbput(tdb->db, op->id, op->text))
+            return false;
+        td_rank_put(tdb->rank, op->id, op->text);
+    }
+    return true;
+}
+
+static bool qdb_wsync(td_db *tdb)
+{
+    td_rank_sync(tdb->rank);
+    return tcqdbsync(tdb->db);
+}
+
+static int qdb_ecode(void *db)
+{
+    return tcqdbecode(db);
+}
+
+static void *qdb_open_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdbopen(c->db, c->str, c->smode);
+    return NULL;
+}
+
+static VALUE qdb_open(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    VALUE path, omode, opts;
+    rb_scan_args(argc, argv, "2:", &path, &omode, &opts);
+    td_oopts oo;
+    td_oopts_parse(opts, &oo);
+    FilePathValue(path);
+    td_call c = { .db = qdb, .smode = oo.snapshot ? QDBOREADER | QDBONOLCK : NUM2INT(omode) };
+    c.str = td_strdup(path);
+    td_nogvl(qdb_open_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    xfree(c.str);
+    QDB_CHK(c.ok);
+    tdb->snapshot = oo.snapshot;
+    if (oo.prefetch)
+        td_snapshot_prefetch(path, oo.prefetch);
+    if (oo.rank)
+        td_rank_attach(tdb, path, c.smode);
+    if (oo.async && !tdb->writer)
+        td_writer_start(tdb, oo.interval, oo.max_pending,
+                        qdb_wapply, qdb_wsync, qdb_ecode, tcqdberrmsg);
+    return obj;
+}
+
+static void *qdb_close_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdbclose(c->db);
+    return NULL;
+}
+
+static VALUE qdb_close(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    int werror = td_writer_stop(tdb);
+    td_call c = { .db = qdb };
+    td_nogvl(qdb_close_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    tdb->snapshot = false;
+    td_rank_detach(tdb);
+    if (werror)
+        tc_error(werror, tcqdberrmsg(werror));
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static void *qdb_put_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdbput(c->db, c->id, c->str);
+    if (c->ok)
+        td_rank_put(c->rank, c->id, c->str);
+    return NULL;
+}
+
+static VALUE qdb_put(VALUE obj, VALUE id, VALUE text)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    if (tdb->writer) {
+        uint64_t t0 = td_clock();
+        td_writer_push(tdb->writer, NUM2LL(id), text, false);
+        td_record(tdb, TD_OP_PUT, t0, true);
+        td_record_bytes(tdb, RSTRING_LEN(text));
+        return obj;
+    }
+    td_call c = { .db = qdb, .id = NUM2LL(id), .rank = tdb->rank };
+    c.str = td_strdup(text);
+    td_timed(tdb, TD_OP_PUT, qdb_put_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    if (c.ok)
+        td_record_bytes(tdb, RSTRING_LEN(text));
+    xfree(c.str);
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static void qdb_error(void *db)
+{
+    TCQDB *qdb = db;
+    tc_error(tcqdbecode(qdb), tcqdberrmsg(tcqdbecode(qdb)));
+}
+
+static void *qdb_batch_nogvl(void *p)
+{
+    td_batch *b = p;
+    int i;
+    for (i = 0; i < b->num; i++) {
+        if (!tcqdbput(b->db, b->ids[i], b->buf + b->offs[i])) {
+            b->ok = false;
+            break;
+        }
+        td_rank_put(b->tdb->rank, b->ids[i], b->buf + b->offs[i]);
+        b->done++;
+    }
+    return NULL;
+}
+
+static VALUE qdb_put_batch(VALUE obj, VALUE records)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    td_db_drain(tdb);
+    return td_put_batch(tdb, records, qdb_batch_nogvl, qdb_error, false, Qnil);
+}
+
+static VALUE qdb_import(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    td_db_drain(tdb);
+    return td_import_s(tdb, argc, argv, qdb_batch_nogvl, qdb_error, false);
+}
+
+static void *qdb_out_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdbout(c->db, c->id, c->str);
+    if (c->ok)
+        td_rank_out(c->rank, c->id);
+    return NULL;
+}
+
+static VALUE qdb_out(VALUE obj, VALUE id, VALUE text)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    if (tdb->writer) {
+        uint64_t t0 = td_clock();
+        td_writer_push(tdb->writer, NUM2LL(id), text, true);
+        td_record(tdb, TD_OP_OUT, t0, true);
+        return obj;
+    }
+    td_call c = { .db = qdb, .id = NUM2LL(id), .rank = tdb->rank };
+    c.str = td_strdup(text);
+    td_timed(tdb, TD_OP_OUT, qdb_out_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    xfree(c.str);
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static void *qdb_search_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcqdbsearch(c->db, c->str, c->smode, &c->np);
+    return NULL;
+}
+
+static uint64_t *qdb_search_ids(td_db *tdb, VALUE word, VALUE smode, int *np)
+{
+    TCQDB *qdb = tdb->db;
+    td_call c = { .db = qdb, .smode = NUM2INT(smode) };
+    c.str = td_strdup(word);
+    uint64_t t0 = td_clock(), gen;
+    if (td_rcache_get(tdb->rcache, 's', c.smode, c.str, (uint64_t **)&c.res, &c.np, &gen)) {
+        xfree(c.str);
+        td_record(tdb, TD_OP_SEARCH, t0, true);
+        td_record_hits(tdb, c.np);
+        *np = c.np;
+        return c.res;
+    }
+    td_nogvl(qdb_search_nogvl, &c);
+    td_record(tdb, TD_OP_SEARCH, t0, c.res != NULL);
+    if (c.res) {
+        td_rcache_put(tdb->rcache, 's', c.smode, c.str, c.res, c.np, gen);
+        td_record_hits(tdb, c.np);
+    }
+    xfree(c.str);
+    if (c.res == NULL)
+        tc_error(tcqdbecode(qdb), tcqdberrmsg(tcqdbecode(qdb)));
+    *np = c.np;
+    return c.res;
+}
+
+static VALUE qdb_search(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    int np;
+    uint64_t *idlist = qdb_search_ids(tdb, word, smode, &np);
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE qdb_search_count(VALUE obj, VALUE word, VALUE smode)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    int np;
+    free(qdb_search_ids(tdb, word, smode, &np));
+    return INT2NUM(np);
+}
+
+static VALUE qdb_search_any_p(VALUE obj, VALUE word, VALUE smode)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    int np;
+    free(qdb_search_ids(tdb, word, smode, &np));
+    return np > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE qdb_search_each(int argc, VALUE *argv, VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, argc, argv);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_each e;
+    td_each_parse(opts, &e);
+    int np;
+    uint64_t *idlist = qdb_search_ids(tdb, word, smode, &np);
+    td_idlist_each(idlist, np, &e);
+    return obj;
+}
+
+static uint64_t *qdb_query_search(void *db, const char *word, int smode, int *np)
+{
+    return tcqdbsearch(db, word, smode, np);
+}
+
+static VALUE qdb_query(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    VALUE expr, smode, opts;
+    rb_scan_args(argc, argv, "11:", &expr, &smode, &opts);
+    td_analyzer *an = td_take_analyzer(&opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    int np;
+    uint64_t t0 = td_clock();
+    uint64_t *idlist = td_query_ids(qdb, qdb_query_search, expr,
+                                    NIL_P(smode) ? QDBSSUBSTR : NUM2INT(smode), an,
+                                    td_ropts_need(&ro), &np);
+    td_record(tdb, TD_OP_QUERY, t0, idlist != NULL);
+    if (idlist)
+        td_record_hits(tdb, np);
+    if (idlist == NULL)
+        tc_error(tcqdbecode(qdb), tcqdberrmsg(tcqdbecode(qdb)));
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE qdb_search_ranked(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    VALUE query, smode, opts;
+    rb_scan_args(argc, argv, "11:", &query, &smode, &opts);
+    td_db_drain(tdb);
+    VALUE ret = td_ranked_s(tdb, qdb_query_search, NULL, NULL, query,
+                            NIL_P(smode) ? QDBSSUBSTR : NUM2INT(smode), opts);
+    QDB_CHK(!NIL_P(ret));
+    return ret;
+}
+
+static void *qdb_sync_nogvl(void *p)
+{
+    td_call *c = p;
+    td_rank_sync(c->rank);
+    c->ok = tcqdbsync(c->db);
+    return NULL;
+}
+
+static VALUE qdb_sync(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    td_db_drain(tdb);
+    td_call c = { .db = qdb, .rank = tdb->rank };
+    td_timed(tdb, TD_OP_SYNC, qdb_sync_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static void *qdb_optimize_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdboptimize(c->db);
+    return NULL;
+}
+
+static VALUE qdb_optimize(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    td_db_drain(tdb);
+    td_call c = { .db = qdb };
+    td_timed(tdb, TD_OP_OPTIMIZE, qdb_optimize_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static VALUE qdb_optimize_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_OPTIMIZE, qdb_optimize_nogvl, qdb_ecode, tcqdberrmsg);
+}
+
+static VALUE qdb_sync_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_SYNC, qdb_sync_nogvl, qdb_ecode, tcqdberrmsg);
+}
+
+static void *qdb_vanish_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdbvanish(c->db);
+    if (c->ok)
+        td_rank_vanish(c->rank);
+    return NULL;
+}
+
+static VALUE qdb_vanish(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    td_db_drain(tdb);
+    td_call c = { .db = qdb, .rank = tdb->rank };
+    td_nogvl(qdb_vanish_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static void *qdb_copy_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcqdbcopy(c->db, c->str);
+    return NULL;
+}
+
+static VALUE qdb_copy(VALUE obj, VALUE path)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    td_db_drain(tdb);
+    FilePathValue(path);
+    td_call c = { .db = qdb };
+    c.str = td_strdup(path);
+    td_nogvl(qdb_copy_nogvl, &c);
+    xfree(c.str);
+    QDB_CHK(c.ok);
+    return obj;
+}
+
+static VALUE qdb_path(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    const char *path = tcqdbpath(qdb);
+    return path ? rb_tainted_str_new2(path) : Qnil;
+}
+
+static VALUE qdb_tnum(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    return ULL2NUM(tcqdbtnum(qdb));
+}
+
+static VALUE qdb_fsiz(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &qdb_type, tdb);
+    TCQDB *qdb = tdb->db;
+    return ULL2NUM(tcqdbfsiz(qdb));
+}
+
+/* Simple */
+
+static void jdb_free(void *p)
+{
+    td_db_free(p);
+}
+
+static const rb_data_type_t jdb_type = {
+    "TokyoDystopia::JDB",
+    { NULL, jdb_free, td_db_memsize, },
+    &td_db_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE jdb_allocate(VALUE klass)
+{
+    td_db *tdb = td_db_new(tcjdbnew(), TD_JDB);
+    tcjdbsetmutex(tdb->db);
+    return TypedData_Wrap_Struct(klass, &jdb_type, tdb);
+}
+
+#define JDB_CHK(x) if (!(x)) tc_error(tcjdbecode(jdb), tcjdberrmsg(tcjdbecode(jdb)))
+
+static VALUE jdb_tune(VALUE obj, VALUE ernum, VALUE etnum, VALUE iusiz, VALUE opts)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    JDB_CHK(tcjdbtune(jdb, NUM2LL(ernum), NUM2LL(etnum), NUM2LL(iusiz), NUM2INT(opts)));
+    return obj;
+}
+
+static VALUE jdb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    int64_t size = NUM2LL(icsiz);
+    JDB_CHK(tcjdbsetcache(jdb, size, NUM2INT(lcnum)));
+    if (size > 0)
+        tdb->icsiz = size;
+    return obj;
+}
+
+static VALUE jdb_setfwmmax(VALUE obj, VALUE fwmmax)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    JDB_CHK(tcjdbsetfwmmax(jdb, NUM2ULONG(fwmmax)));
+    return obj;
+}
+
+static int jdb_ecode(void *db)
+{
+    return tcjdbecode(db);
+}
+
+static void *jdb_open_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbopen(c->db, c->str, c->smode);
+    return NULL;
+}
+
+static VALUE jdb_open(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    VALUE path, omode, opts;
+    rb_scan_args(argc, argv, "2:", &path, &omode, &opts);
+    td_oopts oo;
+    td_oopts_parse(opts, &oo);
+    if (oo.async || oo.rank)
+        rb_raise(rb_eArgError, "async_writes and rank_stats are only for IDB and QDB");
+    FilePathValue(path);
+    td_call c = { .db = jdb, .smode = oo.snapshot ? JDBOREADER | JDBONOLCK : NUM2INT(omode) };
+    c.str = td_strdup(path);
+    td_nogvl(jdb_open_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    xfree(c.str);
+    JDB_CHK(c.ok);
+    tdb->snapshot = oo.snapshot;
+    if (oo.prefetch)
+        td_snapshot_prefetch(path, oo.prefetch);
+    return obj;
+}
+
+static void *jdb_close_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbclose(c->db);
+    return NULL;
+}
+
+static VALUE jdb_close(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb };
+    td_nogvl(jdb_close_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    tdb->snapshot = false;
+    JDB_CHK(c.ok);
+    return obj;
+}
+
+static void *jdb_put_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbput(c->db, c->id, c->words);
+    return NULL;
+}
+
+static VALUE jdb_put(VALUE obj, VALUE id, VALUE words)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb, .id = NUM2LL(id) };
+    c.words = td_words(words);
+    td_timed(tdb, TD_OP_PUT, jdb_put_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    if (c.ok)
+        td_record_bytes(tdb, td_words_bytes(c.words));
+    tclistdel(c.words);
+    JDB_CHK(c.ok);
+    return obj;
+}
+
+static void *jdb_put2_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbput2(c->db, c->id, c->str, c->delims);
+    return NULL;
+}
+
+static VALUE jdb_put2(VALUE obj, VALUE id, VALUE text, VALUE delims)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb, .id = NUM2LL(id) };
+    td_analyzer *an = td_analyzer_check(delims);
+    if (an) {
+        c.words = td_analyzer_words(an, text);
+        td_timed(tdb, TD_OP_PUT, jdb_put_nogvl, &c);
+        td_rcache_clear(tdb->rcache);
+        if (c.ok)
+            td_record_bytes(tdb, td_words_bytes(c.words));
+        td_analyzer_release(an, c.words);
+        JDB_CHK(c.ok);
+        return obj;
+    }
+    StringValueCStr(text);
+    StringValueCStr(delims);
+    c.str = td_strdup(text);
+    c.delims = td_strdup(delims);
+    td_timed(tdb, TD_OP_PUT, jdb_put2_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    if (c.ok)
+        td_record_bytes(tdb, RSTRING_LEN(text));
+    xfree(c.str);
+    xfree(c.delims);
+    JDB_CHK(c.ok);
+    return obj;
+}
+
+static void jdb_error(void *db)
+{
+    TCJDB *jdb = db;
+    tc_error(tcjdbecode(jdb), tcjdberrmsg(tcjdbecode(jdb)));
+}
+
+static void *jdb_batch_nogvl(void *p)
+{
+    td_batch *b = p;
+    const char *delims = b->delims ? b->delims : TD_DELIMS;
+    int i;
+    for (i = 0; i < b->num; i++) {
+        bool ok;
+        if (b->wnums[i] < 0) {
+            ok = tcjdbput2(b->db, b->ids[i], b->buf + b->offs[i], delims);
+        } else {
+            td_batch_list(b, i);
+            ok = tcjdbput(b->db, b->ids[i], b->words);
+        }
+        if (!ok) {
+            b->ok = false;
+            break;
+        }
+        b->done++;
+    }
+    return NULL;
+}
+
+static VALUE jdb_put_batch(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    VALUE records, delims;
+    rb_scan_args(argc, argv, "11", &records, &delims);
+    return td_put_batch(tdb, records, jdb_batch_nogvl, jdb_error, true, delims);
+}
+
+static VALUE jdb_import(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    return td_import_s(tdb, argc, argv, jdb_batch_nogvl, jdb_error, true);
+}
+
+static void *jdb_out_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbout(c->db, c->id);
+    return NULL;
+}
+
+static VALUE jdb_out(VALUE obj, VALUE id)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb, .id = NUM2LL(id) };
+    td_timed(tdb, TD_OP_OUT, jdb_out_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    JDB_CHK(c.ok);
+    return obj;
+}
+
+static void *jdb_get_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcjdbget(c->db, c->id);
+    return NULL;
+}
+
+static VALUE jdb_get(VALUE obj, VALUE id)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb, .id = NUM2LL(id) };
+    td_nogvl(jdb_get_nogvl, &c);
+    if (c.res == NULL && tcjdbecode(jdb) == TCENOREC)
+        return Qnil;
+    JDB_CHK(c.res);
+    VALUE ret = td_list(c.res);
+    tclistdel(c.res);
+    return ret;
+}
+
+static void *jdb_get2_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcjdbget2(c->db, c->id);
+    return NULL;
+}
+
+static VALUE jdb_get2(VALUE obj, VALUE id)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb, .id = NUM2LL(id) };
+    td_nogvl(jdb_get2_nogvl, &c);
+    if (c.res == NULL && tcjdbecode(jdb) == TCENOREC)
+        return Qnil;
+    JDB_CHK(c.res);
+    VALUE ret = rb_str_new2(c.res);
+    free(c.res);
+    return ret;
+}
+
+static void *jdb_search_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcjdbsearch(c->db, c->str, c->smode, &c->np);
+    return NULL;
+}
+
+static uint64_t *jdb_search_ids(td_db *tdb, VALUE word, VALUE smode, int *np)
+{
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb, .smode = NUM2INT(smode) };
+    c.str = td_strdup(word);
+    uint64_t t0 = td_clock(), gen;
+    if (td_rcache_get(tdb->rcache, 's', c.smode, c.str, (uint64_t **)&c.res, &c.np, &gen)) {
+        xfree(c.str);
+        td_record(tdb, TD_OP_SEARCH, t0, true);
+        td_record_hits(tdb, c.np);
+        *np = c.np;
+        return c.res;
+    }
+    td_nogvl(jdb_search_nogvl, &c);
+    td_record(tdb, TD_OP_SEARCH, t0, c.res != NULL);
+    if (c.res) {
+        td_rcache_put(tdb->rcache, 's', c.smode, c.str, c.res, c.np, gen);
+        td_record_hits(tdb, c.np);
+    }
+    xfree(c.str);
+    if (c.res == NULL)
+        tc_error(tcjdbecode(jdb), tcjdberrmsg(tcjdbecode(jdb)));
+    *np = c.np;
+    return c.res;
+}
+
+static VALUE jdb_search(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    int np;
+    uint64_t *idlist = jdb_search_ids(tdb, word, smode, &np);
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE jdb_search_count(VALUE obj, VALUE word, VALUE smode)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    int np;
+    free(jdb_search_ids(tdb, word, smode, &np));
+    return INT2NUM(np);
+}
+
+static VALUE jdb_search_any_p(VALUE obj, VALUE word, VALUE smode)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    int np;
+    free(jdb_search_ids(tdb, word, smode, &np));
+    return np > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE jdb_search_each(int argc, VALUE *argv, VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, argc, argv);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_each e;
+    td_each_parse(opts, &e);
+    int np;
+    uint64_t *idlist = jdb_search_ids(tdb, word, smode, &np);
+    td_idlist_each(idlist, np, &e);
+    return obj;
+}
+
+static void *jdb_search2_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcjdbsearch2(c->db, c->str, &c->np);
+    return NULL;
+}
+
+static uint64_t *jdb_search2_ids(td_db *tdb, VALUE expr, int *np)
+{
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb };
+    c.str = td_strdup(expr);
+    uint64_t t0 = td_clock(), gen;
+    if (td_rcache_get(tdb->rcache, '2', c.smode, c.str, (uint64_t **)&c.res, &c.np, &gen)) {
+        xfree(c.str);
+        td_record(tdb, TD_OP_SEARCH2, t0, true);
+        td_record_hits(tdb, c.np);
+        *np = c.np;
+        return c.res;
+    }
+    td_nogvl(jdb_search2_nogvl, &c);
+    td_record(tdb, TD_OP_SEARCH2, t0, c.res != NULL);
+    if (c.res) {
+        td_rcache_put(tdb->rcache, '2', c.smode, c.str, c.res, c.np, gen);
+        td_record_hits(tdb, c.np);
+    }
+    xfree(c.str);
+    if (c.res == NULL)
+        tc_error(tcjdbecode(jdb), tcjdberrmsg(tcjdbecode(jdb)));
+    *np = c.np;
+    return c.res;
+}
+
+static VALUE jdb_search2(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    VALUE expr, opts;
+    rb_scan_args(argc, argv, "1:", &expr, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    int np;
+    uint64_t *idlist = jdb_search2_ids(tdb, expr, &np);
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE jdb_search2_count(VALUE obj, VALUE expr)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    int np;
+    free(jdb_search2_ids(tdb, expr, &np));
+    return INT2NUM(np);
+}
+
+static VALUE jdb_search2_any_p(VALUE obj, VALUE expr)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    int np;
+    free(jdb_search2_ids(tdb, expr, &np));
+    return np > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE jdb_search2_each(int argc, VALUE *argv, VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, argc, argv);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    VALUE expr, opts;
+    rb_scan_args(argc, argv, "1:", &expr, &opts);
+    td_each e;
+    td_each_parse(opts, &e);
+    int np;
+    uint64_t *idlist = jdb_search2_ids(tdb, expr, &np);
+    td_idlist_each(idlist, np, &e);
+    return obj;
+}
+
+static VALUE jdb_iterinit(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    JDB_CHK(tcjdbiterinit(jdb));
+    return obj;
+}
+
+static void *jdb_iternext_nogvl(void *p)
+{
+    td_call *c = p;
+    c->id = tcjdbiternext(c->db);
+    return NULL;
+}
+
+static VALUE jdb_iternext(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb };
+    td_nogvl(jdb_iternext_nogvl, &c);
+    if (c.id == 0 && tcjdbecode(jdb) == TCENOREC)
+        return Qnil;
+    JDB_CHK(c.id);
+    return ULL2NUM(c.id);
+}
+
+static void *jdb_iter_nogvl(void *p)
+{
+    td_iter *it = p;
+    while (it->num < TD_ITER_BATCH) {
+        uint64_t id = tcjdbiternext(it->db);
+        if (id == 0) {
+            it->end = true;
+            it->ok = tcjdbecode(it->db) == TCENOREC;
+            break;
+        }
+        if (it->conv) {
+            void *val = tcjdbget(it->db, id);
+            if (val == NULL) {
+                if (tcjdbecode(it->db) == TCENOREC)
+                    continue;
+                it->ok = false;
+                break;
+            }
+            it->vals[it->num] = val;
+        }
+        it->ids[it->num++] = id;
+    }
+    return NULL;
+}
+
+static VALUE jdb_each_id(VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, 0, 0);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    JDB_CHK(tcjdbiterinit(jdb));
+    td_iterate(jdb, jdb_iter_nogvl, NULL, NULL, jdb_error);
+    return obj;
+}
+
+static VALUE jdb_each(VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, 0, 0);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    JDB_CHK(tcjdbiterinit(jdb));
+    td_iterate(jdb, jdb_iter_nogvl, td_list, td_list_release, jdb_error);
+    return obj;
+}
+
+static void *jdb_sync_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbsync(c->db);
+    return NULL;
+}
+
+static VALUE jdb_sync(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb };
+    td_timed(tdb, TD_OP_SYNC, jdb_sync_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    JDB_CHK(c.ok);
+    return obj;
+}
+
+static void *jdb_optimize_nogvl(void *p)
 {
-    TCIDB *idb = tcidbnew();
-    return Data_Wrap_Struct(klass, NULL, tcidbdel, idb);
+    td_call *c = p;
+    c->ok = tcjdboptimize(c->db);
+    return NULL;
 }
 
-#define IDB_CHK(x) if (!(x)) tc_error(tcidbecode(idb), tcidberrmsg(tcidbecode(idb)))
+static VALUE jdb_optimize(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb };
+    td_timed(tdb, TD_OP_OPTIMIZE, jdb_optimize_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    JDB_CHK(c.ok);
+    return obj;
+}
 
-static VALUE idb_tune(VALUE obj, VALUE ernum, VALUE etnum, VALUE iusiz, VALUE opts)
+static VALUE jdb_optimize_async(VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbtune(idb, NUM2LL(ernum), NUM2LL(etnum), NUM2LL(iusiz), NUM2INT(opts)));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_OPTIMIZE, jdb_optimize_nogvl, jdb_ecode, tcjdberrmsg);
+}
+
+static VALUE jdb_sync_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_SYNC, jdb_sync_nogvl, jdb_ecode, tcjdberrmsg);
+}
+
+static void *jdb_vanish_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbvanish(c->db);
+    return NULL;
+}
+
+static VALUE jdb_vanish(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    td_call c = { .db = jdb };
+    td_nogvl(jdb_vanish_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    JDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+static void *jdb_copy_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcjdbcopy(c->db, c->str);
+    return NULL;
+}
+
+static VALUE jdb_copy(VALUE obj, VALUE path)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbsetcache(idb, NUL2LL(icsiz), NUL2INT(lcnum)));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    FilePathValue(path);
+    td_call c = { .db = jdb };
+    c.str = td_strdup(path);
+    td_nogvl(jdb_copy_nogvl, &c);
+    xfree(c.str);
+    JDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_setfwmmax(VALUE obj, VALUE fwmmax)
+static VALUE jdb_path(VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbsetfwmmax(idb, NUM2ULONG(fwmmax)));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    const char *path = tcjdbpath(jdb);
+    return path ? rb_tainted_str_new2(path) : Qnil;
+}
+
+static VALUE jdb_rnum(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    return ULL2NUM(tcjdbrnum(jdb));
+}
+
+static VALUE jdb_fsiz(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &jdb_type, tdb);
+    TCJDB *jdb = tdb->db;
+    return ULL2NUM(tcjdbfsiz(jdb));
+}
+
+/* Word */
+
+static void wdb_free(void *p)
+{
+    td_db_free(p);
+}
+
+static const rb_data_type_t wdb_type = {
+    "TokyoDystopia::WDB",
+    { NULL, wdb_free, td_db_memsize, },
+    &td_db_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE wdb_allocate(VALUE klass)
+{
+    td_db *tdb = td_db_new(tcwdbnew(), TD_WDB);
+    tcwdbsetmutex(tdb->db);
+    return TypedData_Wrap_Struct(klass, &wdb_type, tdb);
+}
+
+#define WDB_CHK(x) if (!(x)) tc_error(tcwdbecode(wdb), tcwdberrmsg(tcwdbecode(wdb)))
+
+static VALUE wdb_tune(VALUE obj, VALUE etnum, VALUE opts)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    WDB_CHK(tcwdbtune(wdb, NUM2LL(etnum), NUM2INT(opts)));
+    return obj;
+}
+
+static VALUE wdb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    int64_t size = NUM2LL(icsiz);
+    WDB_CHK(tcwdbsetcache(wdb, size, NUM2INT(lcnum)));
+    if (size > 0)
+        tdb->icsiz = size;
+    return obj;
+}
+
+static VALUE wdb_setfwmmax(VALUE obj, VALUE fwmmax)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    WDB_CHK(tcwdbsetfwmmax(wdb, NUM2ULONG(fwmmax)));
     return obj;
 }
 
-static VALUE idb_open(VALUE obj, VALUE path, VALUE omode)
+static int wdb_ecode(void *db)
+{
+    return tcwdbecode(db);
+}
+
+static void *wdb_open_nogvl(void *p)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
+    td_call *c = p;
+    c->ok = tcwdbopen(c->db, c->str, c->smode);
+    return NULL;
+}
+
+static VALUE wdb_open(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    VALUE path, omode, opts;
+    rb_scan_args(argc, argv, "2:", &path, &omode, &opts);
+    td_oopts oo;
+    td_oopts_parse(opts, &oo);
+    if (oo.async || oo.rank)
+        rb_raise(rb_eArgError, "async_writes and rank_stats are only for IDB and QDB");
     FilePathValue(path);
-    IDB_CHK(tcidbopen(idb, RSTRING_PTR(path), NUM2INT(omode)));
+    td_call c = { .db = wdb, .smode = oo.snapshot ? WDBOREADER | WDBONOLCK : NUM2INT(omode) };
+    c.str = td_strdup(path);
+    td_nogvl(wdb_open_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    xfree(c.str);
+    WDB_CHK(c.ok);
+    tdb->snapshot = oo.snapshot;
+    if (oo.prefetch)
+        td_snapshot_prefetch(path, oo.prefetch);
     return obj;
 }
 
-static VALUE idb_close(VALUE obj)
+static void *wdb_close_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbclose(c->db);
+    return NULL;
+}
+
+static VALUE wdb_close(VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbclose(idb));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb };
+    td_nogvl(wdb_close_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    tdb->snapshot = false;
+    WDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_put(VALUE obj, VALUE id, VALUE text)
+static void *wdb_put_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbput(c->db, c->id, c->words);
+    return NULL;
+}
+
+static VALUE wdb_put(VALUE obj, VALUE id, VALUE words)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbput(idb, NUM2LL(id), StringValueCStr(text)));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb, .id = NUM2LL(id) };
+    c.words = td_words(words);
+    td_timed(tdb, TD_OP_PUT, wdb_put_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    if (c.ok)
+        td_record_bytes(tdb, td_words_bytes(c.words));
+    tclistdel(c.words);
+    WDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_out(VALUE obj, VALUE id)
+static void *wdb_put2_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbput2(c->db, c->id, c->str, c->delims);
+    return NULL;
+}
+
+static VALUE wdb_put2(VALUE obj, VALUE id, VALUE text, VALUE delims)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbout(idb, NUM2LL(id)));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb, .id = NUM2LL(id) };
+    td_analyzer *an = td_analyzer_check(delims);
+    if (an) {
+        c.words = td_analyzer_words(an, text);
+        td_timed(tdb, TD_OP_PUT, wdb_put_nogvl, &c);
+        td_rcache_clear(tdb->rcache);
+        if (c.ok)
+            td_record_bytes(tdb, td_words_bytes(c.words));
+        td_analyzer_release(an, c.words);
+        WDB_CHK(c.ok);
+        return obj;
+    }
+    StringValueCStr(text);
+    StringValueCStr(delims);
+    c.str = td_strdup(text);
+    c.delims = td_strdup(delims);
+    td_timed(tdb, TD_OP_PUT, wdb_put2_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    if (c.ok)
+        td_record_bytes(tdb, RSTRING_LEN(text));
+    xfree(c.str);
+    xfree(c.delims);
+    WDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_get(VALUE obj, VALUE id)
+static void wdb_error(void *db)
+{
+    TCWDB *wdb = db;
+    tc_error(tcwdbecode(wdb), tcwdberrmsg(tcwdbecode(wdb)));
+}
+
+static void *wdb_batch_nogvl(void *p)
+{
+    td_batch *b = p;
+    const char *delims = b->delims ? b->delims : TD_DELIMS;
+    int i;
+    for (i = 0; i < b->num; i++) {
+        bool ok;
+        if (b->wnums[i] < 0) {
+            ok = tcwdbput2(b->db, b->ids[i], b->buf + b->offs[i], delims);
+        } else {
+            td_batch_list(b, i);
+            ok = tcwdbput(b->db, b->ids[i], b->words);
+        }
+        if (!ok) {
+            b->ok = false;
+            break;
+        }
+        b->done++;
+    }
+    return NULL;
+}
+
+static VALUE wdb_put_batch(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    VALUE records, delims;
+    rb_scan_args(argc, argv, "11", &records, &delims);
+    return td_put_batch(tdb, records, wdb_batch_nogvl, wdb_error, true, delims);
+}
+
+static VALUE wdb_import(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    return td_import_s(tdb, argc, argv, wdb_batch_nogvl, wdb_error, true);
+}
+
+static void *wdb_out_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbout(c->db, c->id, c->words);
+    return NULL;
+}
+
+static VALUE wdb_out(VALUE obj, VALUE id, VALUE words)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb, .id = NUM2LL(id) };
+    c.words = td_words(words);
+    td_timed(tdb, TD_OP_OUT, wdb_out_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    tclistdel(c.words);
+    WDB_CHK(c.ok);
+    return obj;
+}
+
+static void *wdb_out2_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbout2(c->db, c->id, c->str, c->delims);
+    return NULL;
+}
+
+static VALUE wdb_out2(VALUE obj, VALUE id, VALUE text, VALUE delims)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbget(idb, NUM2LL(id)));
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb, .id = NUM2LL(id) };
+    td_analyzer *an = td_analyzer_check(delims);
+    if (an) {
+        c.words = td_analyzer_words(an, text);
+        td_timed(tdb, TD_OP_OUT, wdb_out_nogvl, &c);
+        td_rcache_clear(tdb->rcache);
+        td_analyzer_release(an, c.words);
+        WDB_CHK(c.ok);
+        return obj;
+    }
+    StringValueCStr(text);
+    StringValueCStr(delims);
+    c.str = td_strdup(text);
+    c.delims = td_strdup(delims);
+    td_timed(tdb, TD_OP_OUT, wdb_out2_nogvl, &c);
+    td_rcache_clear(tdb->rcache);
+    xfree(c.str);
+    xfree(c.delims);
+    WDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_search(VALUE obj, VALUE word, VALUE smode)
+static void *wdb_search_nogvl(void *p)
+{
+    td_call *c = p;
+    c->res = tcwdbsearch(c->db, c->str, &c->np);
+    return NULL;
+}
+
+static uint64_t *wdb_search_ids(td_db *tdb, VALUE word, int *np)
+{
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb };
+    c.str = td_strdup(word);
+    uint64_t t0 = td_clock(), gen;
+    if (td_rcache_get(tdb->rcache, 's', c.smode, c.str, (uint64_t **)&c.res, &c.np, &gen)) {
+        xfree(c.str);
+        td_record(tdb, TD_OP_SEARCH, t0, true);
+        td_record_hits(tdb, c.np);
+        *np = c.np;
+        return c.res;
+    }
+    td_nogvl(wdb_search_nogvl, &c);
+    td_record(tdb, TD_OP_SEARCH, t0, c.res != NULL);
+    if (c.res) {
+        td_rcache_put(tdb->rcache, 's', c.smode, c.str, c.res, c.np, gen);
+        td_record_hits(tdb, c.np);
+    }
+    xfree(c.str);
+    if (c.res == NULL)
+        tc_error(tcwdbecode(wdb), tcwdberrmsg(tcwdbecode(wdb)));
+    *np = c.np;
+    return c.res;
+}
+
+static VALUE wdb_search(int argc, VALUE *argv, VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    VALUE word, opts;
+    rb_scan_args(argc, argv, "1:", &word, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
     int np;
-    uint64_t *idlist;
-    idlist = tcidbsearch(idb, StringValueCStr(word), NUM2INT(smode), &np);
-    if (idlist == NULL)
-        tc_error(tcidbcode(idb), tcidberrmsg(tcidbecode(idb)));
-    VALUE ret = rb_ary_new2(np);
-    int i;
-    for (i = 0; i < np; i++)
-        rb_ary_push(ret, ULL2NUM(idlist[i]));
-    free(idlist);
-    return ret;
+    uint64_t *idlist = wdb_search_ids(tdb, word, &np);
+    return td_idlist(idlist, np, &ro);
+}
+
+static VALUE wdb_search_count(VALUE obj, VALUE word)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    int np;
+    free(wdb_search_ids(tdb, word, &np));
+    return INT2NUM(np);
+}
+
+static VALUE wdb_search_any_p(VALUE obj, VALUE word)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    int np;
+    free(wdb_search_ids(tdb, word, &np));
+    return np > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE wdb_search_each(int argc, VALUE *argv, VALUE obj)
+{
+    RETURN_ENUMERATOR(obj, argc, argv);
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    VALUE word, opts;
+    rb_scan_args(argc, argv, "1:", &word, &opts);
+    td_each e;
+    td_each_parse(opts, &e);
+    int np;
+    uint64_t *idlist = wdb_search_ids(tdb, word, &np);
+    td_idlist_each(idlist, np, &e);
+    return obj;
 }
 
-static VALUE idb_search2(VALUE obj, VALUE expr)
+static uint64_t *wdb_query_search(void *db, const char *word, int smode, int *np)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
+    return tcwdbsearch(db, word, np);
+}
+
+static VALUE wdb_query(int argc, VALUE *argv, VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    VALUE expr, opts;
+    rb_scan_args(argc, argv, "1:", &expr, &opts);
+    td_analyzer *an = td_take_analyzer(&opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
     int np;
-    uint64_t *idlist;
-    idlist = tcidbsearch2(idb, StringValueCStr(expr), &np);
+    uint64_t t0 = td_clock();
+    uint64_t *idlist = td_query_ids(wdb, wdb_query_search, expr, 0, an, td_ropts_need(&ro), &np);
+    td_record(tdb, TD_OP_QUERY, t0, idlist != NULL);
+    if (idlist)
+        td_record_hits(tdb, np);
     if (idlist == NULL)
-        tc_error(tcidbcode(idb), tcidberrmsg(tcidbecode(idb)));
-    VALUE ret = rb_ary_new2(np);
-    int i;;
-    for (i = 0; i < np; i++)
-        rb_ary_push(ret, ULL2NUM(idlist[i]));
-    free(idlist);
-    return ret;
+        tc_error(tcwdbecode(wdb), tcwdberrmsg(tcwdbecode(wdb)));
+    return td_idlist(idlist, np, &ro);
 }
 
-static VALUE idb_iterinit(VALUE obj)
+static void *wdb_sync_nogvl(void *p)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbiterinit(idb));
+    td_call *c = p;
+    c->ok = tcwdbsync(c->db);
+    return NULL;
+}
+
+static VALUE wdb_sync(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb };
+    td_timed(tdb, TD_OP_SYNC, wdb_sync_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    WDB_CHK(c.ok);
     return obj;
 }
 
-static VALUE idb_iternext(VALUE obj)
+static void *wdb_optimize_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdboptimize(c->db);
+    return NULL;
+}
+
+static VALUE wdb_optimize(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb };
+    td_timed(tdb, TD_OP_OPTIMIZE, wdb_optimize_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    WDB_CHK(c.ok);
+    return obj;
+}
+
+static VALUE wdb_optimize_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_OPTIMIZE, wdb_optimize_nogvl, wdb_ecode, tcwdberrmsg);
+}
+
+static VALUE wdb_sync_async(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    return td_task_start(obj, tdb, TD_OP_SYNC, wdb_sync_nogvl, wdb_ecode, tcwdberrmsg);
+}
+
+static void *wdb_vanish_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbvanish(c->db);
+    return NULL;
+}
+
+static VALUE wdb_vanish(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    td_call c = { .db = wdb };
+    td_nogvl(wdb_vanish_nogvl, &c);
+    if (c.ok)
+        td_db_cache_flushed(tdb);
+    td_rcache_clear(tdb->rcache);
+    WDB_CHK(c.ok);
+    return obj;
+}
+
+static void *wdb_copy_nogvl(void *p)
+{
+    td_call *c = p;
+    c->ok = tcwdbcopy(c->db, c->str);
+    return NULL;
+}
+
+static VALUE wdb_copy(VALUE obj, VALUE path)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    FilePathValue(path);
+    td_call c = { .db = wdb };
+    c.str = td_strdup(path);
+    td_nogvl(wdb_copy_nogvl, &c);
+    xfree(c.str);
+    WDB_CHK(c.ok);
+    return obj;
+}
+
+static VALUE wdb_path(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    const char *path = tcwdbpath(wdb);
+    return path ? rb_tainted_str_new2(path) : Qnil;
+}
+
+static VALUE wdb_tnum(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    return ULL2NUM(tcwdbtnum(wdb));
+}
+
+static VALUE wdb_fsiz(VALUE obj)
+{
+    td_db *tdb;
+    TypedData_Get_Struct(obj, td_db, &wdb_type, tdb);
+    TCWDB *wdb = tdb->db;
+    return ULL2NUM(tcwdbfsiz(wdb));
+}
+
+/* Sharding
+ *
+ * ShardedIDB, ShardedQDB and ShardedJDB spread one logical database over
+ * N handles of the plain class, opened on "path.000", "path.001", ...
+ * Writes and get go to the shard picked by a hash of the ID.  Searches
+ * run on every shard at once on the worker threads.  The hits of each
+ * shard are sorted and disjoint from the others, so one k-way merge gives
+ * the result.  sync and optimize also run on every shard at once.
+ * shards returns the handles for per-shard maintenance.  The shard count
+ * is written to "path.shards" when the database is created, since an ID
+ * hashes to a different shard under another count.  open takes the count
+ * from there unless one was given to new, and raises if the two differ.
+ */
+
+#define TD_SHARDS_DEFAULT 8
+
+typedef struct {
+    void *(*search)(void *);
+    void *(*search2)(void *);    /* NULL for QDB */
+    void *(*sync)(void *);
+    void *(*optimize)(void *);
+    int (*ecode)(void *);
+    const char *(*errmsg)(int);
+} td_shardops;
+
+typedef struct {
+    const td_shardops *ops;
+    int num;
+    VALUE *dbs;
+    bool fixed;                  /* num given to new */
+} td_sharded;
+
+static const td_shardops td_idb_shardops = {
+    idb_search_nogvl, idb_search2_nogvl, idb_sync_nogvl, idb_optimize_nogvl,
+    idb_ecode, tcidberrmsg
+};
+
+static const td_shardops td_qdb_shardops = {
+    qdb_search_nogvl, NULL, qdb_sync_nogvl, qdb_optimize_nogvl,
+    qdb_ecode, tcqdberrmsg
+};
+
+static const td_shardops td_jdb_shardops = {
+    jdb_search_nogvl, jdb_search2_nogvl, jdb_sync_nogvl, jdb_optimize_nogvl,
+    jdb_ecode, tcjdberrmsg
+};
+
+static void sharded_mark(void *p)
+{
+    td_sharded *sh = p;
+    int i;
+    for (i = 0; i < sh->num; i++)
+        rb_gc_mark(sh->dbs[i]);
+}
+
+static void sharded_free(void *p)
+{
+    td_sharded *sh = p;
+    xfree(sh->dbs);
+    xfree(sh);
+}
+
+static size_t sharded_memsize(const void *p)
+{
+    const td_sharded *sh = p;
+    return sizeof(td_sharded) + sh->num * sizeof(VALUE);
+}
+
+static const rb_data_type_t sharded_type = {
+    "TokyoDystopia::Sharded",
+    { sharded_mark, sharded_free, sharded_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE td_sharded_alloc(VALUE klass, const td_shardops *ops)
+{
+    td_sharded *sh = ALLOC(td_sharded);
+    sh->ops = ops;
+    sh->num = 0;
+    sh->dbs = NULL;
+    sh->fixed = false;
+    return TypedData_Wrap_Struct(klass, &sharded_type, sh);
+}
+
+static VALUE sharded_idb_allocate(VALUE klass)
+{
+    return td_sharded_alloc(klass, &td_idb_shardops);
+}
+
+static VALUE sharded_qdb_allocate(VALUE klass)
+{
+    return td_sharded_alloc(klass, &td_qdb_shardops);
+}
+
+static VALUE sharded_jdb_allocate(VALUE klass)
+{
+    return td_sharded_alloc(klass, &td_jdb_shardops);
+}
+
+static td_sharded *td_sharded_get(VALUE obj)
+{
+    td_sharded *sh;
+    TypedData_Get_Struct(obj, td_sharded, &sharded_type, sh);
+    if (!sh->dbs)
+        rb_raise(rb_eArgError, "uninitialized sharded database");
+    return sh;
+}
+
+static VALUE td_shard_klass(const td_shardops *ops)
+{
+    return ops == &td_idb_shardops ? cIDB : ops == &td_qdb_shardops ? cQDB : cJDB;
+}
+
+/* splitmix64 finalizer: consecutive IDs land on different shards. */
+static int td_shard_of(int64_t id, int num)
+{
+    uint64_t z = (uint64_t)id + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (int)(z % (uint64_t)num);
+}
+
+static VALUE sharded_initialize(int argc, VALUE *argv, VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbiternext(idb));
+    td_sharded *sh;
+    TypedData_Get_Struct(obj, td_sharded, &sharded_type, sh);
+    VALUE num;
+    rb_scan_args(argc, argv, "01", &num);
+    int n = NIL_P(num) ? TD_SHARDS_DEFAULT : NUM2INT(num);
+    if (n <= 0 || n > 1000)
+        rb_raise(rb_eArgError, "shard count must be between 1 and 1000");
+    if (sh->dbs)
+        rb_raise(rb_eArgError, "already initialized");
+    VALUE klass = td_shard_klass(sh->ops);
+    VALUE *dbs = ALLOC_N(VALUE, n);
+    int i;
+    for (i = 0; i < n; i++)
+        dbs[i] = Qnil;
+    sh->dbs = dbs;
+    sh->fixed = !NIL_P(num);
+    for (i = 0; i < n; i++) {
+        dbs[i] = rb_class_new_instance(0, NULL, klass);
+        sh->num = i + 1;
+    }
     return obj;
 }
 
-static VALUE idb_sync(VALUE obj)
+/* The count in "path.shards", or 0 if there is no such file. */
+static int td_shards_read(VALUE path)
+{
+    VALUE file = rb_sprintf("%"PRIsVALUE".shards", path);
+    FILE *fp = fopen(StringValueCStr(file), "r");
+    if (!fp) {
+        if (errno == ENOENT)
+            return 0;
+        rb_syserr_fail_str(errno, file);
+    }
+    int n;
+    bool ok = fscanf(fp, "%d", &n) == 1 && n > 0 && n <= 1000;
+    fclose(fp);
+    if (!ok)
+        rb_raise(eMisc, "%"PRIsVALUE": invalid shard count", file);
+    return n;
+}
+
+static void td_shards_write(VALUE path, int n)
+{
+    VALUE file = rb_sprintf("%"PRIsVALUE".shards", path);
+    FILE *fp = fopen(StringValueCStr(file), "w");
+    if (!fp)
+        rb_syserr_fail_str(errno, file);
+    bool ok = fprintf(fp, "%d\n", n) > 0;
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok)
+        rb_syserr_fail_str(errno, file);
+}
+
+/* Take the count of a database written with another one than the default. */
+static void td_sharded_resize(td_sharded *sh, int n)
+{
+    VALUE klass = td_shard_klass(sh->ops);
+    int i;
+    if (n < sh->num) {
+        sh->num = n;
+        return;
+    }
+    REALLOC_N(sh->dbs, VALUE, n);
+    for (i = sh->num; i < n; i++) {
+        sh->dbs[i] = rb_class_new_instance(0, NULL, klass);
+        sh->num = i + 1;
+    }
+}
+
+static VALUE sharded_open(int argc, VALUE *argv, VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbsync(idb));
+    td_sharded *sh = td_sharded_get(obj);
+    VALUE path, omode, opts;
+    rb_scan_args(argc, argv, "2:", &path, &omode, &opts);
+    FilePathValue(path);
+    VALUE klass = td_shard_klass(sh->ops);
+    int mode = NUM2INT(omode);
+    bool trunc = mode & NUM2INT(rb_const_get(klass, rb_intern("TRUNC")));
+    int stored = td_shards_read(path);
+    if (stored && !trunc && stored != sh->num) {
+        if (sh->fixed)
+            rb_raise(rb_eArgError, "%"PRIsVALUE" has %d shards, not %d", path, stored, sh->num);
+        td_sharded_resize(sh, stored);
+    }
+    int i;
+    for (i = 0; i < sh->num; i++) {
+        VALUE args[3];
+        args[0] = rb_sprintf("%"PRIsVALUE".%03d", path, i);
+        args[1] = omode;
+        args[2] = opts;
+        rb_funcallv_kw(sh->dbs[i], rb_intern("open"), NIL_P(opts) ? 2 : 3, args,
+                       NIL_P(opts) ? RB_NO_KEYWORDS : RB_PASS_KEYWORDS);
+    }
+    if ((mode & NUM2INT(rb_const_get(klass, rb_intern("WRITER")))) && (!stored || trunc))
+        td_shards_write(path, sh->num);
     return obj;
 }
 
-static VALUE idb_optimize(VALUE obj)
+static VALUE sharded_close(VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidboptimize(idb));
+    td_sharded *sh = td_sharded_get(obj);
+    int i;
+    for (i = 0; i < sh->num; i++)
+        rb_funcall(sh->dbs[i], rb_intern("close"), 0);
     return obj;
 }
 
-static VALUE idb_vanish(VALUE obj)
+static VALUE sharded_shards(VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    IDB_CHK(tcidbvanish(idb));
-    return obj;
+    td_sharded *sh = td_sharded_get(obj);
+    return rb_ary_new4(sh->num, sh->dbs);
 }
 
-static VALUE idb_copy(VALUE obj, VALUE path)
+static VALUE sharded_shard_for(VALUE obj, VALUE id)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    FilePathValue(path);
-    IDB_CHK(tcidbcopy(idb, RSTRING_PTR(path)));
-    return obj;
+    td_sharded *sh = td_sharded_get(obj);
+    return sh->dbs[td_shard_of(NUM2LL(id), sh->num)];
 }
 
-static VALUE idb_path(VALUE obj)
+/* put, put2, out and get: forward to the shard of the first argument. */
+static VALUE sharded_route(int argc, VALUE *argv, VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    const char *path = tcidbpath(idb);
-    return path ? rb_tainted_str_new2(path) : Qnil;
+    td_sharded *sh = td_sharded_get(obj);
+    if (argc < 1)
+        rb_raise(rb_eArgError, "wrong number of arguments (given 0, expected 1+)");
+    VALUE db = sh->dbs[td_shard_of(NUM2LL(argv[0]), sh->num)];
+    return rb_funcallv(db, rb_frame_this_func(), argc, argv);
 }
 
-static VALUE idb_rnum(VALUE obj)
+/* rnum and fsiz: the sum over every shard. */
+static VALUE sharded_sum(VALUE obj)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    return ULL2NUM(tcidbrnum(idb));
+    td_sharded *sh = td_sharded_get(obj);
+    VALUE sum = INT2FIX(0);
+    int i;
+    for (i = 0; i < sh->num; i++)
+        sum = rb_funcall(sum, '+', 1, rb_funcall(sh->dbs[i], rb_frame_this_func(), 0));
+    return sum;
 }
 
-static VALUE idb_fsiz(VALUE obj)
+typedef struct {
+    td_sharded *sh;
+    VALUE *parts;
+    VALUE delims;
+    long total;
+} td_shbatch;
+
+static void td_shbatch_flush(td_shbatch *b, int i)
 {
-    TCIDB *idb;
-    Data_Get_Struct(obj, TCIDB, idb);
-    return ULL2NUM(tcidbfsiz(idb));
+    VALUE args[2] = { b->parts[i], b->delims };
+    if (RARRAY_LEN(b->parts[i]) == 0)
+        return;
+    b->total += NUM2LONG(rb_funcallv(b->sh->dbs[i], rb_intern("put_batch"),
+                                     NIL_P(b->delims) ? 1 : 2, args));
+    rb_ary_clear(b->parts[i]);
 }
 
-/* Q-gram */
-
-static VALUE qdb_allocate(VALUE klass)
+static VALUE td_shbatch_i(RB_BLOCK_CALL_FUNC_ARGLIST(rec, data))
 {
-    TCQDB *qdb = tcqdbnew();
-    return Data_Wrap_Struct(klass, NULL, tcqdbdel, qdb);
+    td_shbatch *b = (td_shbatch *)data;
+    VALUE pair = argc >= 2 ? rb_ary_new4(2, argv) : rb_convert_type(rec, T_ARRAY, "Array", "to_ary");
+    if (RARRAY_LEN(pair) < 2)
+        rb_raise(rb_eArgError, "records must be [id, text] pairs");
+    int i = td_shard_of(NUM2LL(RARRAY_PTR(pair)[0]), b->sh->num);
+    rb_ary_push(b->parts[i], pair);
+    if (RARRAY_LEN(b->parts[i]) >= TD_BATCH_MAX)
+        td_shbatch_flush(b, i);
+    return Qnil;
 }
 
-#define QDB_CHK(x) if (!(x)) tc_error(tcqdbecode(qdb), tcqdberrmsg(tcqdbecode(qdb)))
-
-static VALUE qdb_tune(VALUE obj, VALUE etnum, VALUE opts)
+/* put_batch(records[, delims]): split records by shard, TD_BATCH_MAX at a time. */
+static VALUE sharded_put_batch(int argc, VALUE *argv, VALUE obj)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbtune(qdb, NUM2LL(etnum), NUM2INT(opts)));
-    return obj;
+    td_sharded *sh = td_sharded_get(obj);
+    VALUE records, delims;
+    rb_scan_args(argc, argv, "11", &records, &delims);
+    VALUE parts = rb_ary_new2(sh->num);
+    int i;
+    for (i = 0; i < sh->num; i++)
+        rb_ary_push(parts, rb_ary_new());
+    td_shbatch b = { sh, RARRAY_PTR(parts), delims, 0 };
+    rb_block_call(records, rb_intern("each"), 0, NULL, td_shbatch_i, (VALUE)&b);
+    for (i = 0; i < sh->num; i++)
+        td_shbatch_flush(&b, i);
+    RB_GC_GUARD(parts);
+    return LONG2NUM(b.total);
 }
 
-static VALUE qdb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+/* Calls of ops->sync or ops->optimize on every shard at once. */
+static void td_sharded_each(td_sharded *sh, void *(*func)(void *), td_call *calls, td_job *jobs)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbsetcache(qdb, NUM2LL(icsiz), NUM2LONG(lcnum)));
-    return obj;
+    int i;
+    for (i = 0; i < sh->num; i++) {
+        td_db *tdb = td_db_get(sh->dbs[i]);
+        td_db_drain(tdb);
+        calls[i].db = tdb->db;
+        jobs[i].func = func;
+        jobs[i].arg = &calls[i];
+    }
+    td_run_jobs(jobs, sh->num);
 }
 
-static VALUE qdb_setfwmmax(VALUE obj, VALUE fwmmax)
+static VALUE td_sharded_maint(VALUE obj, int op)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbsetfwmmax(qdb, NUM2ULONG(fwmmax)));
+    td_sharded *sh = td_sharded_get(obj);
+    td_call *calls = ALLOCA_N(td_call, sh->num);
+    td_job *jobs = ALLOCA_N(td_job, sh->num);
+    MEMZERO(calls, td_call, sh->num);
+    td_sharded_each(sh, op == TD_OP_SYNC ? sh->ops->sync : sh->ops->optimize, calls, jobs);
+    int i;
+    for (i = 0; i < sh->num; i++) {
+        td_db *tdb = td_db_get(sh->dbs[i]);
+        if (calls[i].ok)
+            td_db_cache_flushed(tdb);
+        if (op == TD_OP_OPTIMIZE)
+            td_rcache_clear(tdb->rcache);
+    }
+    for (i = 0; i < sh->num; i++) {
+        if (!calls[i].ok) {
+            int ecode = sh->ops->ecode(calls[i].db);
+            tc_error(ecode, sh->ops->errmsg(ecode));
+        }
+    }
     return obj;
 }
 
-static VALUE qdb_open(VALUE obj, VALUE path, VALUE omode)
+static VALUE sharded_sync(VALUE obj)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    FilePathValue(path);
-    QDB_CHK(tcqdbopen(qdb, RSTRING_PTR(path), NUM2INT(omode)));
-    return obj;
+    return td_sharded_maint(obj, TD_OP_SYNC);
 }
 
-static VALUE qdb_close(VALUE obj)
+static VALUE sharded_optimize(VALUE obj)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbclose(qdb));
-    return obj;
+    return td_sharded_maint(obj, TD_OP_OPTIMIZE);
 }
 
-static VALUE qdb_put(VALUE obj, VALUE id, VALUE text)
+/* Merge num ascending idlists into one of at most max IDs (max < 0: all). */
+static uint64_t *td_kmerge(td_call *calls, int num, long max, int *np)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbput(qdb, NUM2LL(id), StringValueCStr(text)));
-    return obj;
+    long total = 0, n = 0;
+    int i, h = 0;
+    for (i = 0; i < num; i++)
+        total += calls[i].np;
+    if (max >= 0 && max < total)
+        total = max;
+    uint64_t *out = malloc(sizeof(uint64_t) * (total > 0 ? total : 1));
+    int *heap = ALLOCA_N(int, num);
+    int *pos = ALLOCA_N(int, num);
+    if (!out)
+        return NULL;
+#define TD_HEAD(k) (((uint64_t *)calls[heap[k]].res)[pos[heap[k]]])
+    for (i = 0; i < num; i++) {
+        pos[i] = 0;
+        if (calls[i].np > 0) {
+            int k = h++;
+            heap[k] = i;
+            while (k > 0 && TD_HEAD((k - 1) / 2) > TD_HEAD(k)) {
+                int t = heap[k]; heap[k] = heap[(k - 1) / 2]; heap[(k - 1) / 2] = t;
+                k = (k - 1) / 2;
+            }
+        }
+    }
+    while (h > 0 && n < total) {
+        int s = heap[0];
+        uint64_t v = TD_HEAD(0);
+        if (n == 0 || out[n - 1] != v)
+            out[n++] = v;
+        if (++pos[s] == calls[s].np)
+            heap[0] = heap[--h];
+        int k = 0;
+        for (;;) {
+            int l = 2 * k + 1, r = l + 1, m = k;
+            if (l < h && TD_HEAD(l) < TD_HEAD(m))
+                m = l;
+            if (r < h && TD_HEAD(r) < TD_HEAD(m))
+                m = r;
+            if (m == k)
+                break;
+            int t = heap[k]; heap[k] = heap[m]; heap[m] = t;
+            k = m;
+        }
+    }
+#undef TD_HEAD
+    *np = (int)n;
+    return out;
 }
 
-static VALUE qdb_out(VALUE obj, VALUE id, VALUE text)
+/* Search every shard with func at once; calls[i].res must be freed. */
+static void td_sharded_calls(td_sharded *sh, void *(*func)(void *), VALUE word,
+                             int smode, td_call *calls)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbout(qdb, NUM2LL(id), StringValueCStr(text)));
-    return obj;
+    int i, num = sh->num, failed = -1;
+    td_job *jobs = ALLOCA_N(td_job, num);
+    char *str = td_strdup(word);
+    MEMZERO(calls, td_call, num);
+    for (i = 0; i < num; i++) {
+        calls[i].db = td_db_get(sh->dbs[i])->db;
+        calls[i].str = str;
+        calls[i].smode = smode;
+        jobs[i].func = func;
+        jobs[i].arg = &calls[i];
+    }
+    td_run_jobs(jobs, num);
+    xfree(str);
+    for (i = 0; i < num; i++) {
+        if (!calls[i].res)
+            failed = i;
+    }
+    if (failed >= 0) {
+        int ecode = sh->ops->ecode(calls[failed].db);
+        for (i = 0; i < num; i++)
+            free(calls[i].res);
+        tc_error(ecode, sh->ops->errmsg(ecode));
+    }
 }
 
-static VALUE qdb_search(VALUE obj, VALUE word, VALUE smode)
+static uint64_t *td_sharded_search(td_sharded *sh, void *(*func)(void *), VALUE word,
+                                   int smode, long max, int *np)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    int np;
-    uint64_t *idlist;
-    idlist = tcqdbsearch(qdb, StringValueCStr(word), NUM2INT(smode), &np);
-    if (idlist == NULL)
-        tc_error(tcqdbecode(qdb), tcqdberrmsg(tcqdbecode(qdb)));
-    VALUE ret = rb_ary_new2(np);
+    td_call *calls = ALLOCA_N(td_call, sh->num);
     int i;
-    for (i = 0; i < np; i++)
-        rb_ary_push(ret, ULL2NUM(idlist[i]));
-    free(idlist);
-    return ret;
+    td_sharded_calls(sh, func, word, smode, calls);
+    uint64_t *ids = td_kmerge(calls, sh->num, max, np);
+    for (i = 0; i < sh->num; i++)
+        free(calls[i].res);
+    if (!ids)
+        rb_memerror();
+    return ids;
 }
 
-static VALUE qdb_sync(VALUE obj)
+static long td_sharded_count(td_sharded *sh, void *(*func)(void *), VALUE word, int smode)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbsync(qdb));
-    return obj;
+    td_call *calls = ALLOCA_N(td_call, sh->num);
+    long count = 0;
+    int i;
+    td_sharded_calls(sh, func, word, smode, calls);
+    for (i = 0; i < sh->num; i++) {
+        count += calls[i].np;
+        free(calls[i].res);
+    }
+    return count;
 }
 
-static VALUE qdb_optimize(VALUE obj)
+static VALUE sharded_search(int argc, VALUE *argv, VALUE obj)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdboptimize(qdb));
-    return obj;
+    td_sharded *sh = td_sharded_get(obj);
+    VALUE word, smode, opts;
+    rb_scan_args(argc, argv, "2:", &word, &smode, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    StringValueCStr(word);
+    int np;
+    uint64_t *ids = td_sharded_search(sh, sh->ops->search, word, NUM2INT(smode),
+                                      td_ropts_need(&ro), &np);
+    return td_idlist(ids, np, &ro);
 }
 
-static VALUE qdb_vanish(VALUE obj)
+static VALUE sharded_search2(int argc, VALUE *argv, VALUE obj)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    QDB_CHK(tcqdbvanish(qdb));
-    return obj;
+    td_sharded *sh = td_sharded_get(obj);
+    VALUE expr, opts;
+    rb_scan_args(argc, argv, "1:", &expr, &opts);
+    td_ropts ro;
+    td_ropts_parse(opts, &ro);
+    StringValueCStr(expr);
+    int np;
+    uint64_t *ids = td_sharded_search(sh, sh->ops->search2, expr, 0, td_ropts_need(&ro), &np);
+    return td_idlist(ids, np, &ro);
 }
 
-static VALUE qdb_copy(VALUE obj, VALUE path)
+static VALUE sharded_search_count(VALUE obj, VALUE word, VALUE smode)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    FilePathValue(path);
-    QDB_CHK(tcqdbcopy(qdb, RSTRING_PTR(path)));
-    return obj;
+    td_sharded *sh = td_sharded_get(obj);
+    StringValueCStr(word);
+    return LONG2NUM(td_sharded_count(sh, sh->ops->search, word, NUM2INT(smode)));
 }
 
-static VALUE qdb_path(VALUE obj)
+static VALUE sharded_search2_count(VALUE obj, VALUE expr)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    const char *path = tcqdbpath(qdb);
-    return path ? rb_tainted_str_new2(path) : Qnil;
+    td_sharded *sh = td_sharded_get(obj);
+    StringValueCStr(expr);
+    return LONG2NUM(td_sharded_count(sh, sh->ops->search2, expr, 0));
 }
 
-static VALUE qdb_tnum(VALUE obj)
+/* Bulk build
+ *
+ * ShardedIDB.build, ShardedQDB.build and ShardedJDB.build index a whole
+ * corpus at once.  The library cannot merge two indexes, so the build is
+ * only offered where a sharded layout is what gets opened: one handle per
+ * thread on "path.000", "path.001", ..., each record going to the shard
+ * its ID hashes to.  The
+ * calling thread reads the source into td_batch buffers.  Each shard has
+ * its own native thread, which applies full buffers and closes the
+ * handle at the end.  The count goes to "path.shards", from which
+ * ShardedIDB#open and friends take it.
+ */
+
+#define TD_BUILD_DEPTH 2         /* full buffers queued per shard */
+
+typedef struct {
+    void *(*apply)(void *);
+    void *(*close)(void *);
+    int (*ecode)(void *);
+    const char *(*errmsg)(int);
+    bool words;
+} td_buildops;
+
+typedef struct td_build td_build;
+
+typedef struct {
+    td_build *bd;
+    td_db *tdb;
+    void *db;
+    pthread_t thread;
+    bool started;
+    td_batch *queue[TD_BUILD_DEPTH];
+    int qhead;
+    int qnum;
+    td_batch *spare[TD_BUILD_DEPTH + 2];
+    int nspare;
+    td_batch *filling;
+    long done;
+    int error;
+} td_bshard;
+
+struct td_build {
+    const td_buildops *ops;
+    VALUE src;
+    int num;
+    td_bshard *shards;
+    char *delims;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;        /* a buffer queued, or closing */
+    pthread_cond_t space;        /* a buffer applied */
+    bool closing;
+};
+
+static const td_buildops td_idb_buildops = {
+    idb_batch_nogvl, idb_close_nogvl, idb_ecode, tcidberrmsg, false
+};
+
+static const td_buildops td_qdb_buildops = {
+    qdb_batch_nogvl, qdb_close_nogvl, qdb_ecode, tcqdberrmsg, false
+};
+
+static const td_buildops td_jdb_buildops = {
+    jdb_batch_nogvl, jdb_close_nogvl, jdb_ecode, tcjdberrmsg, true
+};
+
+static void *td_build_main(void *p)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    return ULL2NUM(tcqdbtnum(qdb));
+    td_bshard *s = p;
+    td_build *bd = s->bd;
+    pthread_mutex_lock(&bd->mutex);
+    for (;;) {
+        while (s->qnum == 0 && !bd->closing)
+            pthread_cond_wait(&bd->ready, &bd->mutex);
+        if (s->qnum == 0)
+            break;
+        td_batch *b = s->queue[s->qhead];
+        pthread_mutex_unlock(&bd->mutex);
+        b->ok = true;
+        b->done = 0;
+        if (!s->error) {
+            td_gate_enter();
+            bd->ops->apply(b);
+            if (!b->ok)
+                s->error = bd->ops->ecode(s->db);
+            td_gate_leave();
+        }
+        s->done += b->done;
+        b->num = 0;
+        b->len = 0;
+        b->bytes = 0;
+        pthread_mutex_lock(&bd->mutex);
+        s->qhead = (s->qhead + 1) % TD_BUILD_DEPTH;
+        s->qnum--;
+        s->spare[s->nspare++] = b;
+        pthread_cond_broadcast(&bd->space);
+    }
+    pthread_mutex_unlock(&bd->mutex);
+    td_call c = { .db = s->db };
+    td_gate_enter();
+    bd->ops->close(&c);
+    if (!c.ok && !s->error)
+        s->error = bd->ops->ecode(s->db);
+    td_gate_leave();
+    return NULL;
 }
 
-static VALUE qdb_fsiz(VALUE obj)
+static void *td_build_wait_nogvl(void *p)
 {
-    TCQDB *qdb;
-    Data_Get_Struct(obj, TCQDB, qdb);
-    return ULL2NUM(tcqdbfsiz(qdb));
+    td_bshard *s = p;
+    td_build *bd = s->bd;
+    pthread_mutex_lock(&bd->mutex);
+    while (s->qnum == TD_BUILD_DEPTH)
+        pthread_cond_wait(&bd->space, &bd->mutex);
+    pthread_mutex_unlock(&bd->mutex);
+    return NULL;
 }
 
-/* Simple */
-
-static VALUE jdb_allocate(VALUE klass)
+static td_batch *td_build_buffer(td_bshard *s)
 {
-    TCJDB *jdb = tcjdbnew();
-    return Data_Wrap_Struct(klass, NULL, tcjdbdel, jdb);
+    td_batch *b = ALLOC(td_batch);
+    MEMZERO(b, td_batch, 1);
+    b->db = s->db;
+    b->tdb = s->tdb;
+    b->delims = s->bd->delims;
+    if (s->bd->ops->words)
+        b->words = tclistnew();
+    return b;
 }
 
-#define JDB_CHK(x) if (!(x)) tc_error(tcjdbecode(jdb), tcjdberrmsg(tcjdbecode(jdb)))
-
-static VALUE jdb_tune(VALUE obj, VALUE ernum, VALUE etnum, VALUE iusiz, VALUE opts)
+/* Hand the shard's full buffer to its thread and take an empty one. */
+static void td_build_submit(td_bshard *s)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbtune(jdb, NUM2LL(ernum), NUM2LL(etnum), NUM2LL(iusiz), NUM2INT(opts)));
-    return obj;
+    td_build *bd = s->bd;
+    td_nogvl(td_build_wait_nogvl, s);
+    td_batch *b = NULL;
+    pthread_mutex_lock(&bd->mutex);
+    s->queue[(s->qhead + s->qnum) % TD_BUILD_DEPTH] = s->filling;
+    s->qnum++;
+    if (s->nspare > 0)
+        b = s->spare[--s->nspare];
+    pthread_cond_broadcast(&bd->ready);
+    pthread_mutex_unlock(&bd->mutex);
+    s->filling = b ? b : td_build_buffer(s);
 }
 
-static VALUE jdb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+static void td_build_batch_free(td_batch *b)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbsetcache(jdb, NUL2LL(icsiz), NUL2INT(lcnum)));
-    return obj;
+    if (!b)
+        return;
+    xfree(b->buf);
+    if (b->words)
+        tclistdel(b->words);
+    xfree(b);
 }
 
-static VALUE jdb_setfwmmax(VALUE obj, VALUE fwmmax)
+static VALUE td_build_i(RB_BLOCK_CALL_FUNC_ARGLIST(rec, data))
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbsetfwmmax(jdb, NUM2ULONG(fwmmax)));
-    return obj;
+    td_build *bd = (td_build *)data;
+    VALUE id, val;
+    if (argc >= 2) {
+        id = argv[0];
+        val = argv[1];
+    } else {
+        VALUE ary = rb_convert_type(rec, T_ARRAY, "Array", "to_ary");
+        if (RARRAY_LEN(ary) != 2)
+            rb_raise(rb_eArgError, "record must be [id, text]");
+        id = RARRAY_PTR(ary)[0];
+        val = RARRAY_PTR(ary)[1];
+    }
+    int64_t n = NUM2LL(id);
+    td_bshard *s = &bd->shards[td_shard_of(n, bd->num)];
+    td_batch *b = s->filling;
+    b->ids[b->num] = n;
+    if (bd->ops->words)
+        td_batch_words(b, val);
+    else
+        td_batch_text(b, val);
+    b->num++;
+    if (b->num == TD_BATCH_MAX || b->len >= TD_BATCH_BYTES)
+        td_build_submit(s);
+    return Qnil;
 }
 
-static VALUE jdb_open(VALUE obj, VALUE path, VALUE omode)
+static VALUE td_build_run(VALUE data)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    FilePathValue(path);
-    JDB_CHK(tcjdbopen(jdb, RSTRING_PTR(path), NUM2INT(omode)));
-    return obj;
+    td_build *bd = (td_build *)data;
+    int i;
+    for (i = 0; i < bd->num; i++) {
+        td_bshard *s = &bd->shards[i];
+        s->filling = td_build_buffer(s);
+        int err = pthread_create(&s->thread, NULL, td_build_main, s);
+        if (err)
+            rb_syserr_fail(err, "pthread_create");
+        s->started = true;
+    }
+    rb_block_call(bd->src, rb_intern("each"), 0, 0, td_build_i, data);
+    for (i = 0; i < bd->num; i++) {
+        if (bd->shards[i].filling->num > 0)
+            td_build_submit(&bd->shards[i]);
+    }
+    return Qnil;
 }
 
-static VALUE jdb_close(VALUE obj)
+static void *td_build_join_nogvl(void *p)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbclose(jdb));
-    return obj;
+    td_build *bd = p;
+    int i;
+    pthread_mutex_lock(&bd->mutex);
+    bd->closing = true;
+    pthread_cond_broadcast(&bd->ready);
+    pthread_mutex_unlock(&bd->mutex);
+    for (i = 0; i < bd->num; i++) {
+        if (bd->shards[i].started)
+            pthread_join(bd->shards[i].thread, NULL);
+    }
+    return NULL;
 }
 
-static VALUE jdb_put(VALUE obj, VALUE id, VALUE words)
+static VALUE td_build_finish(VALUE data)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    VALUE ary = rb_check_array_type(words);
-    TCLIST *tclist = tclistnew();
-    int i;
-    VALUE *ptr = RARRAY_PTR(ary);
-    for (i = 0; i < RARRAY_LEN(ary); i++) {
-        VALUE s = rb_check_string_type(ptr[i]);
-        tclistpush(tclist, RSTRING_PTR(s), RSTRING_LEN(s));
+    td_build *bd = (td_build *)data;
+    int i, j;
+    td_nogvl(td_build_join_nogvl, bd);
+    for (i = 0; i < bd->num; i++) {
+        td_bshard *s = &bd->shards[i];
+        td_build_batch_free(s->filling);
+        for (j = 0; j < s->nspare; j++)
+            td_build_batch_free(s->spare[j]);
     }
-    JDB_CHK(tcjdbput(jdb, NUM2LL(id), tclist));
-    tclistdel(tclist);
-    return obj;
+    pthread_mutex_destroy(&bd->mutex);
+    pthread_cond_destroy(&bd->ready);
+    pthread_cond_destroy(&bd->space);
+    return Qnil;
 }
 
-static VALUE jdb_put2(VALUE obj, VALUE id, VALUE text, VALUE delims)
+static VALUE td_build_s(int argc, VALUE *argv, VALUE klass, const td_buildops *ops)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbput2(jdb, NUM2LL(id), StringValueCStr(text), StringValueCStr(delims)));
-    return obj;
+    VALUE path, src, opts;
+    rb_scan_args(argc, argv, "2:", &path, &src, &opts);
+    static ID keys[3];
+    VALUE vals[3] = { Qundef, Qundef, Qundef };
+    if (!keys[0]) {
+        keys[0] = rb_intern("threads");
+        keys[1] = rb_intern("omode");
+        keys[2] = rb_intern("delims");
+    }
+    if (!NIL_P(opts))
+        rb_get_kwargs(opts, keys, 0, 3, vals);
+    long n = vals[0] == Qundef || NIL_P(vals[0]) ? sysconf(_SC_NPROCESSORS_ONLN) : NUM2LONG(vals[0]);
+    if (n < 1 || n > 1000)
+        rb_raise(rb_eArgError, "threads must be between 1 and 1000");
+    VALUE omode = vals[1] == Qundef || NIL_P(vals[1]) ?
+        rb_funcall(rb_funcall(rb_const_get(klass, rb_intern("WRITER")), '|', 1,
+                              rb_const_get(klass, rb_intern("CREAT"))),
+                   '|', 1, rb_const_get(klass, rb_intern("TRUNC"))) : vals[1];
+    FilePathValue(path);
+
+    td_build bd;
+    MEMZERO(&bd, td_build, 1);
+    bd.ops = ops;
+    bd.src = src;
+    bd.num = (int)n;
+    bd.shards = ALLOCA_N(td_bshard, n);
+    MEMZERO(bd.shards, td_bshard, n);
+    VALUE delims = vals[2] == Qundef ? Qnil : vals[2];
+    char *dcopy = NIL_P(delims) ? NULL : td_strdup(delims);
+    bd.delims = dcopy;
+    VALUE dbs = rb_ary_new2(n);
+    int i;
+    for (i = 0; i < n; i++) {
+        VALUE db = rb_class_new_instance(0, NULL, klass);
+        rb_ary_push(dbs, db);
+        rb_funcall(db, rb_intern("open"), 2, rb_sprintf("%"PRIsVALUE".%03d", path, i), omode);
+        bd.shards[i].bd = &bd;
+        bd.shards[i].tdb = td_db_get(db);
+        bd.shards[i].db = bd.shards[i].tdb->db;
+    }
+    td_shards_write(path, bd.num);
+    pthread_mutex_init(&bd.mutex, NULL);
+    pthread_cond_init(&bd.ready, NULL);
+    pthread_cond_init(&bd.space, NULL);
+    rb_ensure(td_build_run, (VALUE)&bd, td_build_finish, (VALUE)&bd);
+    xfree(dcopy);
+    RB_GC_GUARD(dbs);
+
+    long total = 0;
+    for (i = 0; i < n; i++)
+        total += bd.shards[i].done;
+    for (i = 0; i < n; i++) {
+        int error = bd.shards[i].error;
+        if (error)
+            tc_error(error, ops->errmsg(error));
+    }
+    return LONG2NUM(total);
 }
 
-static VALUE jdb_out(VALUE obj, VALUE id)
+static VALUE sharded_idb_s_build(int argc, VALUE *argv, VALUE klass)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbout(jdb, NUM2LL(id)));
-    return obj;
+    return td_build_s(argc, argv, cIDB, &td_idb_buildops);
 }
 
-static VALUE jdb_get(VALUE obj, VALUE id)
+static VALUE sharded_qdb_s_build(int argc, VALUE *argv, VALUE klass)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbget(jdb, NUM2LL(id)));
-    return obj;
+    return td_build_s(argc, argv, cQDB, &td_qdb_buildops);
 }
 
-static VALUE jdb_get2(VALUE obj, VALUE id)
+static VALUE sharded_jdb_s_build(int argc, VALUE *argv, VALUE klass)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbget2(jdb, NUM2LL(id)));
-    return obj;
+    return td_build_s(argc, argv, cJDB, &td_jdb_buildops);
 }
 
-static VALUE jdb_search(VALUE obj, VALUE word, VALUE smode)
+/* Reader pool
+ *
+ * A ReaderPool opens size handles of one class on the same files with
+ * READER|NOLCK, each with its own cache, and lends them out through a
+ * lock-free stack of free handle indexes.  The head packs a generation
+ * tag above the index so that a pop racing with a push and a pop cannot
+ * succeed on a stale head.  When none is free, checkout waits on a
+ * ConditionVariable that checkin signals, at most timeout: seconds if
+ * given; both are Ruby's, so a fiber scheduler sees the wait.
+ */
+
+typedef struct {
+    int size;
+    VALUE *dbs;
+    int *next;                   /* index + 1 of the next free handle, 0 at the end */
+    char *lent;
+    uint64_t head;               /* tag << 32 | (index + 1) */
+    VALUE lock;                  /* Mutex and ConditionVariable for waits */
+    VALUE cond;
+    int waiting;                 /* checkouts waiting on cond */
+} td_pool;
+
+static void pool_mark(void *p)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    int np;
-    uint64_t *idlist;
-    idlist = tcjdbsearch(jdb, StringValueCStr(word), NUM2INT(smode), &np);
-    if (idlist == NULL)
-        tc_error(tcjdbcode(jdb), tcjdberrmsg(tcjdbecode(jdb)));
-    VALUE ret = rb_ary_new2(np);
+    td_pool *pool = p;
     int i;
-    for (i = 0; i < np; i++)
-        rb_ary_push(ret, ULL2NUM(idlist[i]));
-    free(idlist);
-    return ret;
+    for (i = 0; i < pool->size; i++)
+        rb_gc_mark(pool->dbs[i]);
+    rb_gc_mark(pool->lock);
+    rb_gc_mark(pool->cond);
 }
 
-static VALUE jdb_search2(VALUE obj, VALUE expr)
+static void pool_free(void *p)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    int np;
-    uint64_t *idlist;
-    idlist = tcjdbsearch2(jdb, StringValueCStr(expr), &np);
-    if (idlist == NULL)
-        tc_error(tcjdbcode(jdb), tcjdberrmsg(tcjdbecode(jdb)));
-    VALUE ret = rb_ary_new2(np);
-    int i;
-    for (i = 0; i < np; i++)
-        rb_ary_push(ret, ULL2NUM(idlist[i]));
-    free(idlist);
-    return ret;
+    td_pool *pool = p;
+    xfree(pool->dbs);
+    xfree(pool->next);
+    xfree(pool->lent);
+    xfree(pool);
 }
 
-static VALUE jdb_iterinit(VALUE obj)
+static size_t pool_memsize(const void *p)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbiterinit(jdb));
-    return obj;
+    const td_pool *pool = p;
+    return sizeof(td_pool) + pool->size * (sizeof(VALUE) + sizeof(*pool->next) + sizeof(*pool->lent));
 }
 
-static VALUE jdb_iternext(VALUE obj)
+static const rb_data_type_t pool_type = {
+    "TokyoDystopia::ReaderPool",
+    { pool_mark, pool_free, pool_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE pool_allocate(VALUE klass)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbiternext(jdb));
-    return obj;
+    td_pool *pool = ALLOC(td_pool);
+    MEMZERO(pool, td_pool, 1);
+    pool->lock = Qnil;
+    pool->cond = Qnil;
+    return TypedData_Wrap_Struct(klass, &pool_type, pool);
 }
 
-static VALUE jdb_sync(VALUE obj)
+static int td_pool_pop(td_pool *pool)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbsync(jdb));
-    return obj;
+    uint64_t old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE), new;
+    uint32_t top;
+    do {
+        top = (uint32_t)old;
+        if (top == 0)
+            return -1;
+        new = ((old >> 32) + 1) << 32 | (uint32_t)pool->next[top - 1];
+    } while (!__atomic_compare_exchange_n(&pool->head, &old, new, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return top - 1;
 }
 
-static VALUE jdb_optimize(VALUE obj)
+static void td_pool_push(td_pool *pool, int i)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdboptimize(jdb));
-    return obj;
+    uint64_t old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE), new;
+    do {
+        pool->next[i] = (uint32_t)old;
+        new = ((old >> 32) + 1) << 32 | (uint32_t)(i + 1);
+    } while (!__atomic_compare_exchange_n(&pool->head, &old, new, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 }
 
-static VALUE jdb_vanish(VALUE obj)
+static td_pool *td_pool_get(VALUE obj)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    JDB_CHK(tcjdbvanish(jdb));
-    return obj;
+    td_pool *pool;
+    TypedData_Get_Struct(obj, td_pool, &pool_type, pool);
+    if (pool->size == 0)
+        rb_raise(eMisc, "reader pool is closed");
+    return pool;
 }
 
-static VALUE jdb_copy(VALUE obj, VALUE path)
+static VALUE pool_initialize(int argc, VALUE *argv, VALUE obj)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    FilePathValue(path);
-    JDB_CHK(tcjdbcopy(jdb, RSTRING_PTR(path)));
+    td_pool *pool;
+    TypedData_Get_Struct(obj, td_pool, &pool_type, pool);
+    VALUE klass, path, opts;
+    rb_scan_args(argc, argv, "2:", &klass, &path, &opts);
+    static ID keys[3];
+    VALUE vals[3];
+    if (!keys[0]) {
+        keys[0] = rb_intern("size");
+        keys[1] = rb_intern("cache");
+        keys[2] = rb_intern("omode");
+    }
+    rb_get_kwargs(NIL_P(opts) ? rb_hash_new() : opts, keys, 0, 3, vals);
+    int size = vals[0] == Qundef ? 4 : NUM2INT(vals[0]);
+    if (size <= 0)
+        rb_raise(rb_eArgError, "size must be positive");
+    if (pool->size)
+        rb_raise(eMisc, "reader pool already open");
+    VALUE omode = INT2NUM(NUM2INT(rb_const_get(klass, rb_intern("READER"))) |
+                          NUM2INT(rb_const_get(klass, rb_intern("NOLCK"))) |
+                          (vals[2] == Qundef ? 0 : NUM2INT(vals[2])));
+    VALUE cache = vals[1] == Qundef ? Qnil : rb_convert_type(vals[1], T_ARRAY, "Array", "to_ary");
+    if (NIL_P(pool->lock)) {
+        pool->lock = rb_mutex_new();
+        pool->cond = rb_class_new_instance(0, NULL, rb_const_get(rb_cThread, rb_intern("ConditionVariable")));
+    }
+    pool->dbs = ALLOC_N(VALUE, size);
+    pool->next = ALLOC_N(int, size);
+    pool->lent = ALLOC_N(char, size);
+    int i;
+    for (i = 0; i < size; i++) {
+        VALUE db = rb_class_new_instance(0, NULL, klass);
+        if (!NIL_P(cache))
+            rb_funcall2(db, rb_intern("setcache"), (int)RARRAY_LEN(cache), RARRAY_PTR(cache));
+        rb_funcall(db, rb_intern("open"), 2, path, omode);
+        pool->dbs[i] = db;
+        pool->lent[i] = 0;
+        pool->size = i + 1;
+        td_pool_push(pool, i);
+    }
     return obj;
 }
 
-static VALUE jdb_path(VALUE obj)
+typedef struct {
+    VALUE obj;
+    double timeout;              /* seconds, or < 0 to wait for good */
+} td_pool_wait;
+
+static VALUE td_pool_cond_wait(VALUE data)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    const char *path = tcjdbpath(jdb);
-    return path ? rb_tainted_str_new2(path) : Qnil;
+    VALUE *args = (VALUE *)data;
+    return rb_funcall(args[0], rb_intern("wait"), 2, args[1], args[2]);
 }
 
-static VALUE jdb_rnum(VALUE obj)
+static VALUE td_pool_broadcast(VALUE cond)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    return ULL2NUM(tcjdbrnum(jdb));
+    return rb_funcall(cond, rb_intern("broadcast"), 0);
 }
 
-static VALUE jdb_fsiz(VALUE obj)
+static VALUE td_pool_wait_locked(VALUE data)
 {
-    TCJDB *jdb;
-    Data_Get_Struct(obj, TCJDB, jdb);
-    return ULL2NUM(tcjdbfsiz(jdb));
+    td_pool_wait *a = (td_pool_wait *)data;
+    double deadline = td_now() + a->timeout;
+    int i;
+    for (;;) {
+        td_pool *pool = td_pool_get(a->obj);
+        if ((i = td_pool_pop(pool)) >= 0)
+            break;
+        VALUE left = Qnil;
+        if (a->timeout >= 0) {
+            double secs = deadline - td_now();
+            if (secs <= 0)
+                rb_raise(eMisc, "no handle available within %g seconds", a->timeout);
+            left = DBL2NUM(secs);
+        }
+        pool->waiting++;
+        int state;
+        VALUE args[3] = { pool->cond, pool->lock, left };
+        rb_protect(td_pool_cond_wait, (VALUE)args, &state);
+        pool->waiting--;
+        if (state)
+            rb_jump_tag(state);
+    }
+    return INT2NUM(i);
 }
 
-/* Word */
+/* Lend a free handle, waiting for one if timeout is nil or positive. */
+static VALUE td_pool_checkout(VALUE obj, VALUE timeout)
+{
+    td_pool *pool = td_pool_get(obj);
+    int i = td_pool_pop(pool);
+    if (i < 0) {
+        td_pool_wait a = { obj, NIL_P(timeout) ? -1 : NUM2DBL(timeout) };
+        if (!NIL_P(timeout) && a.timeout < 0)
+            rb_raise(rb_eArgError, "timeout must not be negative");
+        i = NUM2INT(rb_mutex_synchronize(pool->lock, td_pool_wait_locked, (VALUE)&a));
+        pool = td_pool_get(obj);
+    }
+    pool->lent[i] = 1;
+    return pool->dbs[i];
+}
 
-static VALUE wdb_allocate(VALUE klass)
+static VALUE td_pool_timeout(VALUE opts)
 {
-    TCWDB *wdb = tcwdbnew();
-    return Data_Wrap_Struct(klass, NULL, tcwdbdel, wdb);
+    static ID keys[1];
+    VALUE vals[1];
+    if (NIL_P(opts))
+        return Qnil;
+    if (!keys[0])
+        keys[0] = rb_intern("timeout");
+    rb_get_kwargs(opts, keys, 0, 1, vals);
+    return vals[0] == Qundef ? Qnil : vals[0];
 }
 
-#define WDB_CHK(x) if (!(x)) tc_error(tcwdbecode(wdb), tcwdberrmsg(tcwdbecode(wdb)))
+/* checkout(timeout: nil) */
+static VALUE pool_checkout(int argc, VALUE *argv, VALUE obj)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+    return td_pool_checkout(obj, td_pool_timeout(opts));
+}
 
-static VALUE wdb_tune(VALUE obj, VALUE etnum, VALUE opts)
+static VALUE td_pool_signal(VALUE cond)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbtune(wdb, NUM2LL(etnum), NUM2INT(opts)));
-    return obj;
+    return rb_funcall(cond, rb_intern("signal"), 0);
 }
 
-static VALUE wdb_setcache(VALUE obj, VALUE icsiz, VALUE lcnum)
+static VALUE pool_checkin(VALUE obj, VALUE db)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbsetcache(wdb, NUL2LL(icsiz), NUL2INT(lcnum)));
+    td_pool *pool = td_pool_get(obj);
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->dbs[i] == db) {
+            if (!__atomic_exchange_n(&pool->lent[i], 0, __ATOMIC_ACQ_REL))
+                rb_raise(rb_eArgError, "handle is not checked out");
+            td_pool_push(pool, i);
+            if (pool->waiting)
+                rb_mutex_synchronize(pool->lock, td_pool_signal, pool->cond);
+            return obj;
+        }
+    }
+    rb_raise(rb_eArgError, "handle does not belong to this pool");
     return obj;
 }
 
-static VALUE wdb_setfwmmax(VALUE obj, VALUE fwmmax)
+static VALUE td_pool_yield(VALUE db)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbsetfwmmax(wdb, NUM2ULONG(fwmmax)));
-    return obj;
+    return rb_yield(db);
 }
 
-static VALUE wdb_open(VALUE obj, VALUE path, VALUE omode)
+static VALUE td_pool_return(VALUE args)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    FilePathValue(path);
-    WDB_CHK(tcwdbopen(wdb, RSTRING_PTR(path), NUM2INT(omode)));
-    return obj;
+    return pool_checkin(RARRAY_PTR(args)[0], RARRAY_PTR(args)[1]);
 }
 
-static VALUE wdb_close(VALUE obj)
+/* with(timeout: nil) { |db| ... } */
+static VALUE pool_with(int argc, VALUE *argv, VALUE obj)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbclose(wdb));
-    return obj;
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+    VALUE db = td_pool_checkout(obj, td_pool_timeout(opts));
+    return rb_ensure(td_pool_yield, db, td_pool_return, rb_assoc_new(obj, db));
 }
 
-static VALUE wdb_put(VALUE obj, VALUE id, VALUE words)
+typedef struct {
+    VALUE db;
+    ID mid;
+    int argc;
+    VALUE *argv;
+    VALUE block;
+    int kw;
+} td_pool_call;
+
+static VALUE td_pool_call_run(VALUE data)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    VALUE ary = rb_check_array_type(words);
-    TCLIST *tclist = tclistnew();
-    int i;
-    VALUE *ptr = RARRAY_PTR(ary);
-    for (i = 0; i < RARRAY_LEN(ary); i++) {
-        VALUE s = rb_check_string_type(ptr[i]);
-        tclistpush(tclist, RSTRING_PTR(s), RSTRING_LEN(s));
-    }
-    WDB_CHK(tcwdbput(wdb, NUM2LL(id), tclist));
-    tclistdel(tclist);
-    return obj;
+    td_pool_call *c = (td_pool_call *)data;
+    return rb_funcall_with_block_kw(c->db, c->mid, c->argc, c->argv, c->block, c->kw);
 }
 
-static VALUE wdb_put2(VALUE obj, VALUE id, VALUE text, VALUE delims)
+/* search, search2, query, get, ... on a lent handle. */
+static VALUE pool_delegate(int argc, VALUE *argv, VALUE obj)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbput2(wdb, NUM2LL(id), StringValueCStr(text), StringValueCStr(delims)));
-    return obj;
+    VALUE block = rb_block_given_p() ? rb_block_proc() : Qnil;
+    td_pool_call c = { td_pool_checkout(obj, Qnil), rb_frame_this_func(), argc, argv, block, rb_keyword_given_p() };
+    return rb_ensure(td_pool_call_run, (VALUE)&c, td_pool_return, rb_assoc_new(obj, c.db));
 }
 
-static VALUE wdb_out(VALUE obj, VALUE id, VALUE words)
+static VALUE pool_size(VALUE obj)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    VALUE ary = rb_check_array_type(words);
-    TCLIST *tclist = tclistnew();
-    int i;
-    VALUE *ptr = RARRAY_PTR(ary);
-    for (i = 0; i < RARRAY_LEN(ary); i++) {
-        VALUE s = rb_check_string_type(ptr[i]);
-        tclistpush(tclist, RSTRING_PTR(s), RSTRING_LEN(s));
-    }
-    WDB_CHK(tcwdbout(wdb, NUM2LL(id), tclist));
-    tclistdel(tclist);
-    return obj;
+    return INT2NUM(td_pool_get(obj)->size);
 }
 
-static VALUE wdb_out2(VALUE obj, VALUE id, VALUE text, VALUE delims)
+static VALUE pool_available(VALUE obj)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbout2(wdb, NUM2LL(id), StringValueCStr(text), StringValueCStr(delims)));
-    return obj;
+    td_pool *pool = td_pool_get(obj);
+    int i, n = 0;
+    for (i = 0; i < pool->size; i++)
+        if (!pool->lent[i])
+            n++;
+    return INT2NUM(n);
 }
 
-static VALUE wdb_search(VALUE obj, VALUE word)
+static VALUE pool_close(VALUE obj)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    int np;
-    uint64_t *idlist;
-    idlist = tcwdbsearch(wdb, StringValueCStr(word), &np);
-    if (idlist == NULL)
-        tc_error(tcwdbcode(wdb), tcwdberrmsg(tcwdbecode(wdb)));
-    VALUE ret = rb_ary_new2(np);
+    td_pool *pool = td_pool_get(obj);
     int i;
-    for (i = 0; i < np; i++)
-        rb_ary_push(ret, ULL2NUM(idlist[i]));
-    free(idlist);
-    return ret;
+    for (i = 0; i < pool->size; i++)
+        if (pool->lent[i])
+            rb_raise(eMisc, "reader pool has handles checked out");
+    for (i = 0; i < pool->size; i++)
+        rb_funcall(pool->dbs[i], rb_intern("close"), 0);
+    pool->size = 0;
+    pool->head = 0;
+    /* Waiters wake up to find the pool closed. */
+    if (pool->waiting)
+        rb_mutex_synchronize(pool->lock, td_pool_broadcast, pool->cond);
+    return obj;
 }
 
-static VALUE wdb_sync(VALUE obj)
+/* Forking
+ *
+ * Preforking servers open their indexes once and fork workers that serve
+ * them.  The handles' file descriptors and the library's caches pass to
+ * the children and stay shared copy-on-write, but the threads of the
+ * extension do not: the worker pool, write-behind threads and background
+ * tasks stay in the parent.  fork waits until no library call is in
+ * flight, so neither the library's locks nor the extension's are left
+ * held, and resets in the child what the lost threads owned.
+ *
+ * fork does not wait for background tasks, which may run for minutes.  A
+ * handle with a task running keeps the library's lock in the child, so
+ * the child gets a new, closed handle in its place: open it again to use
+ * it there.  The Task itself raises MiscError in the child.  A call that
+ * a fiber had queued but no worker started is failed the same way in the
+ * child, on a pipe of its own so as not to take the parent's wakeup.
+ *
+ * The worker pool starts again on first use; a handle's writer drops the
+ * writes the parent still had queued, which the parent applies, and
+ * starts a new thread on the next write, or at once on
+ * TokyoDystopia.after_fork.  Only one process should write through a
+ * handle opened before fork; readers, and snapshots in particular, may
+ * be used by all of them.
+ */
+
+static void td_fork_prepare(void)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbsync(wdb));
-    return obj;
+    td_db *tdb;
+    pthread_mutex_lock(&td_gate.mutex);
+    while (td_gate.calls > 0)
+        pthread_cond_wait(&td_gate.idle, &td_gate.mutex);
+    pthread_mutex_lock(&td_workers.mutex);
+    pthread_mutex_lock(&td_task_mutex);
+    for (tdb = td_dbs; tdb; tdb = tdb->next)
+        if (tdb->writer)
+            pthread_mutex_lock(&tdb->writer->mutex);
 }
 
-static VALUE wdb_optimize(VALUE obj)
+static void td_fork_parent(void)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdboptimize(wdb));
-    return obj;
+    td_db *tdb;
+    for (tdb = td_dbs; tdb; tdb = tdb->next)
+        if (tdb->writer)
+            pthread_mutex_unlock(&tdb->writer->mutex);
+    pthread_mutex_unlock(&td_task_mutex);
+    pthread_mutex_unlock(&td_workers.mutex);
+    pthread_mutex_unlock(&td_gate.mutex);
 }
 
-static VALUE wdb_vanish(VALUE obj)
+static void td_writer_forked(td_writer *w)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    WDB_CHK(tcwdbvanish(wdb));
-    return obj;
+    long i;
+    for (i = 0; i < w->num; i++)
+        free(w->queue[i].text);
+    w->num = 0;
+    w->applied = w->synced = w->sync_want = w->queued;
+    w->stop = false;
+    w->lost = true;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
 }
 
-static VALUE wdb_copy(VALUE obj, VALUE path)
+#ifdef TD_FIBER_SCHEDULER
+/* Give each waiting fiber its byte on a new pipe in place of the one it
+ * shares with the parent; a call no worker finished is marked lost. */
+static void td_fjobs_forked(void)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    FilePathValue(path);
-    WDB_CHK(tcwdbcopy(wdb, RSTRING_PTR(path)));
-    return obj;
+    td_fjob *f;
+    char c = 0;
+    for (f = td_workers.fjobs; f; f = f->fnext) {
+        int fds[2];
+        if (pipe(fds) == 0) {
+            dup2(fds[0], f->rfd);
+            dup2(fds[1], f->wfd);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        f->pending = 0;
+        if (!f->finished) {
+            f->lost = true;
+            f->finished = 1;
+        }
+        while (write(f->wfd, &c, 1) < 0 && errno == EINTR)
+            ;
+    }
 }
+#endif
 
-static VALUE wdb_path(VALUE obj)
+/* A handle in place of one a background task still holds in the parent. */
+static void *td_db_forked(int kind)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    const char *path = tcwdbpath(wdb);
-    return path ? rb_tainted_str_new2(path) : Qnil;
+    void *db;
+    switch (kind) {
+      case TD_IDB: db = tcidbnew(); tcidbsetmutex(db); break;
+      case TD_QDB: db = tcqdbnew(); tcqdbsetmutex(db); break;
+      case TD_JDB: db = tcjdbnew(); tcjdbsetmutex(db); break;
+      default: db = tcwdbnew(); tcwdbsetmutex(db); break;
+    }
+    return db;
 }
 
-static VALUE wdb_tnum(VALUE obj)
+/* Only the forking thread lives on: make every lock free and forget the
+ * threads that did not come along. */
+static void td_fork_child(void)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    return ULL2NUM(tcwdbrnum(wdb));
+    td_db *tdb;
+    pthread_mutex_init(&td_gate.mutex, NULL);
+    pthread_cond_init(&td_gate.idle, NULL);
+    td_gate.calls = 0;
+#ifdef TD_FIBER_SCHEDULER
+    td_fjobs_forked();
+#endif
+    pthread_mutex_init(&td_workers.mutex, NULL);
+    pthread_cond_init(&td_workers.work, NULL);
+    pthread_cond_init(&td_workers.done, NULL);
+    td_workers.head = td_workers.tail = NULL;
+    td_workers.nthreads = 0;
+    pthread_mutex_init(&td_task_mutex, NULL);
+    pthread_cond_init(&td_task_cond, NULL);
+    for (tdb = td_dbs; tdb; tdb = tdb->next) {
+        if (tdb->writer)
+            td_writer_forked(tdb->writer);
+        if (tdb->rcache)
+            pthread_mutex_init(&tdb->rcache->mutex, NULL);
+        if (tdb->rank)
+            pthread_mutex_init(&tdb->rank->mutex, NULL);
+        if (tdb->tasks > 0) {
+            /* The old handle and its side store are left alone for good. */
+            tdb->db = td_db_forked(tdb->kind);
+            tdb->rank = NULL;
+            tdb->snapshot = false;
+            tdb->tasks = 0;
+        }
+    }
 }
 
-static VALUE wdb_fsiz(VALUE obj)
+/* Start the writer threads left behind by fork now rather than on the
+ * next write.  Harmless in a process that did not fork. */
+static VALUE td_s_after_fork(VALUE self)
 {
-    TCWDB *wdb;
-    Data_Get_Struct(obj, TCWDB, wdb);
-    return ULL2NUM(tcwdbfsiz(wdb));
+    td_db *tdb;
+    for (tdb = td_dbs; tdb; tdb = tdb->next)
+        if (tdb->writer)
+            td_writer_revive(tdb->writer);
+    return Qnil;
 }
 
 /* Initialize */
@@ -734,7 +8189,7 @@ void Init_tokyodystopia()
     const char *errstr[] = {
         "Success", "ThreadError", "InvlaidError", "NoFileError", "NoPermError",
         "MetaError", "RHeadError", "OpenError", "CloseError", "TruncError",
-        "SyncError", "SeekError", "ReadError", "WriteError", "MmapError",
+        "SyncError", "StatError", "SeekError", "ReadError", "WriteError", "MmapError",
         "LockError", "UnlinkError", "RenameError", "MkdirError", "RmdirError",
         "KeepError", "NoRecError"
     };
@@ -743,6 +8198,47 @@ void Init_tokyodystopia()
     for (i = 0; i < sizeof(errstr)/sizeof(*errstr); i++)
         errors[i] = rb_define_class_under(mTD, errstr[i], eTD);
     eMisc = rb_define_class_under(mTD, "MiscError", eTD);
+    rb_define_module_function(mTD, "stats", td_s_stats, 0);
+    rb_define_module_function(mTD, "reset_stats", td_s_reset_stats, 0);
+    rb_define_module_function(mTD, "after_fork", td_s_after_fork, 0);
+    pthread_atfork(td_fork_prepare, td_fork_parent, td_fork_child);
+
+    /* ID sets */
+
+    cIdSet = rb_define_class_under(mTD, "IdSet", rb_cObject);
+    rb_include_module(cIdSet, rb_mEnumerable);
+    rb_undef_alloc_func(cIdSet);
+    rb_define_singleton_method(cIdSet, "new", idset_s_new, -1);
+    rb_define_method(cIdSet, "size", idset_size, 0);
+    rb_define_method(cIdSet, "length", idset_size, 0);
+    rb_define_method(cIdSet, "empty?", idset_empty_p, 0);
+    rb_define_method(cIdSet, "each", idset_each, 0);
+    rb_define_method(cIdSet, "to_a", idset_to_a, 0);
+    rb_define_method(cIdSet, "to_packed", idset_to_packed, 0);
+    rb_define_method(cIdSet, "include?", idset_include_p, 1);
+    rb_define_method(cIdSet, "|", idset_union, 1);
+    rb_define_method(cIdSet, "&", idset_isect, 1);
+    rb_define_method(cIdSet, "-", idset_diff, 1);
+    rb_define_method(cIdSet, "union", idset_union, 1);
+    rb_define_method(cIdSet, "intersection", idset_isect, 1);
+    rb_define_method(cIdSet, "difference", idset_diff, 1);
+    rb_define_method(cIdSet, "==", idset_eq, 1);
+    rb_define_method(cIdSet, "inspect", idset_inspect, 0);
+
+    /* Analyzers */
+
+    cAnalyzer = rb_define_class_under(mTD, "Analyzer", rb_cObject);
+    rb_define_alloc_func(cAnalyzer, analyzer_alloc);
+    rb_define_method(cAnalyzer, "initialize", analyzer_initialize, -1);
+    rb_define_method(cAnalyzer, "analyze", analyzer_analyze, 1);
+
+    /* Background tasks */
+
+    cTask = rb_define_class_under(mTD, "Task", rb_cObject);
+    rb_undef_alloc_func(cTask);
+    rb_define_method(cTask, "done?", task_done_p, 0);
+    rb_define_method(cTask, "wait", task_wait, -1);
+    rb_define_method(cTask, "progress", task_progress, 0);
 
     /* Core */
 
@@ -770,22 +8266,45 @@ void Init_tokyodystopia()
     rb_define_method(cIDB, "tune", idb_tune, 4);
     rb_define_method(cIDB, "setcache", idb_setcache, 2);
     rb_define_method(cIDB, "setfwmmax",idb_setfwmmax, 1);
-    rb_define_method(cIDB, "open", idb_open, 2);
+    rb_define_method(cIDB, "open", idb_open, -1);
+    rb_define_method(cIDB, "snapshot?", db_snapshot_p, 0);
     rb_define_method(cIDB, "close", idb_close, 0);
     rb_define_method(cIDB, "put", idb_put, 2);
+    rb_define_method(cIDB, "put_batch", idb_put_batch, 1);
+    rb_define_method(cIDB, "import", idb_import, -1);
     rb_define_method(cIDB, "out", idb_out, 1);
     rb_define_method(cIDB, "get", idb_get, 1);
-    rb_define_method(cIDB, "search", idb_search, 2);
-    rb_define_method(cIDB, "search2", idb_search2, 1);
+    rb_define_method(cIDB, "snippets", idb_snippets, -1);
+    rb_define_method(cIDB, "search", idb_search, -1);
+    rb_define_method(cIDB, "search_count", idb_search_count, 2);
+    rb_define_method(cIDB, "search_any?", idb_search_any_p, 2);
+    rb_define_method(cIDB, "search_each", idb_search_each, -1);
+    rb_define_method(cIDB, "search2", idb_search2, -1);
+    rb_define_method(cIDB, "search2_count", idb_search2_count, 1);
+    rb_define_method(cIDB, "search2_any?", idb_search2_any_p, 1);
+    rb_define_method(cIDB, "search2_each", idb_search2_each, -1);
+    rb_define_method(cIDB, "search_ranked", idb_search_ranked, -1);
     rb_define_method(cIDB, "iterinit", idb_iterinit, 0);
     rb_define_method(cIDB, "iternext", idb_iternext, 0);
+    rb_define_method(cIDB, "each", idb_each, 0);
+    rb_define_method(cIDB, "each_id", idb_each_id, 0);
     rb_define_method(cIDB, "sync", idb_sync, 0);
+    rb_define_method(cIDB, "flush", db_flush, 0);
+    rb_define_method(cIDB, "pending", db_pending, 0);
     rb_define_method(cIDB, "optimize", idb_optimize, 0);
+    rb_define_method(cIDB, "optimize_async", idb_optimize_async, 0);
+    rb_define_method(cIDB, "sync_async", idb_sync_async, 0);
     rb_define_method(cIDB, "vanish", idb_vanish, 0);
     rb_define_method(cIDB, "copy", idb_copy, 1);
     rb_define_method(cIDB, "path", idb_path, 0);
     rb_define_method(cIDB, "rnum", idb_rnum, 0);
     rb_define_method(cIDB, "fsiz", idb_fsiz, 0);
+    rb_define_method(cIDB, "enable_result_cache", db_enable_result_cache, -1);
+    rb_define_method(cIDB, "disable_result_cache", db_disable_result_cache, 0);
+    rb_define_method(cIDB, "clear_result_cache", db_clear_result_cache, 0);
+    rb_define_method(cIDB, "result_cache_stats", db_result_cache_stats, 0);
+    rb_define_method(cIDB, "stats", db_stats, 0);
+    rb_define_method(cIDB, "reset_stats", db_reset_stats, 0);
 
     /* Q-gram */
 
@@ -809,18 +8328,36 @@ void Init_tokyodystopia()
     rb_define_method(cQDB, "tune", qdb_tune, 2);
     rb_define_method(cQDB, "setcache", qdb_setcache, 2);
     rb_define_method(cQDB, "setfwmmax", qdb_setfwmmax, 1);
-    rb_define_method(cQDB, "open", qdb_open, 2);
+    rb_define_method(cQDB, "open", qdb_open, -1);
+    rb_define_method(cQDB, "snapshot?", db_snapshot_p, 0);
     rb_define_method(cQDB, "close", qdb_close, 0);
     rb_define_method(cQDB, "put", qdb_put, 2);
+    rb_define_method(cQDB, "put_batch", qdb_put_batch, 1);
+    rb_define_method(cQDB, "import", qdb_import, -1);
     rb_define_method(cQDB, "out", qdb_out, 2);
-    rb_define_method(cQDB, "search", qdb_search, 2);
+    rb_define_method(cQDB, "search", qdb_search, -1);
+    rb_define_method(cQDB, "search_count", qdb_search_count, 2);
+    rb_define_method(cQDB, "search_any?", qdb_search_any_p, 2);
+    rb_define_method(cQDB, "search_each", qdb_search_each, -1);
+    rb_define_method(cQDB, "query", qdb_query, -1);
+    rb_define_method(cQDB, "search_ranked", qdb_search_ranked, -1);
     rb_define_method(cQDB, "sync", qdb_sync, 0);
+    rb_define_method(cQDB, "flush", db_flush, 0);
+    rb_define_method(cQDB, "pending", db_pending, 0);
     rb_define_method(cQDB, "optimize", qdb_optimize, 0);
+    rb_define_method(cQDB, "optimize_async", qdb_optimize_async, 0);
+    rb_define_method(cQDB, "sync_async", qdb_sync_async, 0);
     rb_define_method(cQDB, "vanish", qdb_vanish, 0);
     rb_define_method(cQDB, "copy", qdb_copy, 1);
     rb_define_method(cQDB, "path", qdb_path, 0);
     rb_define_method(cQDB, "tnum", qdb_tnum, 0);
     rb_define_method(cQDB, "fsiz", qdb_fsiz, 0);
+    rb_define_method(cQDB, "enable_result_cache", db_enable_result_cache, -1);
+    rb_define_method(cQDB, "disable_result_cache", db_disable_result_cache, 0);
+    rb_define_method(cQDB, "clear_result_cache", db_clear_result_cache, 0);
+    rb_define_method(cQDB, "result_cache_stats", db_result_cache_stats, 0);
+    rb_define_method(cQDB, "stats", db_stats, 0);
+    rb_define_method(cQDB, "reset_stats", db_reset_stats, 0);
 
     /* Simple */
 
@@ -844,24 +8381,43 @@ void Init_tokyodystopia()
     rb_define_method(cJDB, "tune", jdb_tune, 4);
     rb_define_method(cJDB, "setcache", jdb_setcache, 2);
     rb_define_method(cJDB, "setfwmmax", jdb_setfwmmax, 1);
-    rb_define_method(cJDB, "open", jdb_open, 2);
+    rb_define_method(cJDB, "open", jdb_open, -1);
+    rb_define_method(cJDB, "snapshot?", db_snapshot_p, 0);
     rb_define_method(cJDB, "close", jdb_close, 0);
     rb_define_method(cJDB, "put", jdb_put, 2);
     rb_define_method(cJDB, "put2", jdb_put2, 3);
+    rb_define_method(cJDB, "put_batch", jdb_put_batch, -1);
+    rb_define_method(cJDB, "import", jdb_import, -1);
     rb_define_method(cJDB, "out", jdb_out, 1);
     rb_define_method(cJDB, "get", jdb_get, 1);
     rb_define_method(cJDB, "get2", jdb_get2, 1);
-    rb_define_method(cJDB, "search", jdb_search, 2);
-    rb_define_method(cJDB, "search2", jdb_search2, 1);
+    rb_define_method(cJDB, "search", jdb_search, -1);
+    rb_define_method(cJDB, "search_count", jdb_search_count, 2);
+    rb_define_method(cJDB, "search_any?", jdb_search_any_p, 2);
+    rb_define_method(cJDB, "search_each", jdb_search_each, -1);
+    rb_define_method(cJDB, "search2", jdb_search2, -1);
+    rb_define_method(cJDB, "search2_count", jdb_search2_count, 1);
+    rb_define_method(cJDB, "search2_any?", jdb_search2_any_p, 1);
+    rb_define_method(cJDB, "search2_each", jdb_search2_each, -1);
     rb_define_method(cJDB, "iterinit", jdb_iterinit, 0);
     rb_define_method(cJDB, "iternext", jdb_iternext, 0);
+    rb_define_method(cJDB, "each", jdb_each, 0);
+    rb_define_method(cJDB, "each_id", jdb_each_id, 0);
     rb_define_method(cJDB, "sync", jdb_sync, 0);
     rb_define_method(cJDB, "optimize", jdb_optimize, 0);
+    rb_define_method(cJDB, "optimize_async", jdb_optimize_async, 0);
+    rb_define_method(cJDB, "sync_async", jdb_sync_async, 0);
     rb_define_method(cJDB, "vanish", jdb_vanish, 0);
     rb_define_method(cJDB, "copy", jdb_copy, 1);
     rb_define_method(cJDB, "path", jdb_path, 0);
     rb_define_method(cJDB, "rnum", jdb_rnum, 0);
     rb_define_method(cJDB, "fsiz", jdb_fsiz, 0);
+    rb_define_method(cJDB, "enable_result_cache", db_enable_result_cache, -1);
+    rb_define_method(cJDB, "disable_result_cache", db_disable_result_cache, 0);
+    rb_define_method(cJDB, "clear_result_cache", db_clear_result_cache, 0);
+    rb_define_method(cJDB, "result_cache_stats", db_result_cache_stats, 0);
+    rb_define_method(cJDB, "stats", db_stats, 0);
+    rb_define_method(cJDB, "reset_stats", db_reset_stats, 0);
 
     /* Word */
 
@@ -885,18 +8441,114 @@ void Init_tokyodystopia()
     rb_define_method(cWDB, "tune", wdb_tune, 2);
     rb_define_method(cWDB, "setcache", wdb_setcache, 2);
     rb_define_method(cWDB, "setfwmmax", wdb_setfwmmax, 1);
-    rb_define_method(cWDB, "open", wdb_open, 2);
+    rb_define_method(cWDB, "open", wdb_open, -1);
+    rb_define_method(cWDB, "snapshot?", db_snapshot_p, 0);
     rb_define_method(cWDB, "close", wdb_close, 0);
     rb_define_method(cWDB, "put", wdb_put, 2);
     rb_define_method(cWDB, "put2", wdb_put2, 3);
+    rb_define_method(cWDB, "put_batch", wdb_put_batch, -1);
+    rb_define_method(cWDB, "import", wdb_import, -1);
     rb_define_method(cWDB, "out", wdb_out, 2);
     rb_define_method(cWDB, "out2", wdb_out2, 3);
-    rb_define_method(cWDB, "search", wdb_search, 1);
+    rb_define_method(cWDB, "search", wdb_search, -1);
+    rb_define_method(cWDB, "search_count", wdb_search_count, 1);
+    rb_define_method(cWDB, "search_any?", wdb_search_any_p, 1);
+    rb_define_method(cWDB, "search_each", wdb_search_each, -1);
+    rb_define_method(cWDB, "query", wdb_query, -1);
     rb_define_method(cWDB, "sync", wdb_sync, 0);
     rb_define_method(cWDB, "optimize", wdb_optimize, 0);
+    rb_define_method(cWDB, "optimize_async", wdb_optimize_async, 0);
+    rb_define_method(cWDB, "sync_async", wdb_sync_async, 0);
     rb_define_method(cWDB, "vanish", wdb_vanish, 0);
     rb_define_method(cWDB, "copy", wdb_copy, 1);
     rb_define_method(cWDB, "path", wdb_path, 0);
     rb_define_method(cWDB, "tnum", wdb_tnum, 0);
     rb_define_method(cWDB, "fsiz", wdb_fsiz, 0);
+    rb_define_method(cWDB, "enable_result_cache", db_enable_result_cache, -1);
+    rb_define_method(cWDB, "disable_result_cache", db_disable_result_cache, 0);
+    rb_define_method(cWDB, "clear_result_cache", db_clear_result_cache, 0);
+    rb_define_method(cWDB, "result_cache_stats", db_result_cache_stats, 0);
+    rb_define_method(cWDB, "stats", db_stats, 0);
+    rb_define_method(cWDB, "reset_stats", db_reset_stats, 0);
+
+    /* Sharding */
+
+    cShIDB = rb_define_class_under(mTD, "ShardedIDB", rb_cObject);
+    rb_define_alloc_func(cShIDB, sharded_idb_allocate);
+    rb_define_singleton_method(cShIDB, "build", sharded_idb_s_build, -1);
+    rb_define_method(cShIDB, "initialize", sharded_initialize, -1);
+    rb_define_method(cShIDB, "open", sharded_open, -1);
+    rb_define_method(cShIDB, "close", sharded_close, 0);
+    rb_define_method(cShIDB, "put", sharded_route, -1);
+    rb_define_method(cShIDB, "put_batch", sharded_put_batch, -1);
+    rb_define_method(cShIDB, "out", sharded_route, -1);
+    rb_define_method(cShIDB, "get", sharded_route, -1);
+    rb_define_method(cShIDB, "search", sharded_search, -1);
+    rb_define_method(cShIDB, "search_count", sharded_search_count, 2);
+    rb_define_method(cShIDB, "search2", sharded_search2, -1);
+    rb_define_method(cShIDB, "search2_count", sharded_search2_count, 1);
+    rb_define_method(cShIDB, "sync", sharded_sync, 0);
+    rb_define_method(cShIDB, "optimize", sharded_optimize, 0);
+    rb_define_method(cShIDB, "rnum", sharded_sum, 0);
+    rb_define_method(cShIDB, "fsiz", sharded_sum, 0);
+    rb_define_method(cShIDB, "shards", sharded_shards, 0);
+    rb_define_method(cShIDB, "shard_for", sharded_shard_for, 1);
+
+    cShQDB = rb_define_class_under(mTD, "ShardedQDB", rb_cObject);
+    rb_define_alloc_func(cShQDB, sharded_qdb_allocate);
+    rb_define_singleton_method(cShQDB, "build", sharded_qdb_s_build, -1);
+    rb_define_method(cShQDB, "initialize", sharded_initialize, -1);
+    rb_define_method(cShQDB, "open", sharded_open, -1);
+    rb_define_method(cShQDB, "close", sharded_close, 0);
+    rb_define_method(cShQDB, "put", sharded_route, -1);
+    rb_define_method(cShQDB, "put_batch", sharded_put_batch, -1);
+    rb_define_method(cShQDB, "out", sharded_route, -1);
+    rb_define_method(cShQDB, "search", sharded_search, -1);
+    rb_define_method(cShQDB, "search_count", sharded_search_count, 2);
+    rb_define_method(cShQDB, "sync", sharded_sync, 0);
+    rb_define_method(cShQDB, "optimize", sharded_optimize, 0);
+    rb_define_method(cShQDB, "fsiz", sharded_sum, 0);
+    rb_define_method(cShQDB, "shards", sharded_shards, 0);
+    rb_define_method(cShQDB, "shard_for", sharded_shard_for, 1);
+
+    cShJDB = rb_define_class_under(mTD, "ShardedJDB", rb_cObject);
+    rb_define_alloc_func(cShJDB, sharded_jdb_allocate);
+    rb_define_singleton_method(cShJDB, "build", sharded_jdb_s_build, -1);
+    rb_define_method(cShJDB, "initialize", sharded_initialize, -1);
+    rb_define_method(cShJDB, "open", sharded_open, -1);
+    rb_define_method(cShJDB, "close", sharded_close, 0);
+    rb_define_method(cShJDB, "put", sharded_route, -1);
+    rb_define_method(cShJDB, "put2", sharded_route, -1);
+    rb_define_method(cShJDB, "put_batch", sharded_put_batch, -1);
+    rb_define_method(cShJDB, "out", sharded_route, -1);
+    rb_define_method(cShJDB, "get", sharded_route, -1);
+    rb_define_method(cShJDB, "get2", sharded_route, -1);
+    rb_define_method(cShJDB, "search", sharded_search, -1);
+    rb_define_method(cShJDB, "search_count", sharded_search_count, 2);
+    rb_define_method(cShJDB, "search2", sharded_search2, -1);
+    rb_define_method(cShJDB, "search2_count", sharded_search2_count, 1);
+    rb_define_method(cShJDB, "sync", sharded_sync, 0);
+    rb_define_method(cShJDB, "optimize", sharded_optimize, 0);
+    rb_define_method(cShJDB, "rnum", sharded_sum, 0);
+    rb_define_method(cShJDB, "fsiz", sharded_sum, 0);
+    rb_define_method(cShJDB, "shards", sharded_shards, 0);
+    rb_define_method(cShJDB, "shard_for", sharded_shard_for, 1);
+
+    /* Reader pool */
+
+    cPool = rb_define_class_under(mTD, "ReaderPool", rb_cObject);
+    rb_define_alloc_func(cPool, pool_allocate);
+    rb_define_method(cPool, "initialize", pool_initialize, -1);
+    rb_define_method(cPool, "checkout", pool_checkout, -1);
+    rb_define_method(cPool, "checkin", pool_checkin, 1);
+    rb_define_method(cPool, "with", pool_with, -1);
+    rb_define_method(cPool, "size", pool_size, 0);
+    rb_define_method(cPool, "available", pool_available, 0);
+    rb_define_method(cPool, "close", pool_close, 0);
+    const char *delegated[] = {
+        "search", "search2", "search_count", "search2_count", "search_any?",
+        "search2_any?", "search_each", "search2_each", "query", "get", "get2"
+    };
+    for (i = 0; i < sizeof(delegated)/sizeof(*delegated); i++)
+        rb_define_method(cPool, delegated[i], pool_delegate, -1);
 }